@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "word-distance.h"
+#include "latency.h"
+
+using namespace std;
+
+
+/*
+ * Measures the M-Tree on synthetic and dictionary workloads, with fixed
+ * seeds, and prints one row per workload, node capacity, execution mode and
+ * operation, as CSV or, with --json, as JSON.
+ *
+ * Usage: benchmark [--json] [--size N] [--queries N]
+ *                  [--execution automatic|tree|scan]
+ *
+ * The dictionaries are read from the current directory.
+ */
+
+
+const char* const DICT_FILES[] = { "en.dic", "pt-br.dic" };
+const size_t DIMENSIONS[] = { 2, 8, 32 };
+const size_t MIN_NODE_CAPACITIES[] = { 8, 32 };
+
+enum {
+	SEED = 42,
+	DEFAULT_SIZE = 20000,
+	DEFAULT_QUERIES = 1000,
+	CLUSTERS = 20,
+};
+
+const double CLUSTER_DEVIATION = 0.05;
+
+
+// Counts the calls to the euclidean distance by the writes
+atomic<size_t> vectorDistanceCount(0);
+
+struct CountingEuclideanDistance {
+	template <typename Sequence>
+	double operator()(const Sequence& data1, const Sequence& data2) const {
+		++vectorDistanceCount;
+		return mt::functions::euclidean_distance()(data1, data2);
+	}
+};
+
+typedef vector<double> Vector;
+typedef mt::mtree<Vector> VectorMTree;
+typedef mt::mtree<Vector, CountingEuclideanDistance> CountingVectorMTree;
+
+
+
+struct Measurement {
+	string workload;
+	size_t dimensions;
+	size_t size;
+	size_t minNodeCapacity;
+	string execution;
+	string operation;
+	vector<double> latencies;
+	double seconds;
+	size_t distances;
+	size_t memory;
+
+	double distancesPerOperation() const {
+		return latencies.empty() ? 0 : double(distances) / latencies.size();
+	}
+};
+
+
+
+/*
+ * Runs a workload on M-Trees of each node capacity. The distances computed by
+ * the queries are taken from their statistics. Counting them in the timed
+ * M-Tree would slow it down, and keep it from scanning the data objects, so
+ * the writes are repeated untimed on a CountingMTree, whose distance function
+ * counts its calls in distanceCount.
+ */
+template <typename MTree, typename Data, typename CountingMTree>
+class Benchmark {
+public:
+	typedef function<size_t(const Data&)> PayloadSize;
+
+	Benchmark(const string& workload, size_t dimensions, const string& execution, const atomic<size_t>& distanceCount, PayloadSize payloadSize)
+		: workload(workload), dimensions(dimensions), execution(execution), distanceCount(distanceCount), payloadSize(payloadSize)
+		{}
+
+	void run(const vector<Data>& data, const vector<Data>& queries, typename MTree::distance_function_type distanceFunction, typename CountingMTree::distance_function_type countingDistanceFunction, vector<Measurement>& measurements) {
+		for(size_t minNodeCapacity : MIN_NODE_CAPACITIES) {
+			cerr << workload << " dimensions=" << dimensions << " minNodeCapacity=" << minNodeCapacity << " execution=" << execution << endl;
+			MTree mtree(minNodeCapacity, -1, distanceFunction);
+			mtree.set_execution_mode(executionMode());
+			CountingMTree counting(minNodeCapacity, -1, countingDistanceFunction);
+
+			Measurement add = start("add", data.size(), minNodeCapacity);
+			for(typename vector<Data>::const_iterator i = data.begin(); i != data.end(); ++i) {
+				Stopwatch stopwatch;
+				mtree.add(*i);
+				add.latencies.push_back(stopwatch.nanoseconds());
+			}
+			size_t distancesBegin = distanceCount;
+			for(typename vector<Data>::const_iterator i = data.begin(); i != data.end(); ++i) {
+				counting.add(*i);
+			}
+			add.distances = distanceCount - distancesBegin;
+			size_t memory = mtree.statistics(0, payloadSize).memory.total();
+			finish(add, memory, measurements);
+
+			double range = 0;
+			for(size_t limit : { 1, 10 }) {
+				Measurement knn = start("knn-" + to_string(limit), data.size(), minNodeCapacity);
+				for(typename vector<Data>::const_iterator q = queries.begin(); q != queries.end(); ++q) {
+					double farthest = 0;
+					Stopwatch stopwatch;
+					typename MTree::query query = mtree.get_nearest_by_limit(*q, limit);
+					query.collect_stats();
+					for(typename MTree::query::iterator r = query.begin(); r != query.end(); ++r) {
+						farthest = r->distance;
+					}
+					knn.latencies.push_back(stopwatch.nanoseconds());
+					knn.distances += query.stats().distance_computations;
+					if(limit == 10) {
+						range += farthest;
+					}
+				}
+				finish(knn, memory, measurements);
+			}
+
+			// Within the average distance to the 10th nearest neighbor
+			range /= queries.size();
+			Measurement rangeQuery = start("range", data.size(), minNodeCapacity);
+			for(typename vector<Data>::const_iterator q = queries.begin(); q != queries.end(); ++q) {
+				Stopwatch stopwatch;
+				typename MTree::query query = mtree.get_nearest_by_range(*q, range);
+				query.collect_stats();
+				for(typename MTree::query::iterator r = query.begin(); r != query.end(); ++r) {
+				}
+				rangeQuery.latencies.push_back(stopwatch.nanoseconds());
+				rangeQuery.distances += query.stats().distance_computations;
+			}
+			finish(rangeQuery, memory, measurements);
+
+			Measurement remove = start("remove", data.size(), minNodeCapacity);
+			size_t numRemoves = min(queries.size(), data.size());
+			for(size_t i = 0; i < numRemoves; ++i) {
+				Stopwatch stopwatch;
+				mtree.remove(data[i]);
+				remove.latencies.push_back(stopwatch.nanoseconds());
+			}
+			distancesBegin = distanceCount;
+			for(size_t i = 0; i < numRemoves; ++i) {
+				counting.remove(data[i]);
+			}
+			remove.distances = distanceCount - distancesBegin;
+			finish(remove, mtree.statistics(0, payloadSize).memory.total(), measurements);
+		}
+	}
+
+private:
+	typename MTree::execution_mode executionMode() const {
+		if(execution == "tree") {
+			return MTree::TREE_EXECUTION;
+		} else if(execution == "scan") {
+			return MTree::SCAN_EXECUTION;
+		}
+		return MTree::AUTOMATIC_EXECUTION;
+	}
+
+	Measurement start(const string& operation, size_t size, size_t minNodeCapacity) {
+		Measurement measurement;
+		measurement.workload = workload;
+		measurement.dimensions = dimensions;
+		measurement.size = size;
+		measurement.minNodeCapacity = minNodeCapacity;
+		measurement.execution = execution;
+		measurement.operation = operation;
+		measurement.distances = 0;
+		return measurement;
+	}
+
+	void finish(Measurement& measurement, size_t memory, vector<Measurement>& measurements) {
+		measurement.memory = memory;
+		measurement.seconds = 0;
+		for(vector<double>::const_iterator i = measurement.latencies.begin(); i != measurement.latencies.end(); ++i) {
+			measurement.seconds += *i / 1e9;
+		}
+		sort(measurement.latencies.begin(), measurement.latencies.end());
+		measurements.push_back(measurement);
+	}
+
+	string workload;
+	size_t dimensions;
+	string execution;
+	const atomic<size_t>& distanceCount;
+	PayloadSize payloadSize;
+};
+
+
+
+vector<Vector> uniformVectors(size_t count, size_t dimensions, mt19937& random) {
+	uniform_real_distribution<double> coordinate(0.0, 1.0);
+	vector<Vector> vectors(count, Vector(dimensions));
+	for(size_t i = 0; i < count; ++i) {
+		for(size_t d = 0; d < dimensions; ++d) {
+			vectors[i][d] = coordinate(random);
+		}
+	}
+	return vectors;
+}
+
+vector<Vector> clusteredVectors(size_t count, const vector<Vector>& centers, mt19937& random) {
+	normal_distribution<double> deviation(0.0, CLUSTER_DEVIATION);
+	uniform_int_distribution<size_t> cluster(0, centers.size() - 1);
+	vector<Vector> vectors;
+	for(size_t i = 0; i < count; ++i) {
+		Vector vector = centers[cluster(random)];
+		for(size_t d = 0; d < vector.size(); ++d) {
+			vector[d] += deviation(random);
+		}
+		vectors.push_back(vector);
+	}
+	return vectors;
+}
+
+
+void print(const vector<Measurement>& measurements, bool json) {
+	Report report(json);
+	for(vector<Measurement>::const_iterator m = measurements.begin(); m != measurements.end(); ++m) {
+		report.field("workload",          m->workload)
+		      .field("dimensions",        m->dimensions)
+		      .field("size",              m->size)
+		      .field("min_node_capacity", m->minNodeCapacity)
+		      .field("execution",         m->execution)
+		      .field("operation",         m->operation)
+		      .field("count",             m->latencies.size())
+		      .field("p50_ns",            percentile(m->latencies, 0.50))
+		      .field("p90_ns",            percentile(m->latencies, 0.90))
+		      .field("p99_ns",            percentile(m->latencies, 0.99))
+		      .field("mean_ns",           mean(m->latencies))
+		      .field("throughput_per_s",  throughput(m->latencies.size(), m->seconds))
+		      .field("distances_per_op",  m->distancesPerOperation())
+		      .field("memory_bytes",      m->memory)
+		      .endRow();
+	}
+	report.end();
+}
+
+
+
+
+
+int main(int argc, const char* argv[]) {
+	bool json = false;
+	size_t size = DEFAULT_SIZE;
+	size_t numQueries = DEFAULT_QUERIES;
+	string execution = "automatic";
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "--json") == 0) {
+			json = true;
+		} else if(strcmp(argv[i], "--size") == 0  &&  i + 1 < argc) {
+			size = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--queries") == 0  &&  i + 1 < argc) {
+			numQueries = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--execution") == 0  &&  i + 1 < argc) {
+			execution = argv[++i];
+			if(execution != "automatic"  &&  execution != "tree"  &&  execution != "scan") {
+				cerr << "Unknown execution mode: " << execution << endl;
+				return 1;
+			}
+		} else {
+			cerr << "Usage: " << argv[0] << " [--json] [--size N] [--queries N] [--execution automatic|tree|scan]" << endl;
+			return 1;
+		}
+	}
+
+	vector<Measurement> measurements;
+	auto vectorPayload = [](const Vector& vector) { return vector.capacity() * sizeof(double); };
+
+	for(size_t dimensions : DIMENSIONS) {
+		mt19937 random(SEED);
+		vector<Vector> data = uniformVectors(size, dimensions, random);
+		vector<Vector> queries = uniformVectors(numQueries, dimensions, random);
+		Benchmark<VectorMTree, Vector, CountingVectorMTree>("uniform", dimensions, execution, vectorDistanceCount, vectorPayload)
+			.run(data, queries, mt::functions::euclidean_distance(), CountingEuclideanDistance(), measurements);
+
+		vector<Vector> centers = uniformVectors(CLUSTERS, dimensions, random);
+		data = clusteredVectors(size, centers, random);
+		queries = clusteredVectors(numQueries, centers, random);
+		Benchmark<VectorMTree, Vector, CountingVectorMTree>("clustered", dimensions, execution, vectorDistanceCount, vectorPayload)
+			.run(data, queries, mt::functions::euclidean_distance(), CountingEuclideanDistance(), measurements);
+	}
+
+	for(const char* dictFile : DICT_FILES) {
+		vector<string> words = loadWords(dictFile);
+		if(words.size() < 2) {
+			cerr << "Skipping " << dictFile << ": not found" << endl;
+			continue;
+		}
+
+		// The words which are not indexed are the queries
+		shuffle(words.begin(), words.end(), mt19937(SEED));
+		size_t numWords = min(size, words.size() / 2);
+		vector<string> data(words.begin(), words.begin() + numWords);
+		vector<string> queries(words.begin() + numWords, words.begin() + min(numWords + numQueries, words.size()));
+		Benchmark<MTree, string, MTree>(dictFile, 0, execution, wordDistanceCount, wordPayloadSize)
+			.run(data, queries, wordDistance, countingWordDistance, measurements);
+	}
+
+	print(measurements, json);
+}
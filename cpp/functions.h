@@ -3,6 +3,9 @@
 
 
 #include <ext/algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
 #include <iterator>
 #include <set>
 #include <utility>
@@ -31,7 +34,7 @@ struct euclidean_distance {
 			double diff = *i1 - *i2;
 			distance += diff * diff;
 		}
-		distance = sqrt(distance);
+		distance = std::sqrt(distance);
 		return distance;
 	}
 };
@@ -53,7 +56,7 @@ struct random_promotion {
 	template <typename Data, typename DistanceFunction>
 	std::pair<Data, Data> operator()(const std::set<Data>& data_objects, DistanceFunction& distance_function) const {
 		std::vector<Data> promoted;
-		random_sample_n(data_objects.begin(), data_objects.end(), inserter(promoted, promoted.begin()), 2);
+		__gnu_cxx::random_sample_n(data_objects.begin(), data_objects.end(), inserter(promoted, promoted.begin()), 2);
 		assert(promoted.size() == 2);
 		return {promoted[0], promoted[1]};
 	}
@@ -61,6 +64,57 @@ struct random_promotion {
 
 
 
+/**
+ * @brief A promotion function object which chooses two data objects far from
+ *        each other as promoted.
+ * @details Starting from the first data object, it promotes the data object
+ *          farthest from it, and then the data object farthest from the
+ *          latter. This takes a linear number of distance computations, instead
+ *          of the quadratic number needed to find the actual farthest pair.
+ */
+struct farthest_pair_promotion {
+	/**
+	 * @brief  The operator that performs the promotion.
+	 * @tparam Data The type of the data objects.
+	 * @tparam DistanceFunction The type of the function or function object used
+	 *         to calculate the distance between two Data objects.
+	 * @return A pair with the promoted data objects.
+	 */
+	template <typename Data, typename DistanceFunction>
+	std::pair<Data, Data> operator()(const std::set<Data>& data_objects, DistanceFunction& distance_function) const {
+		assert(data_objects.size() >= 2);
+		typename std::set<Data>::const_iterator first = farthest(data_objects, *data_objects.begin(), data_objects.end(), distance_function);
+		typename std::set<Data>::const_iterator second = farthest(data_objects, *first, first, distance_function);
+		return {*first, *second};
+	}
+
+private:
+	template <typename Data, typename DistanceFunction>
+	static typename std::set<Data>::const_iterator farthest(
+				const std::set<Data>& data_objects,
+				const Data& data,
+				typename std::set<Data>::const_iterator excluded,
+				DistanceFunction& distance_function
+			)
+	{
+		typename std::set<Data>::const_iterator farthest = data_objects.end();
+		double farthestDistance = -1;
+		for(typename std::set<Data>::const_iterator i = data_objects.begin(); i != data_objects.end(); ++i) {
+			if(i == excluded) {
+				continue;
+			}
+			double distance = distance_function(*i, data);
+			if(distance > farthestDistance) {
+				farthest = i;
+				farthestDistance = distance;
+			}
+		}
+		return farthest;
+	}
+};
+
+
+
 /**
  * @brief A partition function object which equally distributes the data objects
  *        according to their distances to the promoted data objects.
@@ -214,39 +268,123 @@ struct split_function {
 
 
 
+/**
+ * @brief A partition function object which assigns data objects to the shards
+ *        of a ::mt::mtree_forest by their hash values.
+ * @details Uses @c std::hash, which must be defined for the data objects.
+ */
+struct hash_partition {
+	/**
+	 * @brief The operator that assigns a data object to a shard.
+	 * @tparam Data The type of the data objects.
+	 * @return The index of the shard, less than @c num_shards.
+	 */
+	template <typename Data>
+	size_t operator()(const Data& data, size_t num_shards) const {
+		return std::hash<Data>()(data) % num_shards;
+	}
+};
+
+
+
+/**
+ * @brief A partition function object which assigns data objects to the shards
+ *        of a ::mt::mtree_forest by their nearest pivot.
+ * @details The i-th pivot represents the i-th shard, so that near data objects
+ *          tend to be in the same shard, and queries can be answered by fewer
+ *          shards. The pivots are usually chosen from a sample of the data.
+ *          If there are more pivots than shards, the shards are reused
+ *          cyclically.
+ * @tparam Data The type of the data objects.
+ * @tparam DistanceFunction The type of the function or function object used
+ *         to calculate the distance between two @c Data objects.
+ */
+template <typename Data, typename DistanceFunction>
+struct pivot_partition {
+	/** @brief The data objects which represent the shards. */
+	std::vector<Data> pivots;
+
+	/** @brief The distance function or function object. */
+	DistanceFunction distance_function;
+
+	/** */
+	explicit pivot_partition(
+			const std::vector<Data>& pivots = std::vector<Data>(),
+			const DistanceFunction& distance_function = DistanceFunction()
+		)
+	: pivots(pivots),
+	  distance_function(distance_function)
+	{}
+
+	/**
+	 * @brief The operator that assigns a data object to a shard.
+	 * @return The index of the shard, less than @c num_shards.
+	 */
+	size_t operator()(const Data& data, size_t num_shards) const {
+		assert(!pivots.empty());
+		size_t nearest = 0;
+		double nearestDistance = distance_function(data, pivots[0]);
+		for(size_t i = 1; i < pivots.size(); ++i) {
+			double distance = distance_function(data, pivots[i]);
+			if(distance < nearestDistance) {
+				nearestDistance = distance;
+				nearest = i;
+			}
+		}
+		return nearest % num_shards;
+	}
+};
+
+
+
 template <typename Data, typename DistanceFunction>
 class cached_distance_function {
 public:
 	explicit cached_distance_function(const DistanceFunction& distance_function)
-		: distance_function(distance_function)
+		: distance_function(distance_function), cacheHits(0), cacheMisses(0)
 		{}
 
 	double operator()(const Data& data1, const Data& data2) {
-		typename CacheType::iterator i = cache.find(make_pair(data1, data2));
+		typename CacheType::iterator i = cache.find(std::make_pair(data1, data2));
 		if(i != cache.end()) {
+			++cacheHits;
 			return i->second;
 		}
 
-		i = cache.find(make_pair(data2, data1));
+		i = cache.find(std::make_pair(data2, data1));
 		if(i != cache.end()) {
+			++cacheHits;
 			return i->second;
 		}
 
 		// Not found in cache
+		++cacheMisses;
 		double distance = distance_function(data1, data2);
 
 		// Store in cache
-		cache.insert(make_pair(make_pair(data1, data2), distance));
-		cache.insert(make_pair(make_pair(data2, data1), distance));
+		cache.insert(std::make_pair(std::make_pair(data1, data2), distance));
+		cache.insert(std::make_pair(std::make_pair(data2, data1), distance));
 
 		return distance;
 	}
 
+	/** @brief The number of distances found in the cache. */
+	size_t hits() const {
+		return cacheHits;
+	}
+
+	/** @brief The number of distances actually computed. */
+	size_t misses() const {
+		return cacheMisses;
+	}
+
 private:
 	typedef std::map<std::pair<Data, Data>, double> CacheType;
 
 	const DistanceFunction& distance_function;
 	CacheType cache;
+	size_t cacheHits;
+	size_t cacheMisses;
 };
 
 
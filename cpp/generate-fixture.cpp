@@ -0,0 +1,191 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+
+/*
+ * Generates a fixture in the format of tests/fixtures/<name>.txt, like
+ * py/mtree/tests/fixtures/generator.py followed by convert-fixture-to-cpp.py,
+ * but fast enough for millions of actions.
+ *
+ * Usage: generate-fixture [--actions N] [--dimensions N] [--remove-chance P]
+ *                         [--query-chance P] [--max-radius R] [--max-limit N]
+ *                         [--max-coordinate N] [--seed N]
+ *
+ * Each action is one of:
+ *   A data query-data radius limit   adds the data object
+ *   R data query-data radius limit   removes the data object
+ *   Q data query-data radius limit   only queries; data is the query data
+ *
+ * followed by a query by range and a query by limit. When --query-chance is
+ * zero, every action is a write carrying its own queries, as in the Python
+ * generator. Otherwise, that is the chance of a query-only action, and the
+ * writes carry no queries (negative radius and zero limit), so that the mix of
+ * reads and writes is exactly the requested one.
+ *
+ * The radius and the limit of the queries are bounded by --max-radius and
+ * --max-limit, instead of growing with the number of data objects, so that
+ * large fixtures remain dominated by the cost of the M-Tree and not by the
+ * size of the results.
+ */
+
+
+enum {
+	DEFAULT_ACTIONS = 100,
+	DEFAULT_DIMENSIONS = 2,
+	DEFAULT_MAX_LIMIT = 20,
+	DEFAULT_MAX_COORDINATE = 100,
+	DEFAULT_SEED = 42,
+};
+
+const double DEFAULT_REMOVE_CHANCE = 0.1;
+const double DEFAULT_QUERY_CHANCE = 0.0;
+const double DEFAULT_MAX_RADIUS = 10.0;
+
+
+typedef vector<int> Data;
+
+
+struct Options {
+	size_t actions = DEFAULT_ACTIONS;
+	size_t dimensions = DEFAULT_DIMENSIONS;
+	double removeChance = DEFAULT_REMOVE_CHANCE;
+	double queryChance = DEFAULT_QUERY_CHANCE;
+	double maxRadius = DEFAULT_MAX_RADIUS;
+	size_t maxLimit = DEFAULT_MAX_LIMIT;
+	int maxCoordinate = DEFAULT_MAX_COORDINATE;
+	unsigned seed = DEFAULT_SEED;
+};
+
+
+
+class Generator {
+public:
+	Generator(const Options& options) : options(options), random(options.seed) {}
+
+	void generate(ostream& out) {
+		out << options.dimensions << '\n'
+		    << options.actions << '\n';
+
+		// The number of distinct data objects
+		double space = pow(options.maxCoordinate + 1.0, double(options.dimensions));
+		uniform_real_distribution<double> chance(0.0, 1.0);
+
+		for(size_t n = 0; n < options.actions; ++n) {
+			bool query = chance(random) < options.queryChance;
+			bool remove = !query  &&  chance(random) < options.removeChance;
+			if(!query  &&  (remove ? live.empty() : live.size() >= space)) {
+				// There is nothing to remove, or no data object left to add
+				remove = !remove;
+			}
+
+			Data queryData = generateData();
+			if(query) {
+				print(out, 'Q', queryData, queryData, radius(), limit());
+			} else if(remove) {
+				uniform_int_distribution<size_t> index(0, live.size() - 1);
+				size_t i = index(random);
+				Data data = live[i];
+				live[i] = live.back();
+				live.pop_back();
+				indexed.erase(data);
+				printWrite(out, 'R', data, queryData);
+			} else {
+				Data data;
+				do {
+					data = generateData();
+				} while(!indexed.insert(data).second);
+				live.push_back(data);
+				printWrite(out, 'A', data, queryData);
+			}
+		}
+	}
+
+private:
+	Data generateData() {
+		uniform_int_distribution<int> coordinate(0, options.maxCoordinate);
+		Data data(options.dimensions);
+		for(size_t d = 0; d < options.dimensions; ++d) {
+			data[d] = coordinate(random);
+		}
+		return data;
+	}
+
+	double radius() {
+		return uniform_real_distribution<double>(0.0, options.maxRadius)(random);
+	}
+
+	size_t limit() {
+		return uniform_int_distribution<size_t>(1, options.maxLimit)(random);
+	}
+
+	void printWrite(ostream& out, char cmd, const Data& data, const Data& queryData) {
+		if(options.queryChance > 0) {
+			print(out, cmd, data, queryData, -1, 0);
+		} else {
+			print(out, cmd, data, queryData, radius(), limit());
+		}
+	}
+
+	static void print(ostream& out, char cmd, const Data& data, const Data& queryData, double radius, size_t limit) {
+		out << cmd;
+		for(Data::const_iterator i = data.begin(); i != data.end(); ++i) {
+			out << ' ' << *i;
+		}
+		for(Data::const_iterator i = queryData.begin(); i != queryData.end(); ++i) {
+			out << ' ' << *i;
+		}
+		out << ' ' << radius << ' ' << limit << '\n';
+	}
+
+	Options options;
+	mt19937 random;
+	vector<Data> live;
+	set<Data> indexed;
+};
+
+
+
+
+
+int main(int argc, const char* argv[]) {
+	Options options;
+	for(int i = 1; i < argc; ++i) {
+		if(i + 1 < argc  &&  strcmp(argv[i], "--actions") == 0) {
+			options.actions = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--dimensions") == 0) {
+			options.dimensions = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--remove-chance") == 0) {
+			options.removeChance = atof(argv[++i]);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--query-chance") == 0) {
+			options.queryChance = atof(argv[++i]);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--max-radius") == 0) {
+			options.maxRadius = atof(argv[++i]);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--max-limit") == 0) {
+			options.maxLimit = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--max-coordinate") == 0) {
+			options.maxCoordinate = atoi(argv[++i]);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--seed") == 0) {
+			options.seed = strtoul(argv[++i], NULL, 10);
+		} else {
+			cerr << "Usage: " << argv[0] << " [--actions N] [--dimensions N] [--remove-chance P]" << endl
+			     << "       [--query-chance P] [--max-radius R] [--max-limit N] [--max-coordinate N] [--seed N]" << endl;
+			return 1;
+		}
+	}
+
+	if(options.dimensions == 0  ||  options.maxLimit == 0) {
+		cerr << "The dimensions and the maximum limit must be positive" << endl;
+		return 1;
+	}
+
+	// The fixtures are large, and the standard output does not need to be synchronized with stdio
+	ios::sync_with_stdio(false);
+	Generator(options).generate(cout);
+}
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include "word-distance.h"
+
+using namespace std;
+
+
+//const char DICT_FILE[] = "pt-br.dic";
+const char DICT_FILE[] = "en.dic";
+
+enum {
+	WORD_LIMIT = 50000,
+	MIN_NODE_CAPACITY = 16,
+	SEED = 42,
+};
+
+
+double insertConcurrently(const vector<string>& words, size_t numThreads) {
+	cerr << "Adding " << words.size() << " words with " << numThreads << " thread(s)..." << endl;
+	WordMTree mtree(MIN_NODE_CAPACITY);
+	Timer t;
+	vector<thread> threads;
+	for(size_t n = 0; n < numThreads; ++n) {
+		threads.push_back(thread([&, n]() {
+			for(size_t i = n; i < words.size(); i += numThreads) {
+				mtree.add(words[i]);
+			}
+		}));
+	}
+	for(auto i = threads.begin(); i != threads.end(); ++i) {
+		i->join();
+	}
+	Timer::Times times = t.getTimes();
+	assert(mtree.size() == words.size());
+	return times.real;
+}
+
+
+
+
+
+int main(int argc, const char* argv[]) {
+	size_t maxThreads = (argc > 1) ? atoi(argv[1]) : max(1u, thread::hardware_concurrency());
+	size_t wordsLimit = (argc > 2) ? atoi(argv[2]) : WORD_LIMIT;
+
+	cerr << "Loading words..." << endl;
+	vector<string> words = loadWords(DICT_FILE);
+	words.resize(min(words.size(), wordsLimit));
+	cerr << words.size() << " words loaded" << endl;
+
+	// The dictionary is sorted, which would make every thread insert in the same region
+	shuffle(words.begin(), words.end(), mt19937(SEED));
+
+	double baseTime = 0;
+	for(size_t numThreads = 1; numThreads <= maxThreads; ++numThreads) {
+		double realTime = insertConcurrently(words, numThreads);
+		if(numThreads == 1) {
+			baseTime = realTime;
+		}
+		cout <<      "INSERT"
+		        "\t" "threads"  "=" << numThreads
+		     << "\t" "words"    "=" << words.size()
+		     << "\t" "realTime" "=" << realTime
+		     << "\t" "speedup"  "=" << ((realTime > 0) ? baseTime / realTime : 0)
+		     << endl;
+	}
+}
@@ -0,0 +1,126 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Measures the time elapsed since its construction, in nanoseconds
+class Stopwatch {
+public:
+	Stopwatch() : begin(std::chrono::steady_clock::now()) {}
+
+	double nanoseconds() const {
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+private:
+	std::chrono::steady_clock::time_point begin;
+};
+
+
+
+// The latency below which a fraction p of the operations took; the latencies
+// must be sorted
+inline double percentile(const std::vector<double>& latencies, double p) {
+	if(latencies.empty()) {
+		return 0;
+	}
+	size_t rank = size_t(ceil(p * latencies.size()));
+	return latencies[std::max(rank, size_t(1)) - 1];
+}
+
+inline double mean(const std::vector<double>& latencies) {
+	double sum = 0;
+	for(std::vector<double>::const_iterator i = latencies.begin(); i != latencies.end(); ++i) {
+		sum += *i;
+	}
+	return latencies.empty() ? 0 : sum / latencies.size();
+}
+
+inline double throughput(size_t operations, double seconds) {
+	return (seconds > 0) ? operations / seconds : 0;
+}
+
+
+
+/*
+ * Prints rows of named fields to the standard output, as CSV, with a header
+ * taken from the first row, or as a JSON array of objects.
+ */
+class Report {
+public:
+	explicit Report(bool json) : json(json), rows(0) {}
+
+	Report& field(const char* name, const std::string& value) {
+		return field(name, value, "\"" + value + "\"");
+	}
+
+	Report& field(const char* name, const char* value) {
+		return field(name, std::string(value));
+	}
+
+	template <typename Number>
+	Report& field(const char* name, Number value) {
+		std::ostringstream formatted;
+		formatted << value;
+		return field(name, formatted.str(), formatted.str());
+	}
+
+	// A field formatted differently in CSV and in JSON
+	Report& field(const char* name, const std::string& csvValue, const std::string& jsonValue) {
+		names.push_back(name);
+		csvValues.push_back(csvValue);
+		jsonValues.push_back(jsonValue);
+		return *this;
+	}
+
+	void endRow() {
+		if(json) {
+			std::cout << ((rows == 0) ? "[\n" : ",\n") << "  {";
+			for(size_t i = 0; i < names.size(); ++i) {
+				std::cout << ((i == 0) ? "" : ", ") << "\"" << names[i] << "\": " << jsonValues[i];
+			}
+			std::cout << "}";
+		} else {
+			if(rows == 0) {
+				printCSVLine(names);
+			}
+			printCSVLine(csvValues);
+		}
+		++rows;
+		names.clear();
+		csvValues.clear();
+		jsonValues.clear();
+	}
+
+	// Closes the JSON array
+	void end() {
+		if(json) {
+			std::cout << ((rows == 0) ? "[" : "") << "\n]" << std::endl;
+		}
+	}
+
+private:
+	static void printCSVLine(const std::vector<std::string>& values) {
+		for(size_t i = 0; i < values.size(); ++i) {
+			std::cout << ((i == 0) ? "" : ",") << values[i];
+		}
+		std::cout << std::endl;
+	}
+
+	bool json;
+	size_t rows;
+	std::vector<std::string> names;
+	std::vector<std::string> csvValues;
+	std::vector<std::string> jsonValues;
+};
+
+
+#endif /* LATENCY_H_ */
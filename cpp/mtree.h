@@ -2,11 +2,24 @@
 #define MTREE_H_
 
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iterator>
 #include <limits>
 #include <map>
-#include <queue>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "functions.h"
 
 
@@ -47,566 +60,4266 @@ template <
 		>
 >
 class mtree {
+	// Shares the distribution of tasks among threads
+	template <typename, typename, typename, typename>
+	friend class mtree_forest;
+
 public:
 	typedef DistanceFunction distance_function_type;
 	typedef SplitFunction    split_function_type;
 	typedef functions::cached_distance_function<Data, DistanceFunction> cached_distance_function_type;
 
-private:
-	class Node;
-	class Entry;
+	class IndexItem;
 
 
-	// Exception classes
-	class SplitNodeReplacement {
-	public:
-		enum { NUM_NODES = 2 };
-		Node* newNodes[NUM_NODES];
-		SplitNodeReplacement(Node* newNodes[NUM_NODES]) {
-			for(int i = 0; i < NUM_NODES; ++i) {
-				this->newNodes[i] = newNodes[i];
-			}
+	/**
+	 * @brief The work performed by nearest-neighbors queries.
+	 * @details It is only collected when requested, by
+	 *          mtree::query::collect_stats() or
+	 *          mtree::query_context::collect_stats(). Statistics of different
+	 *          queries can be aggregated with <code>operator+=</code>: the
+	 *          counters and times are added up, and the peaks are the maximum
+	 *          ones.
+	 */
+	struct query_stats {
+		/** @brief The number of queries executed. */
+		size_t queries = 0;
 
-		}
-	};
+		/** @brief The number of results fetched. */
+		size_t results = 0;
 
-	class RootNodeReplacement {
-	public:
-		Node* newRoot;
-	};
+		/**
+		 * @brief The number of queries answered by the result cache, without
+		 *        searching the M-Tree.
+		 * @see mtree::enable_result_cache()
+		 */
+		size_t cache_hits = 0;
 
-	class NodeUnderCapacity { };
+		/** @brief The number of calls to the distance function. */
+		size_t distance_computations = 0;
 
-	class DataNotFound {
-	public:
-		Data data;
+		/** @brief The number of nodes whose children were examined. */
+		size_t nodes_expanded = 0;
+
+		/**
+		 * @brief The number of children discarded without computing their
+		 *        distance to the query data object, because of the
+		 *        triangle inequality on the distance to their parent.
+		 */
+		size_t pruned_by_parent_distance = 0;
+
+		/**
+		 * @brief The number of children discarded after computing their
+		 *        distance to the query data object, because their covering
+		 *        radius does not reach the query range.
+		 */
+		size_t pruned_by_radius = 0;
+
+		/**
+		 * @brief The number of children discarded without computing their
+		 *        distance to the query data object, because they are entries
+		 *        rejected by the filter of the query, or subtrees whose
+		 *        summary has none of the bits of its mask.
+		 * @see mtree::query_filter
+		 */
+		size_t pruned_by_filter = 0;
+
+		/** @brief The maximum number of nodes pending to be expanded. */
+		size_t peak_pending_queue = 0;
+
+		/** @brief The maximum number of candidate results not yet fetched. */
+		size_t peak_nearest_queue = 0;
+
+		/**
+		 * @brief The time in seconds from the start of the query until its
+		 *        first result was fetched.
+		 * @details Queries which fetch no results do not contribute to it.
+		 */
+		double time_to_first_result = 0.0;
+
+		/** @brief Aggregates the statistics of other queries into these. */
+		query_stats& operator+=(const query_stats& that) {
+			queries                   += that.queries;
+			results                   += that.results;
+			cache_hits                += that.cache_hits;
+			distance_computations     += that.distance_computations;
+			nodes_expanded            += that.nodes_expanded;
+			pruned_by_parent_distance += that.pruned_by_parent_distance;
+			pruned_by_radius          += that.pruned_by_radius;
+			pruned_by_filter          += that.pruned_by_filter;
+			peak_pending_queue         = std::max(peak_pending_queue, that.peak_pending_queue);
+			peak_nearest_queue         = std::max(peak_nearest_queue, that.peak_nearest_queue);
+			time_to_first_result      += that.time_to_first_result;
+			return *this;
+		}
 	};
 
 
-public:
+	/**
+	 * @brief A bitmap which summarizes a data object, such as with a bit for
+	 *        its category.
+	 * @see set_summary_function()
+	 */
+	typedef std::uint64_t summary_type;
+
 
 	/**
-	 * @brief A container-like class which can be iterated to fetch the results
-	 *        of a nearest-neighbors query.
-	 * @details The neighbors are presented in non-decreasing order from the
-	 *          @c query_data argument to the mtree::get_nearest() call.
-	 *
-	 *          The query on the M-Tree is executed during the iteration, as the
-	 *          results are fetched. It means that, by the time when the @a n-th
-	 *          result is fetched, the next result may still not be known, and
-	 *          the resources allocated were only the necessary to identify the
-	 *          @a n first results.
+	 * @brief Restricts the results of a query to the data objects accepted by
+	 *        a predicate.
+	 * @details The filter is applied while the M-Tree is searched: an entry
+	 *          rejected by the predicate is discarded before its distance to
+	 *          the query data object is computed, so it costs nothing but the
+	 *          call to the predicate, and it does not count for the limit of
+	 *          the query.
 	 *
-	 *          The objects in the container are mtree::query_result instances,
-	 *          which contain a data object and the distance from the query
-	 *          data object.
-	 * @see mtree::get_nearest()
+	 *          If the M-Tree has a summary function, whole subtrees are also
+	 *          discarded when their summary has none of the bits of the mask.
+	 *          The mask must then have a bit of the summary of every data
+	 *          object accepted by the predicate.
+	 * @code
+	 *     // The 10 nearest data objects of category 3
+	 *     tree.set_summary_function([](const Data& data) {
+	 *         return summary_type(1) << category(data);
+	 *     });
+	 *     mtree_type::query query = tree.get_nearest(
+	 *         query_data,
+	 *         mtree_type::query_filter([](const Data& data) { return category(data) == 3; }, 1 << 3),
+	 *         std::numeric_limits<double>::infinity(),
+	 *         10
+	 *     );
+	 * @endcode
+	 * @see get_nearest(const Data&, const query_filter&, double, size_t)
 	 */
-	class query {
-	public:
+	struct query_filter {
+		/** @brief Tells whether a data object is accepted. */
+		std::function<bool(const Data&)> predicate;
 
 		/**
-		 * @brief The type of the results for nearest-neighbor queries.
+		 * @brief The bits which a summary must have any of, for its subtree
+		 *        to be searched.
 		 */
-		class result_item {
-		public:
-			/** @brief A nearest-neighbor */
-			Data data;
-
-			/** @brief The distance from the nearest-neighbor to the query data
-			 *         object parameter.
-			 */
-			double distance;
+		summary_type summary_mask;
 
-			/** @brief Default constructor */
-			result_item() = default;
+		/** @brief Constructs a filter. */
+		query_filter(std::function<bool(const Data&)> predicate, summary_type summary_mask = ~summary_type(0))
+			: predicate(std::move(predicate)), summary_mask(summary_mask)
+			{}
+	};
 
-			/** @brief Copy constructor */
-			result_item(const result_item&) = default;
 
-			/** @brief Move constructor */
-			result_item(result_item&&) = default;
+	/**
+	 * @brief A histogram with buckets of exponentially growing widths.
+	 * @details The bucket 0 counts the values under 1, and each bucket
+	 *          @c i > 0 counts the values in <code>[2^(i-1), 2^i)</code>.
+	 */
+	struct histogram {
+		/** @brief The number of values in each bucket. */
+		std::vector<size_t> buckets;
+
+		/** @brief Returns the number of values in all the buckets. */
+		size_t count() const {
+			size_t count = 0;
+			for(typename std::vector<size_t>::const_iterator i = buckets.begin(); i != buckets.end(); ++i) {
+				count += *i;
+			}
+			return count;
+		}
 
-			~result_item() = default;
+		/** @brief Returns the upper bound (exclusive) of the values in a bucket. */
+		static double bucket_upper_bound(size_t bucket) {
+			return std::ldexp(1.0, bucket);
+		}
+	};
 
-			/** @brief Copy assignment */
-			result_item& operator=(const result_item&) = default;
 
-			/** @brief Move assignment */
-			result_item& operator=(result_item&& ri) {
-				if(this != &ri) {
-					data = std::move(ri.data);
-					distance = ri.distance;
-				}
-				return *this;
-			}
-		};
+	/**
+	 * @brief A structural change of the M-Tree, reported to the hook set by
+	 *        mtree::set_build_event_hook().
+	 */
+	struct build_event {
+		/** @brief The kinds of structural changes. */
+		enum kind_type {
+			/** @brief A node was split in two. */
+			SPLIT,
 
+			/**
+			 * @brief A node under its minimum capacity received a child from
+			 *        a sibling.
+			 */
+			DONATION,
 
-		typedef result_item value_type;
+			/**
+			 * @brief A node under its minimum capacity was merged into a
+			 *        sibling.
+			 */
+			MERGE,
 
+			/** @brief The root was split, and the M-Tree grew one level. */
+			HEIGHT_INCREASE,
 
-		query() = delete;
+			/**
+			 * @brief The root was left with a single child, which replaced
+			 *        it, and the M-Tree shrank one level.
+			 */
+			HEIGHT_DECREASE
+		};
 
-		/**
-		 * @brief Copy constructor.
-		 */
-		query(const query&) = default;
+		/** @brief The kind of structural change. */
+		kind_type kind;
 
 		/**
-		 * @brief Move constructor.
+		 * @brief The level of the node which was split, received a child or
+		 *        was merged, counted from the leaves, which are at level 0.
+		 *        For height changes, the new height of the M-Tree.
 		 */
-		query(query&&) = default;
+		size_t level;
 
-		query(const mtree* _mtree, const Data& data, double range, size_t limit)
-			: _mtree(_mtree), data(data), range(range), limit(limit)
-			{}
+		/** @brief For splits, the covering radii of the two new nodes. */
+		double radii[2];
+	};
 
 
-		/** @brief Copy assignment. */
-		query& operator=(const query&) = default;
+	/**
+	 * @brief Counters of the work performed by the writes on the M-Tree.
+	 * @see mtree::enable_build_stats()
+	 */
+	struct build_stats {
+		/** @brief The number of calls to add(). */
+		size_t adds = 0;
 
-		/** @brief Move assignment. */
-		query& operator=(query&& q) {
-			if(this != &q) {
-				this->_mtree = q._mtree;
-				this->range = q.range;
-				this->limit = q.limit;
-				this->data = std::move(q.data);
-			}
-			return *this;
-		}
+		/** @brief The number of calls to remove(). */
+		size_t removes = 0;
 
+		/**
+		 * @brief The number of node splits at each level, counted from the
+		 *        leaves, which are at level 0.
+		 */
+		std::vector<size_t> splits_per_level;
 
+		/** @brief The covering radii of the nodes created by splits. */
+		histogram split_radii;
 
 		/**
-		 * @brief The iterator for accessing the results of nearest-neighbor
-		 *        queries.
+		 * @brief The number of distances computed while splitting nodes,
+		 *        including those by the split function.
 		 */
-		class iterator {
-		public:
-			typedef std::input_iterator_tag iterator_category;
-			typedef result_item             value_type;
-			typedef signed long int         difference_type;
-			typedef result_item*            pointer;
-			typedef result_item&            reference;
+		size_t split_distance_computations = 0;
 
+		/**
+		 * @brief The number of distances requested while splitting nodes
+		 *        which were found in the cache of the
+		 *        ::mt::functions::cached_distance_function.
+		 */
+		size_t split_distance_cache_hits = 0;
 
-			iterator() : isEnd(true) {}
+		/** @brief The number of nodes that received a child from a sibling. */
+		size_t donations = 0;
 
+		/** @brief The number of nodes merged into a sibling. */
+		size_t merges = 0;
 
-			explicit iterator(const query* _query)
-				: _query(_query),
-				  isEnd(false),
-				  yieldedCount(0)
-			{
-				if(_query->_mtree->root == NULL) {
-					isEnd = true;
-					return;
-				}
+		/** @brief The number of times the M-Tree grew one level. */
+		size_t height_increases = 0;
 
-				double distance = _query->_mtree->distance_function(_query->data, _query->_mtree->root->data);
-				double minDistance = std::max(distance - _query->_mtree->root->radius, 0.0);
+		/** @brief The number of times the M-Tree shrank one level. */
+		size_t height_decreases = 0;
 
-				pendingQueue.push({_query->_mtree->root, distance, minDistance});
-				nextPendingMinDistance = minDistance;
+		/** @brief The time taken by each call to add(), in nanoseconds. */
+		histogram add_nanoseconds;
 
-				fetchNext();
-			}
+		/** @brief The time taken by each call to remove(), in nanoseconds. */
+		histogram remove_nanoseconds;
+	};
 
 
-			/** @brief Copy constructor. */
-			iterator(const iterator&) = default;
+	/**
+	 * @brief The shape of an M-Tree, as returned by mtree::statistics().
+	 */
+	struct tree_statistics {
+		/** @brief The statistics of the nodes at a level of the M-Tree. */
+		struct level_statistics {
+			/** @brief The number of nodes. */
+			size_t nodes = 0;
 
-			/** @brief Move constructor. */
-			iterator(iterator&&) = default;
+			/** @brief The number of children of all the nodes. */
+			size_t children = 0;
 
-			~iterator() = default;
+			/**
+			 * @brief The number of nodes by fill factor, which is the number
+			 *        of children of a node over the maximum node capacity.
+			 *        The bucket @c i counts the fill factors in
+			 *        <code>[i/10, (i+1)/10)</code>, except the last one, which
+			 *        also counts the full nodes.
+			 */
+			std::vector<size_t> fill_factors = std::vector<size_t>(10);
 
-			/** @brief Copy assignment. */
-			iterator& operator=(const iterator&) = default;
+			/** @brief The smallest covering radius. */
+			double min_radius = std::numeric_limits<double>::infinity();
 
-			/** @brief Move assignment. */
-			iterator& operator=(iterator&& i) {
-				if(this != &i) {
-					this->_query = i._query;
-					this->currentResultItem = std::move(i.currentResultItem);
-					this->isEnd = i.isEnd;
-					this->pendingQueue = std::move(i.pendingQueue);
-					this->nextPendingMinDistance = i.nextPendingMinDistance;
-					this->nearestQueue = std::move(i.nearestQueue);
-					this->yieldedCount = i.yieldedCount;
-				}
-				return *this;
-			}
+			/** @brief The average covering radius. */
+			double mean_radius = 0.0;
 
+			/** @brief The largest covering radius. */
+			double max_radius = 0.0;
 
-			bool operator==(const iterator& ri) const {
-				if(this->isEnd  &&  ri.isEnd) {
-					return true;
-				}
+			/** @brief The covering radii of the nodes. */
+			histogram radii;
 
-				if(this->isEnd  ||  ri.isEnd) {
-					return false;
-				}
+			/**
+			 * @brief The number of pairs of sibling nodes whose balls were
+			 *        checked for intersection.
+			 */
+			size_t sibling_pairs_sampled = 0;
 
-				return  this->_query == ri._query
-				    &&  this->yieldedCount == ri.yieldedCount;
-			}
+			/**
+			 * @brief The fraction of the pairs of sibling nodes sampled whose
+			 *        balls intersect.
+			 */
+			double sibling_overlap = 0.0;
+		};
 
-			bool operator!=(const iterator& ri) const {
-				return ! this->operator==(ri);
-			}
+		/** @brief Memory used by the M-Tree, in bytes. */
+		struct memory_statistics {
+			/** @brief Memory used by the node objects. */
+			size_t nodes = 0;
 
+			/** @brief Memory used by the entry objects. */
+			size_t entries = 0;
 
 			/**
-			 * @brief Advance the iterator to the next result.
+			 * @brief An estimate of the memory used by the containers of the
+			 *        children of the nodes, including the copies of the data
+			 *        objects held as keys.
 			 */
-			//@{
-			// prefix
-			iterator& operator++() {
-				fetchNext();
-				return *this;
-			}
-
-			// postfix
-			iterator operator++(int) {
-				iterator aCopy = *this;
-				operator++();
-				return aCopy;
-			}
-			//@}
-
+			size_t child_containers = 0;
 
 			/**
-			 * @brief Gives access to the current query result.
-			 * @details An iterator instance always refers to the same
-			 *          result_item instance; only the fields of the result_item
-			 *          are updated when the iterator changes.
+			 * @brief Memory owned by the data objects besides their own size,
+			 *        as reported by the function passed to
+			 *        mtree::statistics().
 			 */
-			//@{
-			const result_item& operator*() const {
-				return currentResultItem;
-			}
+			size_t data_payload = 0;
 
-			const result_item* operator->() const {
-				return &currentResultItem;
+			/** @brief The sum of all the components. */
+			size_t total() const {
+				return nodes + entries + child_containers + data_payload;
 			}
-			//@}
-
-		private:
-			template <typename U>
-			struct ItemWithDistances {
-				const U* item;
-				double distance;
-				double minDistance;
+		};
 
-				ItemWithDistances(const U* item, double distance, double minDistance)
-					: item(item), distance(distance), minDistance(minDistance)
-					{ }
+		/** @brief The number of levels of nodes. */
+		size_t height = 0;
 
-				bool operator<(const ItemWithDistances& that) const {
-					return (this->minDistance > that.minDistance);
-				}
+		/** @brief The number of data objects indexed. */
+		size_t entries = 0;
 
-			};
+		/** @brief The number of removed data objects kept as tombstones. */
+		size_t tombstones = 0;
 
-			void fetchNext() {
-				assert(! isEnd);
+		/**
+		 * @brief The statistics of each level, counted from the leaves, which
+		 *        are at level 0.
+		 */
+		std::vector<level_statistics> levels;
 
-				if(isEnd  ||  yieldedCount >= _query->limit) {
-					isEnd = true;
-					return;
-				}
+		/** @brief Memory used by the M-Tree. */
+		memory_statistics memory;
+	};
 
-				 while(!pendingQueue.empty()  ||  !nearestQueue.empty()) {
-					if(prepareNextNearest()) {
-						return;
-					}
 
-					assert(!pendingQueue.empty());
-
-					ItemWithDistances<Node> pending = pendingQueue.top();
-					pendingQueue.pop();
-
-					const Node* node = pending.item;
-
-					for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
-						IndexItem* child = i->second;
-						if(std::abs(pending.distance - child->distanceToParent) - child->radius <= _query->range) {
-							double childDistance = _query->_mtree->distance_function(_query->data, child->data);
-							double childMinDistance = std::max(childDistance - child->radius, 0.0);
-							if(childMinDistance <= _query->range) {
-								Entry* entry = dynamic_cast<Entry*>(child);
-								if(entry != NULL) {
-									nearestQueue.push({entry, childDistance, childMinDistance});
-								} else {
-									Node* node = dynamic_cast<Node*>(child);
-									assert(node != NULL);
-									pendingQueue.push({node, childDistance, childMinDistance});
-								}
-							}
-						}
-					}
+	/**
+	 * @brief The predicted cost of a nearest-neighbors query, as returned by
+	 *        mtree::estimate_cost().
+	 */
+	struct cost_estimate {
+		/** @brief The expected number of nodes whose children are examined. */
+		double node_accesses;
 
-					if(pendingQueue.empty()) {
-						nextPendingMinDistance = std::numeric_limits<double>::infinity();
-					} else {
-						nextPendingMinDistance = pendingQueue.top().minDistance;
-					}
+		/**
+		 * @brief The expected number of calls to the distance function. It
+		 *        does not account for the children discarded by their
+		 *        distance to their parent, so it is an upper bound.
+		 */
+		double distance_computations;
 
-				}
+		/** @brief The expected number of results. */
+		double results;
 
-				isEnd = true;
-			}
+		/**
+		 * @brief The expected distance to the farthest result, which is the
+		 *        query range unless the query is bound by the number of
+		 *        neighbors.
+		 */
+		double radius;
+	};
 
+private:
+	class Node;
+	class Entry;
 
-			bool prepareNextNearest() {
-				if(!nearestQueue.empty()) {
-					ItemWithDistances<Entry> nextNearest = nearestQueue.top();
-					if(nextNearest.distance <= nextPendingMinDistance) {
-						nearestQueue.pop();
-						currentResultItem.data = nextNearest.item->data;
-						currentResultItem.distance = nextNearest.distance;
-						++yieldedCount;
-						return true;
-					}
-				}
 
-				return false;
+	// Exception classes
+	class SplitNodeReplacement {
+	public:
+		enum { NUM_NODES = 2 };
+		Node* newNodes[NUM_NODES];
+		SplitNodeReplacement(Node* newNodes[NUM_NODES]) {
+			for(int i = 0; i < NUM_NODES; ++i) {
+				this->newNodes[i] = newNodes[i];
+			}
+
+		}
+	};
+
+	class RootNodeReplacement {
+	public:
+		Node* newRoot;
+	};
+
+	class NodeUnderCapacity { };
+
+	class DataNotFound {
+	public:
+		Data data;
+	};
+
+	class WriteRestart { };
+
+
+	template <typename U>
+	struct ItemWithDistances {
+		const U* item;
+		double distance;
+		double minDistance;
+
+		ItemWithDistances(const U* item, double distance, double minDistance)
+			: item(item), distance(distance), minDistance(minDistance)
+			{ }
+
+		bool operator<(const ItemWithDistances& that) const {
+			return (this->minDistance > that.minDistance);
+		}
+
+	};
+
+
+	/*
+	 * Gives a reader access to the root of the M-Tree. When snapshots are
+	 * enabled, the published version of the M-Tree is pinned until release()
+	 * is called, so that none of its items is reclaimed in the meantime.
+	 */
+	class ReadPin {
+	public:
+		const Node* root;
+
+		// Identifies the version of the M-Tree
+		unsigned long version;
+
+		explicit ReadPin(const mtree* _mtree) : root(NULL), version(0), _mtree(_mtree), pinned(false) {
+			acquire();
+		}
+
+		ReadPin(const ReadPin&) = delete;
+		ReadPin& operator=(const ReadPin&) = delete;
+
+		~ReadPin() {
+			release();
+		}
+
+		void acquire() {
+			assert(!pinned);
+			if(!_mtree->snapshots) {
+				root = _mtree->root;
+				version = _mtree->writeCount;
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(_mtree->snapshotMutex);
+			root = _mtree->publishedRoot;
+			epoch = _mtree->epoch;
+			version = epoch;
+			++_mtree->pinnedEpochs[epoch];
+			pinned = true;
+		}
+
+		void release() {
+			if(pinned) {
+				std::lock_guard<std::mutex> lock(_mtree->snapshotMutex);
+				typename std::map<unsigned long, size_t>::iterator i = _mtree->pinnedEpochs.find(epoch);
+				if(--i->second == 0) {
+					_mtree->pinnedEpochs.erase(i);
+				}
+				pinned = false;
+			}
+			root = NULL;
+		}
+
+	private:
+		const mtree* _mtree;
+		bool pinned;
+		unsigned long epoch;
+	};
+
+
+	/*
+	 * Whether the distances of a flat scan can be computed on columns of
+	 * coordinates: for the euclidean distance between sequences of numbers.
+	 */
+	template <typename D, typename F, typename Enable = void>
+	struct ScanLayout {
+		enum { COLUMNAR = false };
+		typedef double Coordinate;
+	};
+
+	template <typename D>
+	struct ScanLayout<D, functions::euclidean_distance, typename std::enable_if<std::is_arithmetic<typename D::value_type>::value>::type> {
+		enum { COLUMNAR = true };
+		typedef typename D::value_type Coordinate;
+	};
+
+
+	/*
+	 * The entries of a version of the M-Tree, in a contiguous array, for
+	 * queries which are cheaper to answer by computing the distance to all of
+	 * them. For the euclidean distance, the coordinates are also kept by
+	 * dimension, so that the distances to a block of entries are computed in
+	 * loops over contiguous memory, which the compiler can vectorize.
+	 */
+	class FlatScan {
+	public:
+		typedef ScanLayout<Data, DistanceFunction> Layout;
+		typedef typename Layout::Coordinate Coordinate;
+
+		enum { BLOCK_SIZE = 256 };
+
+		unsigned long version;
+		std::vector<const Entry*> entries;
+		size_t dimensions;
+		std::vector<Coordinate> coordinates;
+
+		FlatScan(const Node* root, unsigned long version) : version(version), dimensions(0) {
+			std::vector<const Node*> pending;
+			if(root != NULL) {
+				pending.push_back(root);
+			}
+			while(!pending.empty()) {
+				const Node* node = pending.back();
+				pending.pop_back();
+				for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+					if(const Entry* entry = dynamic_cast<const Entry*>(i->second)) {
+						if(entry->entryCount > 0) {
+							entries.push_back(entry);
+						}
+					} else {
+						pending.push_back(dynamic_cast<const Node*>(i->second));
+					}
+				}
+			}
+			fillColumns(std::integral_constant<bool, Layout::COLUMNAR>());
+		}
+
+		/*
+		 * Appends the entries from first to last within the range to results.
+		 */
+		void collect(const mtree* _mtree, const Data& queryData, double range, size_t first, size_t last, std::vector<ItemWithDistances<Entry>>& results) const {
+			collect(_mtree, queryData, range, first, last, results, std::integral_constant<bool, Layout::COLUMNAR>());
+		}
+
+	private:
+		void fillColumns(std::false_type) { }
+
+		void fillColumns(std::true_type) {
+			if(entries.empty()) {
+				return;
+			}
+			dimensions = entries.front()->data.size();
+			for(typename std::vector<const Entry*>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+				if((*i)->data.size() != dimensions) {
+					// The distances will be computed by the distance function
+					dimensions = 0;
+					return;
+				}
+			}
+
+			coordinates.resize(dimensions * entries.size());
+			for(size_t i = 0; i < entries.size(); ++i) {
+				typename Data::const_iterator c = entries[i]->data.begin();
+				for(size_t d = 0; d < dimensions; ++d, ++c) {
+					coordinates[d * entries.size() + i] = *c;
+				}
+			}
+		}
+
+		void collect(const mtree* _mtree, const Data& queryData, double range, size_t first, size_t last, std::vector<ItemWithDistances<Entry>>& results, std::false_type) const {
+			for(size_t i = first; i < last; ++i) {
+				double distance = _mtree->distance_function(queryData, entries[i]->data);
+				if(distance <= range) {
+					results.push_back({entries[i], distance, distance});
+				}
+			}
+		}
+
+		void collect(const mtree* _mtree, const Data& queryData, double range, size_t first, size_t last, std::vector<ItemWithDistances<Entry>>& results, std::true_type) const {
+			if(dimensions == 0  ||  queryData.size() != dimensions) {
+				collect(_mtree, queryData, range, first, last, results, std::false_type());
+				return;
+			}
+
+			// The same operations as functions::euclidean_distance, in the same order
+			double sums[BLOCK_SIZE];
+			for(size_t block = first; block < last; block += BLOCK_SIZE) {
+				size_t count = std::min(size_t(BLOCK_SIZE), last - block);
+				std::fill(sums, sums + count, 0.0);
+				typename Data::const_iterator q = queryData.begin();
+				for(size_t d = 0; d < dimensions; ++d, ++q) {
+					const Coordinate queryCoordinate = *q;
+					const Coordinate* column = &coordinates[d * entries.size() + block];
+					for(size_t j = 0; j < count; ++j) {
+						double diff = queryCoordinate - column[j];
+						sums[j] += diff * diff;
+					}
+				}
+				for(size_t j = 0; j < count; ++j) {
+					double distance = std::sqrt(sums[j]);
+					if(distance <= range) {
+						results.push_back({entries[block + j], distance, distance});
+					}
+				}
+			}
+		}
+	};
+
+
+	/*
+	 * The state of an incremental nearest-neighbors search. The pending nodes
+	 * and the candidate entries are kept in vectors managed as heaps, so that
+	 * the storage survives clear() and can be reused by subsequent searches.
+	 */
+	class NearestSearch {
+	public:
+		NearestSearch() : _mtree(NULL), queryData(NULL), stats(NULL), filter(NULL) {}
+
+		void clear() {
+			pendingQueue.clear();
+			nearestQueue.clear();
+			yieldedCount = 0;
+		}
+
+		void reserve(size_t nodes, size_t entries) {
+			pendingQueue.reserve(nodes);
+			nearestQueue.reserve(entries);
+		}
+
+		/*
+		 * Starts a search. If stats is not NULL, the work performed by the
+		 * search is added to it. If filter is not NULL, only the entries it
+		 * accepts are searched.
+		 */
+		void start(const mtree* _mtree, const Node* root, const Data& queryData, double range, size_t limit, query_stats* stats = NULL, const query_filter* filter = NULL) {
+			clear();
+			this->_mtree = _mtree;
+			this->queryData = &queryData;
+			this->range = range;
+			this->limit = limit;
+			this->stats = stats;
+			this->filter = filter;
+			if(stats != NULL) {
+				++stats->queries;
+				startTime = std::chrono::steady_clock::now();
+			}
+
+			if(root == NULL) {
+				nextPendingMinDistance = std::numeric_limits<double>::infinity();
+				return;
+			}
+
+			double distance = _mtree->distance_function(queryData, root->data);
+			if(stats != NULL) {
+				++stats->distance_computations;
+			}
+			double minDistance = std::max(distance - root->radius, 0.0);
+
+			pushPending({root, distance, minDistance});
+			nextPendingMinDistance = minDistance;
+		}
+
+		/*
+		 * Starts a search which computes the distances to all the entries of a
+		 * flat scan at once, and then yields them in order.
+		 */
+		void startScan(const mtree* _mtree, const FlatScan& scan, const Data& queryData, double range, size_t limit, query_stats* stats = NULL) {
+			clear();
+			this->_mtree = _mtree;
+			this->queryData = &queryData;
+			this->range = range;
+			this->limit = limit;
+			this->stats = stats;
+			if(stats != NULL) {
+				++stats->queries;
+				startTime = std::chrono::steady_clock::now();
+			}
+
+			this->filter = NULL;
+			scan.collect(_mtree, queryData, range, 0, scan.entries.size(), nearestQueue);
+			keepNearest(nearestQueue, limit);
+			std::make_heap(nearestQueue.begin(), nearestQueue.end());
+			nextPendingMinDistance = std::numeric_limits<double>::infinity();
+
+			if(stats != NULL) {
+				stats->distance_computations += scan.entries.size();
+				stats->peak_nearest_queue = std::max(stats->peak_nearest_queue, nearestQueue.size());
+			}
+		}
+
+		// Keeps only the nearest limit entries, in no particular order
+		static void keepNearest(std::vector<ItemWithDistances<Entry>>& entries, size_t limit) {
+			if(entries.size() > limit) {
+				// operator< is reversed, for the heaps
+				std::nth_element(entries.begin(), entries.begin() + limit, entries.end(),
+					[](const ItemWithDistances<Entry>& a, const ItemWithDistances<Entry>& b) {
+						return a.distance < b.distance;
+					});
+				entries.erase(entries.begin() + limit, entries.end());
+			}
+		}
+
+		/*
+		 * Returns the next nearest entry, or NULL if there are no more results.
+		 * The returned pointer is valid until the next call.
+		 */
+		const ItemWithDistances<Entry>* next() {
+			if(yieldedCount >= limit) {
+				return NULL;
+			}
+
+			while(!pendingQueue.empty()  ||  !nearestQueue.empty()) {
+				if(prepareNextNearest()) {
+					return &currentNearest;
+				}
+
+				assert(!pendingQueue.empty());
+				expandNextPending();
+			}
+
+			return NULL;
+		}
+
+		size_t yielded() const {
+			return yieldedCount;
+		}
+
+		/*
+		 * Expands the pending nodes nearest to the query data until there are
+		 * at least count of them, and hands the pending nodes and the
+		 * candidate entries over, leaving the search empty.
+		 */
+		void takeFrontier(size_t count, std::vector<ItemWithDistances<Node>>& nodes, std::vector<ItemWithDistances<Entry>>& entries) {
+			while(!pendingQueue.empty()  &&  pendingQueue.size() < count) {
+				expandNextPending();
+			}
+			nodes.swap(pendingQueue);
+			entries.swap(nearestQueue);
+			clear();
+		}
+
+	private:
+		void expandNextPending() {
+			std::pop_heap(pendingQueue.begin(), pendingQueue.end());
+			ItemWithDistances<Node> pending = pendingQueue.back();
+			pendingQueue.pop_back();
+
+			const Node* node = pending.item;
+			size_t examined = 0;
+			size_t computed = 0;
+			size_t prunedByRadius = 0;
+			size_t prunedByFilter = 0;
+
+			for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+				IndexItem* child = i->second;
+				if(child->entryCount == 0) {
+					// Only tombstones
+					continue;
+				}
+				if(filter != NULL  &&  rejects(child)) {
+					++prunedByFilter;
+					continue;
+				}
+				++examined;
+				if(std::abs(pending.distance - child->distanceToParent) - child->radius <= range) {
+					double childDistance = _mtree->distance_function(*queryData, child->data);
+					++computed;
+					double childMinDistance = std::max(childDistance - child->radius, 0.0);
+					if(childMinDistance <= range) {
+						Entry* entry = dynamic_cast<Entry*>(child);
+						if(entry != NULL) {
+							nearestQueue.push_back({entry, childDistance, childMinDistance});
+							std::push_heap(nearestQueue.begin(), nearestQueue.end());
+						} else {
+							Node* node = dynamic_cast<Node*>(child);
+							assert(node != NULL);
+							pushPending({node, childDistance, childMinDistance});
+						}
+					} else {
+						++prunedByRadius;
+					}
+				}
+			}
+
+			if(stats != NULL) {
+				++stats->nodes_expanded;
+				stats->distance_computations += computed;
+				stats->pruned_by_radius += prunedByRadius;
+				stats->pruned_by_parent_distance += examined - computed;
+				stats->pruned_by_filter += prunedByFilter;
+				stats->peak_nearest_queue = std::max(stats->peak_nearest_queue, nearestQueue.size());
+			}
+
+			if(pendingQueue.empty()) {
+				nextPendingMinDistance = std::numeric_limits<double>::infinity();
+			} else {
+				nextPendingMinDistance = pendingQueue.front().minDistance;
+			}
+		}
+
+		// Whether the filter discards an entry, or a subtree by its summary
+		bool rejects(const IndexItem* child) const {
+			if(_mtree->summaryFunction  &&  (child->summary & filter->summary_mask) == 0) {
+				return true;
+			}
+			return dynamic_cast<const Entry*>(child) != NULL  &&  !filter->predicate(child->data);
+		}
+
+		void pushPending(const ItemWithDistances<Node>& pending) {
+			pendingQueue.push_back(pending);
+			std::push_heap(pendingQueue.begin(), pendingQueue.end());
+			if(stats != NULL) {
+				stats->peak_pending_queue = std::max(stats->peak_pending_queue, pendingQueue.size());
+			}
+		}
+
+		bool prepareNextNearest() {
+			if(!nearestQueue.empty()) {
+				const ItemWithDistances<Entry>& nextNearest = nearestQueue.front();
+				if(nextNearest.distance <= nextPendingMinDistance) {
+					currentNearest = nextNearest;
+					std::pop_heap(nearestQueue.begin(), nearestQueue.end());
+					nearestQueue.pop_back();
+					++yieldedCount;
+					if(stats != NULL) {
+						recordResult();
+					}
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void recordResult() {
+			++stats->results;
+			if(yieldedCount == 1) {
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+				stats->time_to_first_result += elapsed.count();
+			}
+		}
+
+		const mtree* _mtree;
+		const Data* queryData;
+		double range;
+		size_t limit;
+		query_stats* stats;
+		const query_filter* filter;
+		std::chrono::steady_clock::time_point startTime;
+		std::vector<ItemWithDistances<Node>> pendingQueue;
+		double nextPendingMinDistance;
+		std::vector<ItemWithDistances<Entry>> nearestQueue;
+		ItemWithDistances<Entry> currentNearest = {NULL, 0.0, 0.0};
+		size_t yieldedCount = 0;
+	};
+
+
+public:
+
+	/**
+	 * @brief A container-like class which can be iterated to fetch the results
+	 *        of a nearest-neighbors query.
+	 * @details The neighbors are presented in non-decreasing order from the
+	 *          @c query_data argument to the mtree::get_nearest() call.
+	 *
+	 *          The query on the M-Tree is executed during the iteration, as the
+	 *          results are fetched. It means that, by the time when the @a n-th
+	 *          result is fetched, the next result may still not be known, and
+	 *          the resources allocated were only the necessary to identify the
+	 *          @a n first results.
+	 *
+	 *          The objects in the container are mtree::query_result instances,
+	 *          which contain a data object and the distance from the query
+	 *          data object.
+	 * @see mtree::get_nearest()
+	 */
+	class query {
+	public:
+
+		/**
+		 * @brief The type of the results for nearest-neighbor queries.
+		 */
+		class result_item {
+		public:
+			/** @brief A nearest-neighbor */
+			Data data;
+
+			/** @brief The distance from the nearest-neighbor to the query data
+			 *         object parameter.
+			 */
+			double distance;
+
+			/** @brief Default constructor */
+			result_item() = default;
+
+			/** @brief Copy constructor */
+			result_item(const result_item&) = default;
+
+			/** @brief Move constructor */
+			result_item(result_item&&) = default;
+
+			~result_item() = default;
+
+			/** @brief Copy assignment */
+			result_item& operator=(const result_item&) = default;
+
+			/** @brief Move assignment */
+			result_item& operator=(result_item&& ri) {
+				if(this != &ri) {
+					data = std::move(ri.data);
+					distance = ri.distance;
+				}
+				return *this;
+			}
+		};
+
+
+		typedef result_item value_type;
+
+
+		query() = delete;
+
+		/**
+		 * @brief Copy constructor.
+		 */
+		query(const query&) = default;
+
+		/**
+		 * @brief Move constructor.
+		 */
+		query(query&&) = default;
+
+		query(const mtree* _mtree, const Data& data, double range, size_t limit, std::shared_ptr<const query_filter> filter = nullptr)
+			: _mtree(_mtree), data(data), range(range), limit(limit), filter(std::move(filter)), cacheWrites(0)
+		{
+			if(_mtree->snapshots) {
+				// Before pinning, so that a write finishing in between is noticed
+				if(_mtree->resultCache) {
+					cacheWrites = _mtree->resultCache->writes;
+				}
+				pin = std::make_shared<ReadPin>(_mtree);
+			}
+		}
+
+
+		/** @brief Copy assignment. */
+		query& operator=(const query&) = default;
+
+		/** @brief Move assignment. */
+		query& operator=(query&& q) {
+			if(this != &q) {
+				this->_mtree = q._mtree;
+				this->range = q.range;
+				this->limit = q.limit;
+				this->data = std::move(q.data);
+				this->filter = std::move(q.filter);
+				this->pin = std::move(q.pin);
+				this->cacheWrites = q.cacheWrites;
+				this->collectedStats = std::move(q.collectedStats);
+			}
+			return *this;
+		}
+
+
+		/**
+		 * @brief Enables or disables collecting statistics of the work
+		 *        performed by this query.
+		 * @details The statistics of every iteration started by begin() after
+		 *          this call are added up, and can be retrieved by stats().
+		 *          Copies of the query share the same statistics. When
+		 *          disabled, which is the default, the query does not spend any
+		 *          time collecting them.
+		 * @param enabled Whether the statistics are collected. Either way,
+		 *        the statistics collected so far are discarded.
+		 */
+		void collect_stats(bool enabled = true) {
+			collectedStats = enabled ? std::make_shared<query_stats>() : nullptr;
+		}
+
+		/**
+		 * @brief Returns the statistics collected since collect_stats() was
+		 *        called, or empty statistics if they are not collected.
+		 */
+		const query_stats& stats() const {
+			static const query_stats none;
+			return collectedStats ? *collectedStats : none;
+		}
+
+
+
+		/**
+		 * @brief The iterator for accessing the results of nearest-neighbor
+		 *        queries.
+		 */
+		class iterator {
+		public:
+			typedef std::input_iterator_tag iterator_category;
+			typedef result_item             value_type;
+			typedef signed long int         difference_type;
+			typedef result_item*            pointer;
+			typedef result_item&            reference;
+
+
+			iterator() : _query(NULL), isEnd(true), cachedIndex(0), caching(false), cacheWrites(0) {}
+
+
+			explicit iterator(const query* _query)
+				: _query(_query),
+				  isEnd(false),
+				  cachedIndex(0),
+				  caching(false),
+				  cacheWrites(0)
+			{
+				const mtree* _mtree = _query->_mtree;
+				// The filter is not part of the key of the cached results
+				if(_mtree->resultCache  &&  !_query->filter) {
+					// A pinned query reads the version of the M-Tree from when it was created
+					cacheWrites = _query->pin ? _query->cacheWrites : _mtree->resultCache->writes.load();
+					cachedResults = _mtree->resultCache->find(_query->data, _query->range, _query->limit, cacheWrites);
+					if(cachedResults) {
+						if(query_stats* stats = _query->collectedStats.get()) {
+							++stats->queries;
+							++stats->cache_hits;
+						}
+						fetchNext();
+						return;
+					}
+					caching = true;
+				}
+
+				const Node* root = _query->root();
+				// A scan would compute the distances to the rejected entries
+				if(!_query->filter  &&  _mtree->prefersScan(root, _query->range, _query->limit)) {
+					unsigned long version = _query->pin ? _query->pin->version : _mtree->writeCount.load();
+					std::shared_ptr<const FlatScan> scan = _mtree->flatScanOf(root, version);
+					search.startScan(_mtree, *scan, _query->data, _query->range, _query->limit, _query->collectedStats.get());
+				} else {
+					search.start(_mtree, root, _query->data, _query->range, _query->limit, _query->collectedStats.get(), _query->filter.get());
+				}
+
+				fetchNext();
+			}
+
+
+			/** @brief Copy constructor. */
+			iterator(const iterator&) = default;
+
+			/** @brief Move constructor. */
+			iterator(iterator&&) = default;
+
+			~iterator() = default;
+
+			/** @brief Copy assignment. */
+			iterator& operator=(const iterator&) = default;
+
+			/** @brief Move assignment. */
+			iterator& operator=(iterator&& i) {
+				if(this != &i) {
+					this->_query = i._query;
+					this->currentResultItem = std::move(i.currentResultItem);
+					this->isEnd = i.isEnd;
+					this->search = std::move(i.search);
+					this->cachedResults = std::move(i.cachedResults);
+					this->cachedIndex = i.cachedIndex;
+					this->caching = i.caching;
+					this->cacheWrites = i.cacheWrites;
+					this->collectedResults = std::move(i.collectedResults);
+				}
+				return *this;
+			}
+
+
+			bool operator==(const iterator& ri) const {
+				if(this->isEnd  &&  ri.isEnd) {
+					return true;
+				}
+
+				if(this->isEnd  ||  ri.isEnd) {
+					return false;
+				}
+
+				return  this->_query == ri._query
+				    &&  this->yielded() == ri.yielded();
+			}
+
+			bool operator!=(const iterator& ri) const {
+				return ! this->operator==(ri);
+			}
+
+
+			/**
+			 * @brief Advance the iterator to the next result.
+			 */
+			//@{
+			// prefix
+			iterator& operator++() {
+				fetchNext();
+				return *this;
+			}
+
+			// postfix
+			iterator operator++(int) {
+				iterator aCopy = *this;
+				operator++();
+				return aCopy;
+			}
+			//@}
+
+
+			/**
+			 * @brief Gives access to the current query result.
+			 * @details An iterator instance always refers to the same
+			 *          result_item instance; only the fields of the result_item
+			 *          are updated when the iterator changes.
+			 */
+			//@{
+			const result_item& operator*() const {
+				return currentResultItem;
+			}
+
+			const result_item* operator->() const {
+				return &currentResultItem;
+			}
+			//@}
+
+
+			/**
+			 * @brief Returns the statistics of the query being iterated.
+			 * @see query::stats()
+			 */
+			const query_stats& stats() const {
+				assert(_query != NULL);
+				return _query->stats();
+			}
+
+		private:
+			void fetchNext() {
+				assert(! isEnd);
+
+				if(cachedResults) {
+					if(cachedIndex == cachedResults->size()) {
+						isEnd = true;
+						return;
+					}
+					currentResultItem = (*cachedResults)[cachedIndex++];
+					if(query_stats* stats = _query->collectedStats.get()) {
+						++stats->results;
+					}
+					return;
+				}
+
+				const ItemWithDistances<Entry>* nextNearest = search.next();
+				if(nextNearest == NULL) {
+					isEnd = true;
+					if(caching  &&  _query->_mtree->resultCache) {
+						_query->_mtree->resultCache->store(_query->data, _query->range, _query->limit, std::move(collectedResults), cacheWrites);
+					}
+					return;
+				}
+
+				currentResultItem.data = nextNearest->item->data;
+				currentResultItem.distance = nextNearest->distance;
+				if(caching) {
+					collectedResults.push_back(currentResultItem);
+				}
+			}
+
+			size_t yielded() const {
+				return cachedResults ? cachedIndex : search.yielded();
+			}
+
+
+			const query* _query;
+			result_item currentResultItem;
+			bool isEnd;
+			NearestSearch search;
+
+			// The results, when found in the cache
+			std::shared_ptr<const std::vector<result_item>> cachedResults;
+			size_t cachedIndex;
+
+			// Whether the results are collected to be cached
+			bool caching;
+			unsigned long cacheWrites;
+			std::vector<result_item> collectedResults;
+		};
+
+
+		/**
+		 * @brief Begins the execution of the query and returns an interator
+		 *        which refers to the first result.
+		 */
+		iterator begin() const {
+			return iterator(this);
+		}
+
+
+		/**
+		 * @brief Returns an iterator which informs that there are no more
+		 *        results.
+		 */
+		iterator end() const {
+			return {};
+		}
+
+	private:
+		const Node* root() const {
+			return pin ? pin->root : _mtree->root;
+		}
+
+		const mtree* _mtree;
+		Data data;
+		double range;
+		size_t limit;
+		std::shared_ptr<const query_filter> filter;
+		std::shared_ptr<ReadPin> pin;
+		// The writes seen by the result cache when the query was pinned
+		unsigned long cacheWrites;
+		std::shared_ptr<query_stats> collectedStats;
+	};
+
+
+
+	/**
+	 * @brief A reusable workspace for executing nearest-neighbors queries
+	 *        without allocating memory on each query.
+	 * @details Unlike mtree::query, a query_context does not copy the query
+	 *          data object, but holds a reference to it, which must remain
+	 *          valid until the query is finished or another one is started.
+	 *          The storage used by the search is kept between queries, so once
+	 *          it has grown to the size required by the workload, executing a
+	 *          new query performs no heap allocations.
+	 *
+	 *          The results are fetched by calling next(), and accessed through
+	 *          data() and distance(), which refer directly to the indexed
+	 *          object, without copying it:
+	 * @code
+	 *     mtree_type::query_context context(tree);
+	 *     for(...) {
+	 *         context.start(query_data, range, limit);
+	 *         while(context.next()) {
+	 *             use(context.data(), context.distance());
+	 *         }
+	 *     }
+	 * @endcode
+	 *
+	 *          The M-Tree must not be modified while a query is executing.
+	 */
+	class query_context {
+	public:
+		/**
+		 * @brief Creates a workspace for queries on the given M-Tree.
+		 */
+		explicit query_context(const mtree& _mtree)
+			: _mtree(&_mtree), pin(&_mtree), current(NULL), collectingStats(false)
+		{
+			pin.release();
+		}
+
+		query_context(const query_context&) = delete;
+		query_context& operator=(const query_context&) = delete;
+
+		/**
+		 * @brief Reserves storage for the given number of pending nodes and
+		 *        candidate results.
+		 */
+		void reserve(size_t nodes, size_t results) {
+			search.reserve(nodes, results);
+		}
+
+		/**
+		 * @brief Finishes the current query, if any, keeping the allocated
+		 *        storage for the next one.
+		 */
+		void clear() {
+			search.clear();
+			pin.release();
+			current = NULL;
+		}
+
+		/**
+		 * @brief Starts a nearest-neighbors query, constrained by distance
+		 *        and/or the number of neighbors.
+		 * @param query_data The query data object. It is held by reference.
+		 * @param range The maximum distance from @c query_data to fetched
+		 *        neighbors.
+		 * @param limit The maximum number of neighbors to fetch.
+		 */
+		void start(const Data& query_data,
+		           double range = std::numeric_limits<double>::infinity(),
+		           size_t limit = std::numeric_limits<unsigned int>::max())
+		{
+			current = NULL;
+			pin.release();
+			pin.acquire();
+			query_stats* stats = collectingStats ? &collectedStats : NULL;
+			if(_mtree->prefersScan(pin.root, range, limit)) {
+				search.startScan(_mtree, *_mtree->flatScanOf(pin.root, pin.version), query_data, range, limit, stats);
+			} else {
+				search.start(_mtree, pin.root, query_data, range, limit, stats);
+			}
+		}
+
+		/**
+		 * @brief Fetches the next result of the current query.
+		 * @return @c false if there are no more results.
+		 */
+		bool next() {
+			current = search.next();
+			return current != NULL;
+		}
+
+		/**
+		 * @brief The current result, valid after next() returned @c true.
+		 */
+		const Data& data() const {
+			assert(current != NULL);
+			return current->item->data;
+		}
+
+		/**
+		 * @brief The distance from the current result to the query data
+		 *        object.
+		 */
+		double distance() const {
+			assert(current != NULL);
+			return current->distance;
+		}
+
+		/**
+		 * @brief Enables or disables collecting statistics of the work
+		 *        performed by the queries started after this call.
+		 * @param enabled Whether the statistics are collected. Either way,
+		 *        the statistics collected so far are discarded.
+		 * @see query::collect_stats()
+		 */
+		void collect_stats(bool enabled = true) {
+			collectingStats = enabled;
+			collectedStats = query_stats();
+		}
+
+		/**
+		 * @brief Returns the statistics of the queries executed since
+		 *        collect_stats() was called.
+		 */
+		const query_stats& stats() const {
+			return collectedStats;
+		}
+
+	private:
+		const mtree* _mtree;
+		ReadPin pin;
+		NearestSearch search;
+		const ItemWithDistances<Entry>* current;
+		bool collectingStats;
+		query_stats collectedStats;
+	};
+
+
+
+	/**
+	 * @brief The result of mtree::count_in_range().
+	 * @details When the count is exact, @c lower and @c upper are equal.
+	 *          Otherwise, the budget of distance computations was exhausted
+	 *          and the number of data objects within the range is somewhere
+	 *          between them.
+	 */
+	struct range_count {
+		/** @brief The number of data objects known to be within the range. */
+		size_t lower;
+
+		/** @brief The maximum number of data objects within the range. */
+		size_t upper;
+
+		/**
+		 * @brief An estimate of the number of data objects within the range.
+		 * @details Each subtree which could not be resolved contributes a
+		 *          fraction of its objects, linearly interpolated from the
+		 *          bounds of its distance to the query data object.
+		 */
+		double estimate;
+
+		/** @brief Whether the count is exact. */
+		bool exact() const {
+			return lower == upper;
+		}
+	};
+
+
+
+	/**
+	 * @brief A k-nearest-neighbors graph, in compressed sparse row format.
+	 * @details Each vertex corresponds to a data object of the M-Tree. The
+	 *          neighbors of the vertex @c v are stored, in non-decreasing
+	 *          order of distance, in the positions from <code>offsets[v]</code>
+	 *          (inclusive) to <code>offsets[v+1]</code> (exclusive) of the
+	 *          @c neighbors and @c distances vectors.
+	 * @see mtree::all_knn()
+	 */
+	struct knn_graph {
+		/** @brief The data object of each vertex. */
+		std::vector<Data> vertices;
+
+		/** @brief The position of the first neighbor of each vertex. It has
+		 *         one more element than @c vertices.
+		 */
+		std::vector<size_t> offsets;
+
+		/** @brief The vertices of the neighbors. */
+		std::vector<size_t> neighbors;
+
+		/** @brief The distances to the neighbors. */
+		std::vector<double> distances;
+
+		/** @brief The number of vertices. */
+		size_t size() const {
+			return vertices.size();
+		}
+
+		/** @brief The number of neighbors of a vertex. */
+		size_t degree(size_t vertex) const {
+			return offsets[vertex + 1] - offsets[vertex];
+		}
+	};
+
+
+
+	enum {
+		/**
+		 * @brief The default minimum capacity of nodes in an M-Tree, when not
+		 * specified in the constructor call.
+		 */
+		DEFAULT_MIN_NODE_CAPACITY = 50
+	};
+
+	enum {
+		/**
+		 * @brief The default number of distances sampled by
+		 *        update_cost_model().
+		 */
+		DEFAULT_COST_MODEL_SAMPLES = 1000
+	};
+
+	enum {
+		/**
+		 * @brief The default maximum number of results held by the cache
+		 *        enabled by enable_result_cache().
+		 */
+		DEFAULT_RESULT_CACHE_SIZE = 100000
+	};
+
+	/**
+	 * @brief How add() chooses the child of a node under which a data object
+	 *        is added.
+	 * @details The preferred child is the nearest one whose ball covers the
+	 *          data object, or else the one whose radius would increase the
+	 *          least.
+	 */
+	enum insertion_mode {
+		/** @brief Computes the distance to every child. This is the default. */
+		EXHAUSTIVE_INSERTION,
+
+		/**
+		 * @brief Bounds the distance to each child by the triangle
+		 *        inequality, using the distance to the node and the distance
+		 *        from the child to the node. The children are tried in order
+		 *        of their lower bound, and only while they may be preferred to
+		 *        the best one so far. The choice is the same as
+		 *        ::EXHAUSTIVE_INSERTION, except among equally good children.
+		 */
+		BOUNDED_INSERTION,
+
+		/**
+		 * @brief Like ::BOUNDED_INSERTION, but takes the first child found
+		 *        whose ball covers the data object, even if it is not the
+		 *        nearest one.
+		 */
+		FIRST_FIT_INSERTION
+	};
+
+	/**
+	 * @brief How nearest-neighbors queries are executed.
+	 * @see set_execution_mode()
+	 */
+	enum execution_mode {
+		/**
+		 * @brief Scans all the data objects when the query is estimated to
+		 *        compute the distance to a large fraction of them through the
+		 *        M-Tree.
+		 */
+		AUTOMATIC_EXECUTION,
+
+		/** @brief Always searches the M-Tree. This is the default. */
+		TREE_EXECUTION,
+
+		/** @brief Always scans all the data objects. */
+		SCAN_EXECUTION
+	};
+
+
+	/**
+	 * @brief The main constructor of an M-Tree.
+	 *
+	 * @param min_node_capacity The minimum capacity of the nodes of an M-Tree.
+	 *        Should be at least 2.
+	 * @param max_node_capacity The maximum capacity of the nodes of an M-Tree.
+	 *        Should be greater than @c min_node_capacity. If -1 is passed, then
+	 *        the value <code>2*min_node_capacity - 1</code> is used.
+	 * @param distance_function An instance of @c DistanceFunction.
+	 * @param split_function An instance of @c SplitFunction.
+	 *
+	 */
+	explicit mtree(
+			size_t min_node_capacity = DEFAULT_MIN_NODE_CAPACITY,
+			size_t max_node_capacity = -1,
+			const DistanceFunction& distance_function = DistanceFunction(),
+			const SplitFunction& split_function = SplitFunction()
+		)
+		: minNodeCapacity(min_node_capacity),
+		  maxNodeCapacity(max_node_capacity),
+		  root(NULL),
+		  locatorEnabled(false),
+		  tombstones(false),
+		  compactionThreshold(0.0),
+		  insertionMode(EXHAUSTIVE_INSERTION),
+		  executionMode(TREE_EXECUTION),
+		  scanThreshold(0.5),
+		  writeCount(0),
+		  snapshots(false),
+		  writeVersion(0),
+		  publishedRoot(NULL),
+		  epoch(0),
+		  distance_function(distance_function),
+		  split_function(split_function)
+	{
+		if(max_node_capacity == size_t(-1)) {
+			this->maxNodeCapacity = 2 * min_node_capacity - 1;
+		}
+	}
+
+	// Cannot copy!
+	mtree(const mtree&) = delete;
+
+	// ... but moving is ok.
+	/** @brief Move constructor. */
+	mtree(mtree&& that)
+		: minNodeCapacity(that.minNodeCapacity),
+		  maxNodeCapacity(that.maxNodeCapacity),
+		  root(that.root),
+		  locatorEnabled(that.locatorEnabled),
+		  locator(std::move(that.locator)),
+		  summaryFunction(std::move(that.summaryFunction)),
+		  tombstones(that.tombstones),
+		  compactionThreshold(that.compactionThreshold),
+		  insertionMode(that.insertionMode),
+		  buildCounters(std::move(that.buildCounters)),
+		  buildEventHook(std::move(that.buildEventHook)),
+		  costModel(std::move(that.costModel)),
+		  executionMode(that.executionMode),
+		  scanThreshold(that.scanThreshold),
+		  writeCount(that.writeCount.load()),
+		  flatScan(std::move(that.flatScan)),
+		  resultCache(std::move(that.resultCache)),
+		  snapshots(that.snapshots),
+		  writeVersion(that.writeVersion),
+		  publishedRoot(that.publishedRoot),
+		  epoch(that.epoch),
+		  retired(std::move(that.retired)),
+		  distance_function(that.distance_function),
+		  split_function(that.split_function)
+	{
+		that.root = NULL;
+		that.locator.clear();
+		that.publishedRoot = NULL;
+		that.retired.clear();
+	}
+
+
+	~mtree() {
+		assert(pinnedEpochs.empty());
+		reclaimRetired(std::numeric_limits<unsigned long>::max());
+		delete root;
+	}
+
+	// Cannot copy!
+	mtree& operator=(const mtree&) = delete;
+
+	// ... but moving is ok.
+	/** @brief Move assignment. */
+	mtree& operator=(mtree&& that) {
+		if(&that != this) {
+			std::swap(this->root, that.root);
+			std::swap(this->locatorEnabled, that.locatorEnabled);
+			std::swap(this->locator, that.locator);
+			std::swap(this->summaryFunction, that.summaryFunction);
+			std::swap(this->tombstones, that.tombstones);
+			std::swap(this->compactionThreshold, that.compactionThreshold);
+			std::swap(this->insertionMode, that.insertionMode);
+			std::swap(this->buildCounters, that.buildCounters);
+			std::swap(this->buildEventHook, that.buildEventHook);
+			std::swap(this->costModel, that.costModel);
+			std::swap(this->executionMode, that.executionMode);
+			std::swap(this->scanThreshold, that.scanThreshold);
+			unsigned long writeCount = this->writeCount;
+			this->writeCount = that.writeCount.load();
+			that.writeCount = writeCount;
+			std::swap(this->flatScan, that.flatScan);
+			std::swap(this->resultCache, that.resultCache);
+			std::swap(this->snapshots, that.snapshots);
+			std::swap(this->writeVersion, that.writeVersion);
+			std::swap(this->publishedRoot, that.publishedRoot);
+			std::swap(this->epoch, that.epoch);
+			std::swap(this->retired, that.retired);
+			this->minNodeCapacity = that.minNodeCapacity;
+			this->maxNodeCapacity = that.maxNodeCapacity;
+			this->distance_function = std::move(that.distance_function);
+			this->split_function = std::move(that.split_function);
+		}
+		return *this;
+	}
+
+
+	/**
+	 * @brief Adds and indexes a data object.
+	 * @details An object that is already indexed should not be added. There is
+	 *          no validation, and the behavior is undefined if done.
+	 *
+	 *          add() and remove() may be called concurrently from several
+	 *          threads. Writes which only change the entries of a leaf, without
+	 *          growing its radius or splitting it, run in parallel. Other writes
+	 *          run exclusively. Queries must not run concurrently with writes,
+	 *          unless snapshots are enabled, in which case the writes are
+	 *          serialized.
+	 * @param data The data object to index.
+	 */
+	void add(const Data& data) {
+		WriteTimer timer(this, &BuildCounters::adds, &BuildCounters::addNanoseconds);
+		ResultCacheInvalidation invalidation(this, &data);
+		try {
+			WriteTransaction transaction(this, false);
+			doAdd(data, transaction);
+			return;
+		} catch(WriteRestart&) {
+			// Another write is restructuring the M-Tree
+		}
+
+		WriteTransaction transaction(this, true);
+		doAdd(data, transaction);
+	}
+
+
+	/**
+	 * @brief Removes a data object from the M-Tree.
+	 * @details See add() about concurrent writes.
+	 * @param data The data object to be removed.
+	 * @return @c true if and only if the object was found.
+	 */
+	bool remove(const Data& data) {
+		WriteTimer timer(this, &BuildCounters::removes, &BuildCounters::removeNanoseconds);
+		ResultCacheInvalidation invalidation(this, &data);
+		try {
+			WriteTransaction transaction(this, false);
+			return doRemove(data, transaction);
+		} catch(WriteRestart&) {
+			// Another write is restructuring the M-Tree
+		}
+
+		WriteTransaction transaction(this, true);
+		return doRemove(data, transaction);
+	}
+
+	/**
+	 * @brief Replaces an indexed data object with another one.
+	 * @details It is meant for small moves. If the new data object is within
+	 *          the ball of the leaf of the old one, it takes its place in the
+	 *          leaf, at the cost of a single distance computation besides
+	 *          finding the old data object. Otherwise, it is added under the
+	 *          lowest node on the path to the leaf whose ball covers it,
+	 *          instead of starting from the root.
+	 *
+	 *          The new data object should not be already indexed.
+	 * @param old_data The data object to be replaced.
+	 * @param new_data The data object to index in its place.
+	 * @return @c true if and only if the old data object was found.
+	 */
+	bool update(const Data& old_data, const Data& new_data) {
+		ResultCacheInvalidation invalidation(this, &old_data, &new_data);
+		WriteTransaction transaction(this, true);
+		return doUpdate(old_data, new_data, transaction);
+	}
+
+	/**
+	 * @brief Removes a range of data objects from the M-Tree.
+	 * @details All the data objects are first located and marked, and then the
+	 *          affected nodes are restructured once, bottom-up. Instead of
+	 *          balancing each node that gets under its minimum capacity after
+	 *          each removal, the node is dissolved and its remaining children
+	 *          are added back at their level after the pass. The covering
+	 *          radii of the affected nodes are recomputed along the way.
+	 *
+	 *          The removal is a single exclusive write.
+	 * @param first The beginning of the range.
+	 * @param last The end of the range.
+	 * @return The number of data objects that were found and removed.
+	 */
+	template <typename InputIterator>
+	size_t remove_batch(InputIterator first, InputIterator last) {
+		ResultCacheInvalidation invalidation(this);
+		WriteTransaction transaction(this, true);
+		if(root == NULL) {
+			return 0;
+		}
+
+		std::set<const IndexItem*> marked;
+		for(; first != last; ++first) {
+			markData(*first, marked);
+		}
+		return removeMarked(marked, transaction);
+	}
+
+	/**
+	 * @brief Removes all the data objects that satisfy a predicate.
+	 * @details The predicate is called once for each data object. The
+	 *          restructuring is done as in remove_batch().
+	 * @param predicate A function object called as <code>predicate(data)</code>,
+	 *        which returns whether @c data should be removed.
+	 * @return The number of data objects removed.
+	 */
+	template <typename Predicate>
+	size_t remove_if(Predicate predicate) {
+		ResultCacheInvalidation invalidation(this);
+		WriteTransaction transaction(this, true);
+		if(root == NULL) {
+			return 0;
+		}
+
+		std::set<const IndexItem*> marked;
+		markMatching(root, predicate, marked);
+		return removeMarked(marked, transaction);
+	}
+
+
+	/**
+	 * @brief Enables or disables lazy removals.
+	 * @details When enabled, remove() does not take the data object out of
+	 *          its leaf, but replaces it with a tombstone, which queries skip.
+	 *          No node ever gets under its minimum capacity, so removals never
+	 *          need to balance the nodes, and always run in parallel. The
+	 *          tombstones are physically removed by compact(), which can be
+	 *          called at a convenient time, or from a background thread.
+	 *
+	 *          When disabled, all the tombstones are removed. This function
+	 *          itself must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param enabled Whether removals should leave tombstones.
+	 * @param compaction_threshold The ratio of tombstones among the entries of
+	 *        a subtree above which compact() removes them.
+	 */
+	void enable_tombstones(bool enabled = true, double compaction_threshold = 0.25) {
+		WriteTransaction transaction(this, true);
+		tombstones = enabled;
+		compactionThreshold = compaction_threshold;
+		if(!enabled) {
+			compactTombstones(0.0, -1, transaction);
+		}
+	}
+
+	/**
+	 * @brief Removes the tombstones of the subtrees where their ratio exceeds
+	 *        the threshold given to enable_tombstones().
+	 * @details The removal is done as in remove_batch(). A limit can be given
+	 *          to compact incrementally, in several calls. compact() is a
+	 *          write like add() and remove(), so it may run in a background
+	 *          thread concurrently with them, and also with queries if
+	 *          snapshots are enabled.
+	 * @param max_tombstones The maximum number of tombstones to look for.
+	 *        A few more may be removed along with them, from the nodes which
+	 *        get under their minimum capacity.
+	 * @return The number of tombstones removed.
+	 */
+	size_t compact(size_t max_tombstones = -1) {
+		WriteTransaction transaction(this, true);
+		return compactTombstones(compactionThreshold, max_tombstones, transaction);
+	}
+
+	/** @brief Returns the number of tombstones left by removals. */
+	size_t tombstone_count() const {
+		ReadPin pin(this);
+		return (pin.root == NULL) ? 0 : pin.root->tombstoneCount.load();
+	}
+
+	/**
+	 * @brief Computes statistics about the shape of the M-Tree.
+	 * @details Every node is visited once, without computing any distances,
+	 *          except for estimating the overlap of sibling balls. For each
+	 *          level, up to @c overlap_samples pairs of sibling nodes are
+	 *          picked at random, and their balls are checked for
+	 *          intersection, which is decided by their distances to their
+	 *          parent when possible. If a level has fewer sibling pairs, all of
+	 *          them are checked.
+	 *
+	 *          It does not modify the M-Tree, and may run concurrently with
+	 *          queries, and with writes if snapshots are enabled.
+	 * @param overlap_samples The maximum number of sibling pairs checked per
+	 *        level.
+	 * @param payload_size A function which returns the memory owned by a
+	 *        data object besides <code>sizeof(Data)</code>, such as the
+	 *        buffer of a string. If empty, it is assumed to be 0.
+	 */
+	tree_statistics statistics(size_t overlap_samples = 1000, std::function<size_t(const Data&)> payload_size = nullptr) const {
+		tree_statistics stats;
+		ReadPin pin(this);
+		if(pin.root == NULL) {
+			return stats;
+		}
+
+		stats.height = heightOf(pin.root);
+		stats.levels.resize(stats.height);
+		std::vector<std::vector<double>> radii(stats.height);
+		std::vector<std::vector<const Node*>> parents(stats.height);
+		std::vector<size_t> siblingPairs(stats.height);
+
+		std::vector<std::pair<const IndexItem*, size_t>> pending{ {pin.root, stats.height - 1} };
+		while(!pending.empty()) {
+			const IndexItem* item = pending.back().first;
+			size_t level = pending.back().second;
+			pending.pop_back();
+
+			if(payload_size) {
+				stats.memory.data_payload += payload_size(item->data);
+			}
+
+			const Node* node = dynamic_cast<const Node*>(item);
+			if(node == NULL) {
+				stats.memory.entries += sizeof(Entry);
+				if(item->entryCount == 0) {
+					++stats.tombstones;
+				} else {
+					++stats.entries;
+				}
+				continue;
+			}
+
+			typename tree_statistics::level_statistics& levelStats = stats.levels[level];
+			++levelStats.nodes;
+			levelStats.children += node->children.size();
+			double fillFactor = double(node->children.size()) / maxNodeCapacity;
+			size_t bucket = std::min(size_t(fillFactor * levelStats.fill_factors.size()), levelStats.fill_factors.size() - 1);
+			++levelStats.fill_factors[bucket];
+			radii[level].push_back(node->radius);
+
+			stats.memory.nodes += nodeSize(node);
+			// Each element of a std::map is allocated with three pointers and a color
+			stats.memory.child_containers += node->children.size() * (sizeof(typename Node::ChildrenMap::value_type) + 4 * sizeof(void*));
+
+			for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+				if(payload_size) {
+					stats.memory.data_payload += payload_size(i->first);
+				}
+				pending.push_back({i->second, level - 1});
+			}
+			if(level > 0  &&  node->children.size() >= 2) {
+				parents[level - 1].push_back(node);
+				siblingPairs[level - 1] += node->children.size() * (node->children.size() - 1) / 2;
+			}
+		}
+
+		for(size_t level = 0; level < stats.height; ++level) {
+			typename tree_statistics::level_statistics& levelStats = stats.levels[level];
+			double sum = 0.0;
+			for(typename std::vector<double>::const_iterator r = radii[level].begin(); r != radii[level].end(); ++r) {
+				levelStats.min_radius = std::min(levelStats.min_radius, *r);
+				levelStats.max_radius = std::max(levelStats.max_radius, *r);
+				sum += *r;
+				size_t bucket = histogramBucket(*r);
+				if(levelStats.radii.buckets.size() <= bucket) {
+					levelStats.radii.buckets.resize(bucket + 1);
+				}
+				++levelStats.radii.buckets[bucket];
+			}
+			levelStats.mean_radius = sum / levelStats.nodes;
+
+			sampleSiblingOverlap(parents[level], siblingPairs[level], overlap_samples, levelStats);
+		}
+
+		return stats;
+	}
+
+	/**
+	 * @brief Rebuilds the model used by estimate_cost().
+	 * @details The model consists of the distribution of distances between
+	 *          pairs of data objects, estimated from a random sample of pairs,
+	 *          and of the covering radii and number of children of the nodes
+	 *          at each level, grouped by radius. It is built by visiting every
+	 *          node once, so it should be rebuilt periodically rather than
+	 *          before each estimate.
+	 *
+	 *          It does not modify the M-Tree, and may run concurrently with
+	 *          queries and with estimate_cost(), and with writes if snapshots
+	 *          are enabled.
+	 * @param distance_samples The number of pairs of data objects whose
+	 *        distance is sampled.
+	 */
+	void update_cost_model(size_t distance_samples = DEFAULT_COST_MODEL_SAMPLES) const {
+		std::shared_ptr<const CostModel> model = buildCostModel(distance_samples);
+		std::lock_guard<std::mutex> lock(costModelMutex);
+		costModel = model;
+	}
+
+	/**
+	 * @brief Predicts the cost of a nearest-neighbors query, without
+	 *        executing it.
+	 * @details The prediction follows the cost model of the M-Tree paper: a
+	 *          node is accessed if the query ball intersects its ball, which
+	 *          happens with the probability that the distance from the query
+	 *          data object to a data object is within the sum of the radii,
+	 *          assuming the distances from the query data object are
+	 *          distributed like those between the indexed data objects. For a
+	 *          query bound by the number of neighbors, the radius is the
+	 *          distance within which that many data objects are expected.
+	 *
+	 *          The model is built by update_cost_model(), which is called on the
+	 *          first estimate if it was not called before. The prediction
+	 *          takes time proportional to the height of the M-Tree and
+	 *          computes no distances.
+	 * @param range The maximum distance to the fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 */
+	cost_estimate estimate_cost(double range, size_t limit) const {
+		std::shared_ptr<const CostModel> model = currentCostModel();
+		if(!model) {
+			update_cost_model();
+			model = currentCostModel();
+		}
+		return model->estimate(range, limit);
+	}
+
+	/**
+	 * @brief Predicts the cost of a nearest-neighbors query constrained by
+	 *        distance.
+	 * @see estimate_cost()
+	 */
+	cost_estimate estimate_cost_by_range(double range) const {
+		return estimate_cost(range, std::numeric_limits<unsigned int>::max());
+	}
+
+	/**
+	 * @brief Predicts the cost of a nearest-neighbors query constrained by
+	 *        the number of neighbors.
+	 * @see estimate_cost()
+	 */
+	cost_estimate estimate_cost_by_limit(size_t limit) const {
+		return estimate_cost(std::numeric_limits<double>::infinity(), limit);
+	}
+
+
+	/**
+	 * @brief Moves all the data objects of another M-Tree into this one.
+	 * @details Instead of adding the data objects one by one, whole subtrees of
+	 *          @c other are grafted under the nodes of this M-Tree at the level
+	 *          which keeps all the leaves at the same depth. The node under
+	 *          which a subtree is grafted is chosen as add() chooses a leaf,
+	 *          taking the covering radius of the subtree into account. If
+	 *          @c other is taller, the roles of the M-Trees are swapped.
+	 *
+	 *          The data objects are only added one by one if the root of
+	 *          @c other is a leaf, or if the node capacities of @c other are
+	 *          not within the ones of this M-Tree, in which case its nodes
+	 *          cannot be reused.
+	 *
+	 *          The data objects must not be indexed by both M-Trees, and no
+	 *          query on @c other may still be iterated, since its nodes are
+	 *          taken over by this M-Tree.
+	 * @param other The M-Tree to be merged. It is left empty.
+	 */
+	void merge(mtree&& other) {
+		if(&other == this  ||  other.root == NULL) {
+			return;
+		}
+
+		ResultCacheInvalidation invalidation(this);
+		ResultCacheInvalidation otherInvalidation(&other);
+		WriteTransaction transaction(this, true);
+		// A buried data object could collide with one indexed by the other M-Tree
+		compactTombstones(0.0, -1, transaction);
+		{
+			WriteTransaction otherTransaction(&other, true);
+			other.compactTombstones(0.0, -1, otherTransaction);
+		}
+		if(other.root != NULL) {
+			// Otherwise a later write of this M-Tree with the same version
+			// would change them in place, while queries may still read them
+			stampSubtree(other.root);
+		}
+		if(summaryFunction  &&  other.root != NULL) {
+			// The subtrees of the other M-Tree are summarized by this one's function
+			summarizeSubtree(other.root);
+		}
+		doMerge(other, transaction);
+		other.locator.clear();
+		if(locatorEnabled) {
+			// The grafted nodes still point to their parents in the other M-Tree
+			locateSubtree(root);
+		}
+	}
+
+private:
+	class WriteTransaction;
+
+	void doMerge(mtree& other, WriteTransaction& transaction) {
+		bool reusableNodes = (other.minNodeCapacity >= this->minNodeCapacity
+		                  &&  other.maxNodeCapacity <= this->maxNodeCapacity);
+		size_t height = heightOf(root);
+		size_t otherHeight = heightOf(other.root);
+		if(reusableNodes  &&  otherHeight > height
+		&& other.minNodeCapacity == this->minNodeCapacity  &&  other.maxNodeCapacity == this->maxNodeCapacity) {
+			std::swap(this->root, other.root);
+			std::swap(height, otherHeight);
+			if(other.root == NULL) {
+				return;
+			}
+		}
+
+		if(root == NULL  &&  reusableNodes) {
+			root = other.root;
+			other.root = NULL;
+			return;
+		}
+
+		// A root can be grafted as a regular node if it has enough children
+		std::vector<std::pair<IndexItem*, size_t>> subtrees;
+		Node* otherRoot = other.root;
+		other.root = NULL;
+		if(reusableNodes  &&  otherHeight > 1  &&  otherHeight < height
+		&& otherRoot->children.size() >= minNodeCapacity) {
+			Node* node = stamp(new InternalNode(otherRoot->data));
+			node->children.swap(otherRoot->children);
+			node->radius = otherRoot->radius;
+			node->entryCount = otherRoot->entryCount.load();
+			node->tombstoneCount = otherRoot->tombstoneCount.load();
+			node->summary = otherRoot->summary.load();
+			subtrees.push_back(std::make_pair(node, otherHeight));
+		} else {
+			for(typename Node::ChildrenMap::iterator i = otherRoot->children.begin(); i != otherRoot->children.end(); ++i) {
+				subtrees.push_back(std::make_pair(i->second, otherHeight - 1));
+			}
+		}
+		destroy(otherRoot);
+
+		reinsert(subtrees, reusableNodes, transaction);
+	}
+
+	// Adds detached subtrees, each paired with its height
+	void reinsert(std::vector<std::pair<IndexItem*, size_t>>& subtrees, bool reusableNodes, WriteTransaction& transaction) {
+		while(!subtrees.empty()) {
+			IndexItem* subtree = subtrees.back().first;
+			size_t subtreeHeight = subtrees.back().second;
+			subtrees.pop_back();
+
+			if(subtreeHeight == 0) {
+				// Tombstones are dropped
+				if(subtree->entryCount > 0) {
+					doAdd(subtree->data, transaction);
+				}
+				dispose(subtree);
+			} else if(!reusableNodes  ||  subtreeHeight >= heightOf(root)) {
+				// Graft its children instead
+				Node* node = dynamic_cast<Node*>(subtree);
+				for(typename Node::ChildrenMap::iterator i = node->children.begin(); i != node->children.end(); ++i) {
+					subtrees.push_back(std::make_pair(i->second, subtreeHeight - 1));
+				}
+				dispose(node);
+			} else {
+				graft(subtree, subtreeHeight);
+			}
+		}
+	}
+
+	/*
+	 * The model behind estimate_cost(). The nodes of each level are grouped
+	 * by covering radius, and each group is represented by its mean radius.
+	 */
+	class CostModel {
+	public:
+		enum { RADIUS_GROUPS = 16 };
+
+		struct RadiusGroup {
+			double nodes;
+			double children;
+			double radius;
+		};
+
+		std::vector<double> distances;
+		size_t size;
+		double rootChildren;
+		std::vector<RadiusGroup> groups;
+
+		// The fraction of the sampled distances within the given one
+		double distribution(double distance) const {
+			if(distances.empty()) {
+				return 1.0;
+			}
+			return double(std::upper_bound(distances.begin(), distances.end(), distance) - distances.begin()) / distances.size();
+		}
+
+		cost_estimate estimate(double range, size_t limit) const {
+			cost_estimate estimate = { 0.0, 0.0, 0.0, range };
+			if(size == 0  ||  limit == 0) {
+				return estimate;
+			}
+
+			if(limit < size  &&  !distances.empty()) {
+				size_t index = std::min(size_t(std::ceil(double(limit) / size * distances.size())), distances.size()) - 1;
+				estimate.radius = std::min(range, distances[index]);
+			} else {
+				estimate.radius = std::min(range, distances.empty() ? 0.0 : distances.back());
+			}
+
+			// The root is always accessed
+			estimate.node_accesses = 1.0;
+			estimate.distance_computations = 1.0 + rootChildren;
+			for(typename std::vector<RadiusGroup>::const_iterator g = groups.begin(); g != groups.end(); ++g) {
+				double probability = distribution(g->radius + estimate.radius);
+				estimate.node_accesses += g->nodes * probability;
+				estimate.distance_computations += g->children * probability;
+			}
+			estimate.results = std::min(double(limit), size * distribution(estimate.radius));
+			return estimate;
+		}
+	};
+
+	std::shared_ptr<const CostModel> buildCostModel(size_t distanceSamples) const {
+		std::shared_ptr<CostModel> model = std::make_shared<CostModel>();
+		model->size = 0;
+		model->rootChildren = 0.0;
+		ReadPin pin(this);
+		if(pin.root == NULL) {
+			return model;
+		}
+
+		// The radii and numbers of children of the nodes below the root, by level
+		typedef std::pair<double, size_t> NodeShape;
+		std::vector<std::vector<NodeShape>> levels(heightOf(pin.root));
+		std::vector<const IndexItem*> entries;
+		std::vector<std::pair<const Node*, size_t>> pending{ {pin.root, levels.size() - 1} };
+		while(!pending.empty()) {
+			const Node* node = pending.back().first;
+			size_t level = pending.back().second;
+			pending.pop_back();
+			if(node != pin.root) {
+				levels[level].push_back({node->radius, node->children.size()});
+			}
+			for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+				if(level > 0) {
+					pending.push_back({dynamic_cast<const Node*>(i->second), level - 1});
+				} else if(i->second->entryCount > 0) {
+					entries.push_back(i->second);
+				}
+			}
+		}
+		model->size = entries.size();
+		model->rootChildren = pin.root->children.size();
+
+		for(typename std::vector<std::vector<NodeShape>>::iterator l = levels.begin(); l != levels.end(); ++l) {
+			std::sort(l->begin(), l->end());
+			size_t groups = std::min(l->size(), size_t(CostModel::RADIUS_GROUPS));
+			for(size_t g = 0; g < groups; ++g) {
+				typename CostModel::RadiusGroup group = { 0.0, 0.0, 0.0 };
+				for(size_t i = g * l->size() / groups; i < (g + 1) * l->size() / groups; ++i) {
+					group.nodes += 1.0;
+					group.children += (*l)[i].second;
+					group.radius += (*l)[i].first;
+				}
+				group.radius /= group.nodes;
+				model->groups.push_back(group);
+			}
+		}
+
+		if(entries.size() >= 2) {
+			std::minstd_rand random;
+			std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+			model->distances.reserve(distanceSamples);
+			for(size_t s = 0; s < distanceSamples; ++s) {
+				size_t a = pick(random);
+				size_t b = pick(random);
+				if(a != b) {
+					model->distances.push_back(distance_function(entries[a]->data, entries[b]->data));
+				}
+			}
+			std::sort(model->distances.begin(), model->distances.end());
+		}
+		return model;
+	}
+
+	std::shared_ptr<const CostModel> currentCostModel() const {
+		std::lock_guard<std::mutex> lock(costModelMutex);
+		return costModel;
+	}
+
+	bool prefersScan(const Node* root, double range, size_t limit) const {
+		if(executionMode != AUTOMATIC_EXECUTION) {
+			return executionMode == SCAN_EXECUTION;
+		}
+		if(root == NULL) {
+			return false;
+		}
+
+		size_t size = root->entryCount;
+		std::shared_ptr<const CostModel> model = currentCostModel();
+		if(!model  ||  size / 2 > model->size  ||  size < model->size / 2) {
+			update_cost_model();
+			model = currentCostModel();
+		}
+		return model->estimate(range, limit).distance_computations > scanThreshold * size;
+	}
+
+	// Returns the flat scan of a version of the M-Tree, building it if needed
+	std::shared_ptr<const FlatScan> flatScanOf(const Node* root, unsigned long version) const {
+		{
+			std::lock_guard<std::mutex> lock(flatScanMutex);
+			if(flatScan  &&  flatScan->version == version) {
+				return flatScan;
+			}
+		}
+		std::shared_ptr<const FlatScan> scan = std::make_shared<FlatScan>(root, version);
+		std::lock_guard<std::mutex> lock(flatScanMutex);
+		flatScan = scan;
+		return scan;
+	}
+
+	std::vector<typename query::result_item> scanNearest(const FlatScan& scan, const Data& queryData, double range, size_t limit, size_t numThreads) const {
+		// Each block keeps the nearest entries within it
+		size_t blockSize = std::max(size_t(FlatScan::BLOCK_SIZE), scan.entries.size() / (numThreads * SUBTREES_PER_THREAD) + 1);
+		std::vector<size_t> blocks;
+		for(size_t first = 0; first < scan.entries.size(); first += blockSize) {
+			blocks.push_back(first);
+		}
+		std::vector<std::vector<ItemWithDistances<Entry>>> candidates(blocks.size());
+		runTasks(blocks, numThreads, [&](size_t first) {
+			std::vector<ItemWithDistances<Entry>>& blockCandidates = candidates[first / blockSize];
+			scan.collect(this, queryData, range, first, std::min(first + blockSize, scan.entries.size()), blockCandidates);
+			NearestSearch::keepNearest(blockCandidates, limit);
+		});
+
+		std::vector<ItemWithDistances<Entry>> merged;
+		for(size_t i = 0; i < candidates.size(); ++i) {
+			merged.insert(merged.end(), candidates[i].begin(), candidates[i].end());
+		}
+		NearestSearch::keepNearest(merged, limit);
+		std::sort(merged.begin(), merged.end(),
+			[](const ItemWithDistances<Entry>& a, const ItemWithDistances<Entry>& b) {
+				return a.distance < b.distance;
+			});
+
+		std::vector<typename query::result_item> results(merged.size());
+		for(size_t i = 0; i < merged.size(); ++i) {
+			results[i].data = merged[i].item->data;
+			results[i].distance = merged[i].distance;
+		}
+		return results;
+	}
+
+	static size_t nodeSize(const Node* node) {
+		if(dynamic_cast<const RootLeafNode*>(node) != NULL) return sizeof(RootLeafNode);
+		if(dynamic_cast<const RootNode*>(node)     != NULL) return sizeof(RootNode);
+		if(dynamic_cast<const InternalNode*>(node) != NULL) return sizeof(InternalNode);
+		assert(dynamic_cast<const LeafNode*>(node) != NULL);
+		return sizeof(LeafNode);
+	}
+
+	// Checks pairs of children of the same parents for intersecting balls
+	template <typename LevelStatistics>
+	void sampleSiblingOverlap(const std::vector<const Node*>& parents, size_t pairs, size_t samples, LevelStatistics& levelStats) const {
+		size_t intersecting = 0;
+		auto intersect = [&](const IndexItem* a, const IndexItem* b) {
+			double radii = a->radius + b->radius;
+			if(std::abs(a->distanceToParent - b->distanceToParent) > radii) {
+				return false;
+			}
+			return distance_function(a->data, b->data) <= radii;
+		};
+
+		if(pairs <= samples) {
+			for(typename std::vector<const Node*>::const_iterator p = parents.begin(); p != parents.end(); ++p) {
+				for(typename Node::ChildrenMap::const_iterator i = (*p)->children.begin(); i != (*p)->children.end(); ++i) {
+					typename Node::ChildrenMap::const_iterator j = i;
+					for(++j; j != (*p)->children.end(); ++j) {
+						intersecting += intersect(i->second, j->second);
+					}
+				}
+			}
+			levelStats.sibling_pairs_sampled = pairs;
+		} else {
+			// The parents are picked in proportion to their number of pairs
+			std::vector<size_t> cumulativePairs;
+			size_t total = 0;
+			for(typename std::vector<const Node*>::const_iterator p = parents.begin(); p != parents.end(); ++p) {
+				size_t n = (*p)->children.size();
+				total += n * (n - 1) / 2;
+				cumulativePairs.push_back(total);
+			}
+
+			std::minstd_rand random;
+			std::vector<const IndexItem*> children;
+			for(size_t s = 0; s < samples; ++s) {
+				size_t pair = std::uniform_int_distribution<size_t>(0, total - 1)(random);
+				const Node* parent = parents[std::upper_bound(cumulativePairs.begin(), cumulativePairs.end(), pair) - cumulativePairs.begin()];
+				children.clear();
+				for(typename Node::ChildrenMap::const_iterator i = parent->children.begin(); i != parent->children.end(); ++i) {
+					children.push_back(i->second);
+				}
+				size_t a = std::uniform_int_distribution<size_t>(0, children.size() - 1)(random);
+				size_t b = std::uniform_int_distribution<size_t>(0, children.size() - 2)(random);
+				if(b >= a) {
+					++b;
+				}
+				intersecting += intersect(children[a], children[b]);
+			}
+			levelStats.sibling_pairs_sampled = samples;
+		}
+
+		if(levelStats.sibling_pairs_sampled > 0) {
+			levelStats.sibling_overlap = double(intersecting) / levelStats.sibling_pairs_sampled;
+		}
+	}
+
+	static size_t heightOf(const IndexItem* item) {
+		size_t height = 0;
+		while(const Node* node = dynamic_cast<const Node*>(item)) {
+			item = node->children.begin()->second;
+			++height;
+		}
+		return height;
+	}
+
+	// Stamps the items of another M-Tree as created by the current write
+	void stampSubtree(IndexItem* item) {
+		stamp(item);
+		if(Node* node = dynamic_cast<Node*>(item)) {
+			for(typename Node::ChildrenMap::iterator i = node->children.begin(); i != node->children.end(); ++i) {
+				stampSubtree(i->second);
+			}
+		}
+	}
+
+	void graft(IndexItem* subtree, size_t subtreeHeight) {
+		if(snapshots) {
+			root = writable(root);
+		}
+		double distance = distance_function(subtree->data, root->data);
+		try {
+			root->addSubtree(subtree, heightOf(root) - subtreeHeight - 1, distance, this);
+		} catch(SplitNodeReplacement& e) {
+			replaceSplitRoot(e);
+		}
+	}
+
+	// Moves the children of a node into a new root, and disposes the node
+	Node* newRootFrom(Node* theChild) {
+		Node* newRoot;
+		if(dynamic_cast<InternalNode*>(theChild) != NULL) {
+			newRoot = stamp(new RootNode(theChild->data));
+		} else {
+			assert(dynamic_cast<LeafNode*>(theChild) != NULL);
+			newRoot = stamp(new RootLeafNode(theChild->data));
+		}
+
+		// The new root has the same data as the child, so the distances are kept
+		for(typename Node::ChildrenMap::iterator i = theChild->children.begin(); i != theChild->children.end(); ++i) {
+			IndexItem* grandchild = i->second;
+			newRoot->addChild(grandchild, grandchild->distanceToParent, this);
+		}
+		dispose(theChild);
+		if(instrumented()) {
+			recordEvent(build_event::HEIGHT_DECREASE, heightOf(newRoot));
+		}
+		return newRoot;
+	}
+
+	void replaceSplitRoot(SplitNodeReplacement& e) {
+		Node* newRoot = stamp(new RootNode(root->data));
+		dispose(root);
+		root = newRoot;
+		for(int i = 0; i < SplitNodeReplacement::NUM_NODES; ++i) {
+			Node* newNode = e.newNodes[i];
+			double distance = distance_function(root->data, newNode->data);
+			root->addChild(newNode, distance, this);
+		}
+		if(instrumented()) {
+			recordEvent(build_event::HEIGHT_INCREASE, heightOf(root));
+		}
+	}
+
+	void doAdd(const Data& data, WriteTransaction& transaction) {
+		transaction.revived = false;
+		if(root == NULL) {
+			transaction.upgrade();
+		}
+		if(root == NULL) {
+			root = stamp(new RootLeafNode(data));
+			root->addData(data, 0, this, transaction);
+		} else {
+			if(snapshots) {
+				root = writable(root);
+			}
+			double distance = distance_function(data, root->data);
+			try {
+				root->addData(data, distance, this, transaction);
+			} catch(SplitNodeReplacement& e) {
+				replaceSplitRoot(e);
+			}
+		}
+	}
+
+
+	bool doRemove(const Data& data, WriteTransaction& transaction) {
+		if(root == NULL) {
+			return false;
+		}
+
+		double distanceToRoot = 0.0;
+		if(locatorEnabled) {
+			typename std::map<Data, Node*>::const_iterator i = locator.find(data);
+			if(i == locator.end()) {
+				return false;
+			}
+			transaction.locatedLeaf = i->second;
+		} else {
+			distanceToRoot = distance_function(data, root->data);
+		}
+
+		Node* originalRoot = root;
+		if(snapshots) {
+			root = writable(root);
+		}
+		try {
+			root->removeData(data, distanceToRoot, this, transaction);
+		} catch(RootNodeReplacement& e) {
+			dispose(root);
+			root = e.newRoot;
+		} catch(DataNotFound) {
+			if(snapshots) {
+				root = discardCopy(root, originalRoot);
+			}
+			return false;
+		}
+		return true;
+	}
+
+
+	/*
+	 * Batch removals mark the entries to be removed and all the nodes on
+	 * their paths, and then restructure only the marked nodes.
+	 */
+	void markData(const Data& data, std::set<const IndexItem*>& marked) const {
+		if(locatorEnabled) {
+			typename std::map<Data, Node*>::const_iterator i = locator.find(data);
+			if(i != locator.end()) {
+				marked.insert(i->second->children.find(data)->second);
+				for(const Node* node = i->second; node != root; node = node->parent) {
+					marked.insert(node);
+				}
+				marked.insert(root);
+			}
+		} else {
+			markData(root, data, distance_function(data, root->data), marked);
+		}
+	}
+
+	bool markData(const Node* node, const Data& data, double distance, std::set<const IndexItem*>& marked) const {
+		bool found = false;
+		if(dynamic_cast<const Entry*>(node->children.begin()->second) != NULL) {
+			typename Node::ChildrenMap::const_iterator i = node->children.find(data);
+			if(i != node->children.end()  &&  i->second->entryCount > 0) {
+				marked.insert(i->second);
+				found = true;
+			}
+		} else {
+			for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end()  &&  !found; ++i) {
+				const Node* child = dynamic_cast<const Node*>(i->second);
+				if(std::abs(distance - child->distanceToParent) <= child->radius) {
+					double distanceToChild = distance_function(data, child->data);
+					found = distanceToChild <= child->radius  &&  markData(child, data, distanceToChild, marked);
+				}
+			}
+		}
+		if(found) {
+			marked.insert(node);
+		}
+		return found;
+	}
+
+	template <typename Predicate>
+	bool markMatching(const Node* node, Predicate& predicate, std::set<const IndexItem*>& marked) const {
+		bool found = false;
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			const IndexItem* child = i->second;
+			if(const Node* childNode = dynamic_cast<const Node*>(child)) {
+				found |= markMatching(childNode, predicate, marked);
+			} else if(child->entryCount > 0  &&  predicate(child->data)) {
+				marked.insert(child);
+				found = true;
+			}
+		}
+		if(found) {
+			marked.insert(node);
+		}
+		return found;
+	}
+
+	size_t compactTombstones(double threshold, size_t maxTombstones, WriteTransaction& transaction) {
+		if(root == NULL  ||  root->tombstoneCount == 0  ||  maxTombstones == 0) {
+			return 0;
+		}
+
+		size_t tombstoneCount = root->tombstoneCount;
+		std::set<const IndexItem*> marked;
+		markTombstones(root, threshold, maxTombstones, marked);
+		removeMarked(marked, transaction);
+		return tombstoneCount - ((root == NULL) ? 0 : root->tombstoneCount.load());
+	}
+
+	// Once a subtree exceeds the threshold, all of its tombstones are marked
+	bool markTombstones(const Node* node, double threshold, size_t& budget, std::set<const IndexItem*>& marked) const {
+		bool exceeded = node->tombstoneCount > threshold * (node->entryCount + node->tombstoneCount);
+		bool found = false;
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end()  &&  budget > 0; ++i) {
+			const IndexItem* child = i->second;
+			if(child->tombstoneCount == 0) {
+				continue;
+			}
+			if(const Node* childNode = dynamic_cast<const Node*>(child)) {
+				found |= markTombstones(childNode, exceeded ? 0.0 : threshold, budget, marked);
+			} else if(exceeded) {
+				marked.insert(child);
+				--budget;
+				found = true;
+			}
+		}
+		if(found) {
+			marked.insert(node);
+		}
+		return found;
+	}
+
+	size_t removeMarked(const std::set<const IndexItem*>& marked, WriteTransaction& transaction) {
+		if(marked.empty()) {
+			return 0;
+		}
+
+		if(snapshots) {
+			root = writable(root);
+		}
+		size_t removed = 0;
+		std::vector<std::pair<IndexItem*, size_t>> orphans;
+		condense(root, heightOf(root), marked, removed, orphans);
+
+		// The root is only dissolved when it is left without children, and
+		// replaced by its only child while it is not a leaf
+		while(root != NULL  &&  root->children.size() <= 1) {
+			if(root->children.empty()) {
+				dispose(root);
+				root = NULL;
+			} else if(Node* theChild = dynamic_cast<Node*>(root->children.begin()->second)) {
+				Node* newRoot = newRootFrom(theChild);
+				root->children.clear();
+				dispose(root);
+				root = newRoot;
+			} else {
+				break;
+			}
+		}
+
+		reinsert(orphans, true, transaction);
+		return removed;
+	}
+
+	/*
+	 * Removes the marked entries under a node, which must be writable.
+	 * Children left under their minimum capacity are dissolved, and their
+	 * own children are appended to the orphans, to be added back later.
+	 */
+	void condense(Node* node, size_t height, const std::set<const IndexItem*>& marked, size_t& removed, std::vector<std::pair<IndexItem*, size_t>>& orphans) {
+		node->radius = 0.0;
+		node->entryCount = 0;
+		node->tombstoneCount = 0;
+		node->summary = 0;
+		for(typename Node::ChildrenMap::iterator i = node->children.begin(); i != node->children.end(); ) {
+			IndexItem* child = i->second;
+			if(marked.count(child) > 0) {
+				if(Node* childNode = dynamic_cast<Node*>(child)) {
+					childNode = writableChild(node, childNode);
+					condense(childNode, height - 1, marked, removed, orphans);
+					if(childNode->children.size() < childNode->getMinCapacity(this)) {
+						for(typename Node::ChildrenMap::iterator j = childNode->children.begin(); j != childNode->children.end(); ++j) {
+							orphans.push_back(std::make_pair(j->second, height - 2));
+						}
+						i = node->children.erase(i);
+						dispose(childNode);
+						continue;
+					}
+					child = childNode;
+				} else {
+					if(locatorEnabled  &&  child->entryCount > 0) {
+						locator.erase(child->data);
+					}
+					i = node->children.erase(i);
+					dispose(child);
+					++removed;
+					continue;
+				}
+			}
+
+			double radius = child->distanceToParent + child->radius;
+			if(radius > node->radius) {
+				node->radius = radius;
+			}
+			node->entryCount += child->entryCount;
+			node->tombstoneCount += child->tombstoneCount;
+			node->summary |= child->summary;
+			++i;
+		}
+	}
+
+	bool doUpdate(const Data& oldData, const Data& newData, WriteTransaction& transaction) {
+		if(root == NULL) {
+			return false;
+		}
+
+		double oldDistance = 0.0;
+		if(locatorEnabled) {
+			typename std::map<Data, Node*>::const_iterator i = locator.find(oldData);
+			if(i == locator.end()) {
+				return false;
+			}
+			transaction.locatedLeaf = i->second;
+		} else {
+			oldDistance = distance_function(oldData, root->data);
+		}
+
+		Node* originalRoot = root;
+		if(snapshots) {
+			root = writable(root);
+		}
+		double newDistance = distance_function(newData, root->data);
+		try {
+			root->updateData(oldData, oldDistance, newData, newDistance, this, transaction);
+		} catch(SplitNodeReplacement& e) {
+			replaceSplitRoot(e);
+		} catch(RootNodeReplacement& e) {
+			dispose(root);
+			root = e.newRoot;
+		} catch(DataNotFound) {
+			if(snapshots) {
+				root = discardCopy(root, originalRoot);
+			}
+			return false;
+		}
+		assert(transaction.placed);
+		return true;
+	}
+
+public:
+	/**
+	 * @brief Returns the number of data objects indexed by the M-Tree.
+	 */
+	size_t size() const {
+		ReadPin pin(this);
+		return (pin.root == NULL) ? 0 : pin.root->entryCount.load();
+	}
+
+	/**
+	 * @brief Returns whether the M-Tree is empty.
+	 */
+	bool empty() const {
+		ReadPin pin(this);
+		return pin.root == NULL  ||  pin.root->entryCount == 0;
+	}
+
+
+	/**
+	 * @brief Sets how add() chooses the child of a node under which a data
+	 *        object is added.
+	 * @details This function must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param mode The insertion mode.
+	 */
+	void set_insertion_mode(insertion_mode mode) {
+		insertionMode = mode;
+	}
+
+	/**
+	 * @brief Enables or disables counting the work performed by the writes on
+	 *        the M-Tree.
+	 * @details The counters are retrieved by get_build_stats(). When
+	 *          disabled, which is the default, the writes do not spend any
+	 *          time counting.
+	 *
+	 *          This function must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param enabled Whether the work is counted. Either way, the counters
+	 *        are reset.
+	 */
+	void enable_build_stats(bool enabled = true) {
+		buildCounters.reset(enabled ? new BuildCounters() : NULL);
+	}
+
+	/**
+	 * @brief Returns the counters of the work performed by the writes since
+	 *        enable_build_stats() was called.
+	 * @details It should not be called concurrently with writes, or the
+	 *          counters may be inconsistent among themselves.
+	 */
+	build_stats get_build_stats() const {
+		build_stats stats;
+		if(!buildCounters) {
+			return stats;
+		}
+
+		const BuildCounters& counters = *buildCounters;
+		stats.adds = counters.adds;
+		stats.removes = counters.removes;
+		size_t levels = HISTOGRAM_BUCKETS;
+		while(levels > 0  &&  counters.splitsPerLevel[levels - 1] == 0) {
+			--levels;
+		}
+		for(size_t i = 0; i < levels; ++i) {
+			stats.splits_per_level.push_back(counters.splitsPerLevel[i]);
+		}
+		stats.split_radii = BuildCounters::snapshot(counters.splitRadii);
+		stats.split_distance_computations = counters.splitDistanceComputations;
+		stats.split_distance_cache_hits = counters.splitDistanceCacheHits;
+		stats.donations = counters.donations;
+		stats.merges = counters.merges;
+		stats.height_increases = counters.heightIncreases;
+		stats.height_decreases = counters.heightDecreases;
+		stats.add_nanoseconds = BuildCounters::snapshot(counters.addNanoseconds);
+		stats.remove_nanoseconds = BuildCounters::snapshot(counters.removeNanoseconds);
+		return stats;
+	}
+
+	/**
+	 * @brief Sets a function to be called on each structural change of the
+	 *        M-Tree: node splits, donations and merges, and height changes.
+	 * @details The hook is called while the M-Tree is being modified, so it
+	 *          must not access it. With concurrent writes, it may be called
+	 *          concurrently from several threads.
+	 *
+	 *          This function must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param hook The function, or an empty function to remove the hook.
+	 */
+	void set_build_event_hook(std::function<void(const build_event&)> hook) {
+		buildEventHook = std::move(hook);
+	}
+
+	/**
+	 * @brief Enables or disables snapshot isolation between readers and
+	 *        writers.
+	 * @details When snapshots are enabled, add() and remove() never modify a
+	 *          node that was published by a previous write. The nodes on the
+	 *          path to the modification are copied, and the new root is
+	 *          published when the write completes. Each query, including the
+	 *          iteration of a @c query object, reads the version of the
+	 *          M-Tree that was published when it started, so queries may run
+	 *          in other threads concurrently with a writer and never wait for
+	 *          it. Writers are serialized among themselves. The replaced nodes
+	 *          are reclaimed when no query that could reach them is still
+	 *          alive.
+	 *
+	 *          Snapshots cannot be used together with the locator. This
+	 *          function itself must not be called concurrently with any other
+	 *          operation on the M-Tree, nor while any query is alive.
+	 * @param enabled Whether snapshots should be enabled.
+	 * @throw std::logic_error If the locator is enabled, or if a query is
+	 *        alive.
+	 */
+	void enable_snapshots(bool enabled = true) {
+		if(enabled  &&  locatorEnabled) {
+			throw std::logic_error("snapshots cannot be used together with the locator");
+		}
+		if(!pinnedEpochs.empty()) {
+			throw std::logic_error("snapshots cannot be toggled while a query is alive");
+		}
+		snapshots = enabled;
+		publishedRoot = root;
+		++writeVersion;
+		reclaimRetired(std::numeric_limits<unsigned long>::max());
+		// The versions of the M-Tree are identified differently
+		flatScan.reset();
+	}
+
+
+	/**
+	 * @brief Enables or disables the locator of data objects.
+	 * @details When the locator is enabled, the M-Tree keeps a map from each
+	 *          data object to the leaf where it is stored, and each node keeps
+	 *          a pointer to its parent. remove() then goes straight up from the
+	 *          leaf to the root, without computing any distance to find the
+	 *          data object, nor descending into the subtrees whose covering
+	 *          radius happens to contain it. The cost is the memory of the map
+	 *          and its maintenance on every write. Writes are not run in
+	 *          parallel while the locator is enabled.
+	 *
+	 *          The locator cannot be used together with snapshots. This
+	 *          function itself must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param enabled Whether the locator should be enabled.
+	 * @throw std::logic_error If snapshots are enabled.
+	 */
+	void enable_locator(bool enabled = true) {
+		if(enabled  &&  snapshots) {
+			throw std::logic_error("the locator cannot be used together with snapshots");
+		}
+		locatorEnabled = enabled;
+		locator.clear();
+		if(enabled  &&  root != NULL) {
+			locateSubtree(root);
+		}
+	}
+
+	/**
+	 * @brief Enables or disables caching the results of queries.
+	 * @details When enabled, the results of each iteration of a query which
+	 *          runs to its end are kept, indexed by the query data object, the
+	 *          range and the limit. A later iteration of an equal query fetches
+	 *          them from the cache, without searching the M-Tree. This pays off
+	 *          when the same queries are repeated often. Only the iterations of
+	 *          mtree::query objects use the cache.
+	 *
+	 *          The cache holds at most @c max_results results, added up over
+	 *          the cached queries, where a query without results counts as one.
+	 *          When it is full, the queries which were not fetched recently are
+	 *          evicted, as chosen by the CLOCK algorithm.
+	 *
+	 *          By default, every write invalidates the whole cache, which costs
+	 *          nothing. With precise invalidation, add(), remove() and update()
+	 *          only invalidate the queries whose results could change. Those
+	 *          are the queries whose ball contains the added or removed data
+	 *          object, where the radius of the ball is the distance to their
+	 *          farthest result, if they reached their limit, or else their
+	 *          range. This costs a distance computation per cached query on
+	 *          each of those writes. Other writes still invalidate the whole
+	 *          cache.
+	 *
+	 *          A query only uses or fills the cache if no write has finished
+	 *          since it started, so that it never gets results from another
+	 *          version of the M-Tree.
+	 *
+	 *          This function must not be called concurrently with any other
+	 *          operation on the M-Tree, nor while a query is being iterated.
+	 * @param enabled Whether the results should be cached.
+	 * @param max_results The maximum number of results held by the cache.
+	 * @param precise_invalidation Whether add(), remove() and update() only
+	 *        invalidate the queries whose results they could change.
+	 */
+	void enable_result_cache(bool enabled = true, size_t max_results = DEFAULT_RESULT_CACHE_SIZE, bool precise_invalidation = false) {
+		resultCache.reset(enabled ? new ResultCache(max_results, precise_invalidation) : NULL);
+	}
+
+	/**
+	 * @brief Sets the function which summarizes the data objects, or disables
+	 *        the summaries if it is empty.
+	 * @details Each node keeps the bitwise OR of the summaries of the data
+	 *          objects in its subtree, so that a query with a
+	 *          mtree::query_filter skips the subtrees whose summary has none
+	 *          of the bits of its mask. The summaries of the nodes only grow
+	 *          as data objects are added, and are recomputed when nodes are
+	 *          split, merged or compacted, so they may keep the bits of
+	 *          removed data objects until then. That only makes the queries
+	 *          search more subtrees than needed. The cost is a call to the
+	 *          function on each addition, and a bitmap in each node and entry.
+	 *
+	 *          The summaries of all the data objects are computed by this
+	 *          call. It must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param summary_function The function which summarizes a data object.
+	 */
+	void set_summary_function(std::function<summary_type(const Data&)> summary_function) {
+		summaryFunction = std::move(summary_function);
+		if(summaryFunction  &&  root != NULL) {
+			summarizeSubtree(root);
+		}
+	}
+
+private:
+	void locateSubtree(Node* node) {
+		for(typename Node::ChildrenMap::iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			if(Node* child = dynamic_cast<Node*>(i->second)) {
+				child->parent = node;
+				locateSubtree(child);
+			} else {
+				locator[i->first] = node;
+			}
+		}
+	}
+
+	summary_type summarizeSubtree(IndexItem* item) {
+		if(Node* node = dynamic_cast<Node*>(item)) {
+			node->summary = 0;
+			for(typename Node::ChildrenMap::iterator i = node->children.begin(); i != node->children.end(); ++i) {
+				node->summary |= summarizeSubtree(i->second);
+			}
+		} else {
+			item->summary = summaryFunction(item->data);
+		}
+		return item->summary;
+	}
+
+	summary_type summarize(const Data& data) const {
+		return summaryFunction ? summaryFunction(data) : 0;
+	}
+
+public:
+	/**
+	 * @brief Performs a nearest-neighbors query on the M-Tree, constrained by
+	 *        distance.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @return A @c query object.
+	 */
+	query get_nearest_by_range(const Data& query_data, double range) const {
+		return get_nearest(query_data, range, std::numeric_limits<unsigned int>::max());
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbors query on the M-Tree, constrained by
+	 *        the number of neighbors.
+	 * @param query_data The query data object.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @return A @c query object.
+	 */
+	query get_nearest_by_limit(const Data& query_data, size_t limit) const {
+		return get_nearest(query_data, std::numeric_limits<double>::infinity(), limit);
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbor query on the M-Tree, constrained by
+	 *        distance and/or the number of neighbors.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @return A @c query object.
+	 */
+	query get_nearest(const Data& query_data, double range, size_t limit) const {
+		return {this, query_data, range, limit};
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbor query on the M-Tree, without
+	 *        constraints.
+	 * @param query_data The query data object.
+	 * @return A @c query object.
+	 */
+	query get_nearest(const Data& query_data) const {
+		return {
+			this,
+			query_data,
+			std::numeric_limits<double>::infinity(),
+			std::numeric_limits<unsigned int>::max()
+		};
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbor query on the M-Tree, restricted to
+	 *        the data objects accepted by a filter.
+	 * @details Unlike filtering the results of an unrestricted query, the
+	 *          rejected data objects neither cost distance computations nor
+	 *          count for the limit, so the query fetches @c limit accepted
+	 *          neighbors whenever there are that many within the range. The
+	 *          query always searches the M-Tree, even where the execution
+	 *          mode would scan it, and it does not use the result cache.
+	 * @param query_data The query data object.
+	 * @param filter The filter of the neighbors.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @return A @c query object.
+	 */
+	query get_nearest(const Data& query_data,
+	                  const query_filter& filter,
+	                  double range = std::numeric_limits<double>::infinity(),
+	                  size_t limit = std::numeric_limits<unsigned int>::max()) const
+	{
+		return {this, query_data, range, limit, std::make_shared<const query_filter>(filter)};
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbors query using several threads.
+	 * @details The pending nodes nearest to @c query_data are expanded until
+	 *          there are several subtrees for each thread, and the threads take
+	 *          them, nearest first, from a shared queue. When the query is
+	 *          constrained by the number of neighbors, the distance of the
+	 *          farthest of the nearest neighbors found by any subtree search
+	 *          bounds the other searches. The results of all the searches are
+	 *          merged in the end, so this is only worth it for queries which
+	 *          fetch a large number of results.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @param num_threads The number of threads to use.
+	 * @return The neighbors, in non-decreasing order of distance from
+	 *         @c query_data.
+	 */
+	std::vector<typename query::result_item> get_nearest_parallel(const Data& query_data, double range, size_t limit, size_t num_threads) const {
+		typedef std::pair<double, const IndexItem*> Candidate;
+
+		ReadPin pin(this);
+		if(prefersScan(pin.root, range, limit)) {
+			return scanNearest(*flatScanOf(pin.root, pin.version), query_data, range, limit, num_threads);
+		}
+
+		std::vector<ItemWithDistances<Node>> subtrees;
+		std::vector<ItemWithDistances<Entry>> entries;
+		NearestSearch search;
+		search.start(this, pin.root, query_data, range, limit);
+		search.takeFrontier(SUBTREES_PER_THREAD * num_threads, subtrees, entries);
+		std::sort(subtrees.begin(), subtrees.end(),
+			[](const ItemWithDistances<Node>& a, const ItemWithDistances<Node>& b) {
+				return a.minDistance < b.minDistance;
+			});
+
+		std::vector<Candidate> merged;
+		for(typename std::vector<ItemWithDistances<Entry>>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+			merged.push_back(Candidate(i->distance, i->item));
+		}
+
+		std::atomic<double> sharedBound(range);
+		if(merged.size() >= limit  &&  limit > 0) {
+			std::nth_element(merged.begin(), merged.begin() + (limit - 1), merged.end());
+			sharedBound = std::min(range, merged[limit - 1].first);
+		}
+
+		// Each subtree search keeps its nearest neighbors in a bounded max-heap
+		std::vector<std::vector<Candidate>> candidates(subtrees.size());
+		std::vector<size_t> taskIds(subtrees.size());
+		for(size_t i = 0; i < taskIds.size(); ++i) {
+			taskIds[i] = i;
+		}
+
+		runTasks(taskIds, num_threads, [&](size_t taskId) {
+			const ItemWithDistances<Node>& subtree = subtrees[taskId];
+			std::vector<Candidate>& heap = candidates[taskId];
+			auto visitor = [&](const IndexItem* entry, double distance, double& range) {
+				if(heap.size() == limit) {
+					if(distance >= heap.front().first) {
+						return true;
+					}
+					std::pop_heap(heap.begin(), heap.end());
+					heap.pop_back();
+				}
+				heap.push_back(Candidate(distance, entry));
+				std::push_heap(heap.begin(), heap.end());
+
+				if(heap.size() == limit) {
+					double bound = heap.front().first;
+					double current = sharedBound;
+					while(bound < current  &&  !sharedBound.compare_exchange_weak(current, bound)) {
+					}
+				}
+				range = std::min(range, double(sharedBound));
+				return true;
+			};
+
+			double subtreeRange = sharedBound;
+			if(limit > 0  &&  subtree.minDistance <= subtreeRange) {
+				forEachInRange(subtree.item, subtree.distance, query_data, subtreeRange, visitor);
+			}
+		});
+
+		for(size_t i = 0; i < candidates.size(); ++i) {
+			merged.insert(merged.end(), candidates[i].begin(), candidates[i].end());
+		}
+		std::sort(merged.begin(), merged.end());
+
+		std::vector<typename query::result_item> results;
+		for(size_t i = 0; i < merged.size()  &&  results.size() < limit  &&  merged[i].first <= range; ++i) {
+			typename query::result_item result;
+			result.data = merged[i].second->data;
+			result.distance = merged[i].first;
+			results.push_back(result);
+		}
+		return results;
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbors query by computing the distance to
+	 *        every data object, instead of searching the M-Tree.
+	 * @details The data objects are kept in a contiguous array, which is built
+	 *          on the first scan after each write. With
+	 *          ::mt::functions::euclidean_distance on sequences of numbers,
+	 *          their coordinates are also kept by dimension, and the distances
+	 *          are computed by blocks in loops the compiler can vectorize,
+	 *          giving the same results as the distance function. The array is
+	 *          split among the threads.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @param num_threads The number of threads to use.
+	 * @return The neighbors, in non-decreasing order of distance from
+	 *         @c query_data.
+	 */
+	std::vector<typename query::result_item> scan_nearest(const Data& query_data, double range, size_t limit, size_t num_threads = 1) const {
+		ReadPin pin(this);
+		return scanNearest(*flatScanOf(pin.root, pin.version), query_data, range, limit, num_threads);
+	}
+
+	/**
+	 * @brief Chooses how nearest-neighbors queries are executed.
+	 * @details It applies to get_nearest(), get_nearest_parallel() and
+	 *          query_context. With ::AUTOMATIC_EXECUTION, the number of
+	 *          distance computations of each query is predicted by
+	 *          estimate_cost() when the query starts, and all the data objects
+	 *          are scanned, as by scan_nearest(), if it exceeds
+	 *          @c scan_threshold times the number of data objects. The cost
+	 *          model is rebuilt whenever the size of the M-Tree has halved or
+	 *          doubled since it was built, and the contiguous array scanned is
+	 *          rebuilt by the first scan after each write. Neither rebuild is
+	 *          accounted for by the threshold, so ::AUTOMATIC_EXECUTION pays
+	 *          off when queries outnumber writes, and ::TREE_EXECUTION, the
+	 *          default, is kept otherwise. Either way, the results are the
+	 *          same.
+	 *
+	 *          This function must not be called concurrently with any other
+	 *          operation on the M-Tree.
+	 * @param mode The execution mode.
+	 * @param scan_threshold The fraction of the data objects above which
+	 *        they are scanned, with ::AUTOMATIC_EXECUTION.
+	 */
+	void set_execution_mode(execution_mode mode, double scan_threshold = 0.5) {
+		executionMode = mode;
+		scanThreshold = scan_threshold;
+	}
+
+	/**
+	 * @brief Visits every data object within a distance from a query data
+	 *        object, in no particular order.
+	 * @details The M-Tree is traversed depth-first, without the bookkeeping
+	 *          needed to yield the results in order, and the data objects are
+	 *          passed to the visitor directly from the index, without being
+	 *          copied. This is the fastest way to process all the results of a
+	 *          range query when their order is not relevant.
+	 *
+	 *          The visitor is called as <code>visitor(data, distance, range)</code>,
+	 *          where @c data is a <code>const Data&</code>, @c distance is its
+	 *          distance to @c query_data and @c range is a <code>double&</code>
+	 *          holding the current range, which the visitor may reduce to
+	 *          restrict the rest of the traversal. The visitor must return
+	 *          @c false to stop the traversal or @c true to continue it.
+	 *
+	 *          The M-Tree must not be modified by the visitor.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to visited data
+	 *        objects.
+	 * @param visitor The function or function object called for each data
+	 *        object.
+	 * @return @c false if the visitor stopped the traversal, or @c true if it
+	 *         was completed.
+	 */
+	template <typename Visitor>
+	bool for_each_in_range(const Data& query_data, double range, Visitor visitor) const {
+		ReadPin pin(this);
+		const Node* root = pin.root;
+		if(root == NULL) {
+			return true;
+		}
+
+		double distance = distance_function(query_data, root->data);
+		if(distance - root->radius > range) {
+			return true;
+		}
+
+		auto entryVisitor = [&](const IndexItem* entry, double distance, double& range) {
+			return visitor(entry->data, distance, range);
+		};
+		return forEachInRange(root, distance, query_data, range, entryVisitor);
+	}
+
+	/**
+	 * @brief Counts the data objects within a distance from a query data
+	 *        object.
+	 * @details Each node keeps the number of data objects in its subtree, so
+	 *          whenever a node's covering ball is found to be entirely inside
+	 *          the range, its count is taken as a whole without visiting it.
+	 *
+	 *          The number of distance computations can be limited. When the
+	 *          limit is reached, the subtrees which were not resolved are
+	 *          accounted for in the bounds and the estimate of the result.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to counted data
+	 *        objects.
+	 * @param max_distance_computations The maximum number of distance
+	 *        computations to perform.
+	 * @return A range_count object.
+	 */
+	range_count count_in_range(const Data& query_data, double range, size_t max_distance_computations = -1) const {
+		ReadPin pin(this);
+		const Node* root = pin.root;
+		range_count count = {0, 0, 0.0};
+		if(root == NULL) {
+			return count;
+		}
+
+		if(max_distance_computations == 0) {
+			count.upper = root->entryCount;
+			count.estimate = 0.5 * root->entryCount;
+			return count;
+		}
+
+		size_t budget = max_distance_computations - 1;
+		double distance = distance_function(query_data, root->data);
+		countSubtree(root, distance, distance, query_data, range, budget, count);
+		return count;
+	}
+
+	/**
+	 * @brief Finds all the pairs of data objects, one from this M-Tree and
+	 *        the other from @c that M-Tree, which are within a distance from
+	 *        each other.
+	 * @details Both trees are traversed together. A pair of subtrees is
+	 *          discarded when the distance between their routing objects,
+	 *          or the bound for it given by the distances to their parents,
+	 *          exceeds the sum of their covering radii and @c eps.
+	 *
+	 *          The callback is called as <code>callback(data1, data2, distance)</code>,
+	 *          where @c data1 is from this M-Tree and @c data2 is from
+	 *          @c that M-Tree. When @c num_threads is greater than 1, the
+	 *          pairs of top-level subtrees are processed in parallel, and the
+	 *          callback is called concurrently from several threads.
+	 * @param that The other M-Tree.
+	 * @param eps The maximum distance between the data objects of a pair.
+	 * @param callback The function or function object called for each pair.
+	 * @param num_threads The number of threads to use.
+	 * @see mt::similarity_join()
+	 */
+	template <typename Callback>
+	void similarity_join(const mtree& that, double eps, Callback callback, size_t num_threads = 1) const {
+		ReadPin pin1(this);
+		ReadPin pin2(&that);
+		const Node* root1 = pin1.root;
+		const Node* root2 = pin2.root;
+		if(root1 == NULL  ||  root2 == NULL) {
+			return;
+		}
+
+		double rootsDistance = distance_function(root1->data, root2->data);
+		if(rootsDistance - root1->radius - root2->radius > eps) {
+			return;
+		}
+
+		// The top-level tasks pair each child of this root with each child of that root
+		std::vector<JoinTask> tasks;
+		for(typename Node::ChildrenMap::const_iterator i = root1->children.begin(); i != root1->children.end(); ++i) {
+			const IndexItem* child1 = i->second;
+			if(child1->entryCount == 0  ||  std::abs(rootsDistance - child1->distanceToParent) - child1->radius - root2->radius > eps) {
+				continue;
+			}
+
+			double distanceToRoot2 = distance_function(child1->data, root2->data);
+			for(typename Node::ChildrenMap::const_iterator j = root2->children.begin(); j != root2->children.end(); ++j) {
+				const IndexItem* child2 = j->second;
+				if(child2->entryCount > 0  &&  std::abs(distanceToRoot2 - child2->distanceToParent) - child1->radius - child2->radius <= eps) {
+					tasks.push_back(JoinTask{child1, child2});
+				}
+			}
+		}
+
+		runTasks(tasks, num_threads, [&](const JoinTask& task) {
+			double distance = distance_function(task.item1->data, task.item2->data);
+			joinItems(task.item1, task.item2, distance, eps, callback);
+		});
+	}
+
+	/**
+	 * @brief Finds all the pairs of distinct data objects in this M-Tree
+	 *        which are within a distance from each other.
+	 * @details Each pair is reported only once, in no particular order of its
+	 *          members. See similarity_join() for the other details.
+	 * @param eps The maximum distance between the data objects of a pair.
+	 * @param callback The function or function object called for each pair.
+	 * @param num_threads The number of threads to use.
+	 * @see mt::self_join()
+	 */
+	template <typename Callback>
+	void self_join(double eps, Callback callback, size_t num_threads = 1) const {
+		ReadPin pin(this);
+		const Node* root = pin.root;
+		if(root == NULL) {
+			return;
+		}
+
+		// The top-level tasks are each child of the root joined with itself
+		// and each pair of children of the root
+		std::vector<JoinTask> tasks;
+		for(typename Node::ChildrenMap::const_iterator i = root->children.begin(); i != root->children.end(); ++i) {
+			tasks.push_back(JoinTask{i->second, NULL});
+			typename Node::ChildrenMap::const_iterator j = i;
+			for(++j; j != root->children.end(); ++j) {
+				tasks.push_back(JoinTask{i->second, j->second});
+			}
+		}
+
+		runTasks(tasks, num_threads, [&](const JoinTask& task) {
+			if(task.item2 == NULL) {
+				const Node* node = dynamic_cast<const Node*>(task.item1);
+				if(node != NULL) {
+					selfJoinNode(node, eps, callback);
+				}
+			} else {
+				joinSiblings(task.item1, task.item2, eps, callback);
+			}
+		});
+	}
+
+	/**
+	 * @brief Builds the graph of the k nearest neighbors of every data object
+	 *        in the M-Tree.
+	 * @details The objects of each leaf share their search. The distances
+	 *          between the objects of the same leaf give an upper bound to the
+	 *          distance of the k-th neighbor of each one, and a single range
+	 *          traversal from the routing object of the leaf collects the
+	 *          candidates for all of them. The distances already stored in the
+	 *          leaf then discard most of the candidates of each object without
+	 *          computing distances. Objects in leaves with no more than @c k
+	 *          objects fall back to individual queries.
+	 *
+	 *          The leaves are distributed among @c num_threads threads.
+	 * @param k The number of neighbors of each data object. If the M-Tree has
+	 *        no more than @c k objects, each vertex has all the other ones as
+	 *        neighbors.
+	 * @param num_threads The number of threads to use.
+	 * @return A knn_graph object.
+	 */
+	knn_graph all_knn(size_t k, size_t num_threads = 1) const {
+		knn_graph graph;
+		ReadPin pin(this);
+		const Node* root = pin.root;
+
+		std::vector<const Node*> leaves;
+		if(root != NULL) {
+			collectLeaves(root, leaves);
+		}
+
+		std::unordered_map<const IndexItem*, size_t> vertexIds;
+		for(typename std::vector<const Node*>::const_iterator leaf = leaves.begin(); leaf != leaves.end(); ++leaf) {
+			for(typename Node::ChildrenMap::const_iterator i = (*leaf)->children.begin(); i != (*leaf)->children.end(); ++i) {
+				if(i->second->entryCount > 0) {
+					vertexIds[i->second] = graph.vertices.size();
+					graph.vertices.push_back(i->first);
+				}
+			}
+		}
+
+		size_t n = graph.vertices.size();
+		size_t degree = std::min(k, (n == 0) ? 0 : n - 1);
+		graph.offsets.resize(n + 1);
+		for(size_t v = 0; v <= n; ++v) {
+			graph.offsets[v] = v * degree;
+		}
+		graph.neighbors.resize(n * degree);
+		graph.distances.resize(n * degree);
+
+		if(degree > 0) {
+			runTasks(leaves, num_threads, [&](const Node* leaf) {
+				leafNearestNeighbors(root, leaf, degree, vertexIds, graph);
+			});
+		}
+
+		return graph;
+	}
+
+private:
+
+	// The number of subtrees into which get_nearest_parallel() splits the
+	// search for each thread
+	enum { SUBTREES_PER_THREAD = 8 };
+
+
+	/*
+	 * A bounded max-heap with the nearest neighbors found so far for a data
+	 * object, as pairs of distance and vertex.
+	 */
+	class NeighborCandidates {
+	public:
+		explicit NeighborCandidates(size_t k) : k(k) { }
+
+		double bound() const {
+			return (heap.size() < k) ? std::numeric_limits<double>::infinity() : heap.front().first;
+		}
+
+		void offer(double distance, size_t vertex) {
+			if(distance >= bound()) {
+				return;
+			}
+			if(heap.size() == k) {
+				std::pop_heap(heap.begin(), heap.end());
+				heap.pop_back();
+			}
+			heap.push_back(std::make_pair(distance, vertex));
+			std::push_heap(heap.begin(), heap.end());
+		}
+
+		void store(size_t position, knn_graph& graph) {
+			std::sort_heap(heap.begin(), heap.end());
+			for(size_t i = 0; i < heap.size(); ++i) {
+				graph.distances[position + i] = heap[i].first;
+				graph.neighbors[position + i] = heap[i].second;
+			}
+		}
+
+	private:
+		size_t k;
+		std::vector<std::pair<double, size_t>> heap;
+	};
+
+
+	void collectLeaves(const Node* node, std::vector<const Node*>& leaves) const {
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			const Node* child = dynamic_cast<const Node*>(i->second);
+			if(child == NULL) {
+				leaves.push_back(node);
+				return;
+			}
+			if(child->entryCount > 0) {
+				collectLeaves(child, leaves);
+			}
+		}
+	}
+
+
+	void leafNearestNeighbors(const Node* root,
+	                          const Node* leaf,
+	                          size_t k,
+	                          const std::unordered_map<const IndexItem*, size_t>& vertexIds,
+	                          knn_graph& graph) const
+	{
+		std::vector<const IndexItem*> entries;
+		std::vector<size_t> ids;
+		std::vector<NeighborCandidates> candidates;
+		for(typename Node::ChildrenMap::const_iterator i = leaf->children.begin(); i != leaf->children.end(); ++i) {
+			if(i->second->entryCount > 0) {
+				entries.push_back(i->second);
+				ids.push_back(vertexIds.find(i->second)->second);
+				candidates.push_back(NeighborCandidates(k));
+			}
+		}
+		if(entries.empty()) {
+			return;
+		}
+
+		// The objects of the leaf are the first candidates for each other
+		for(size_t i = 0; i < entries.size(); ++i) {
+			for(size_t j = i + 1; j < entries.size(); ++j) {
+				double bound = std::abs(entries[i]->distanceToParent - entries[j]->distanceToParent);
+				if(bound < candidates[i].bound()  ||  bound < candidates[j].bound()) {
+					double distance = distance_function(entries[i]->data, entries[j]->data);
+					candidates[i].offer(distance, ids[j]);
+					candidates[j].offer(distance, ids[i]);
+				}
+			}
+		}
+
+		// A single range traversal from the routing object of the leaf reaches
+		// every object which can improve the candidates of any object of the leaf
+		double range = 0.0;
+		for(size_t i = 0; i < entries.size(); ++i) {
+			range = std::max(range, entries[i]->distanceToParent + candidates[i].bound());
+		}
+
+		if(range < std::numeric_limits<double>::infinity()) {
+			double distance = distance_function(leaf->data, root->data);
+			auto visitor = [&](const IndexItem* entry, double distanceToLeaf, double&) {
+				typename Node::ChildrenMap::const_iterator inLeaf = leaf->children.find(entry->data);
+				if(inLeaf != leaf->children.end()  &&  inLeaf->second == entry) {
+					return true;
+				}
+
+				size_t id = vertexIds.find(entry)->second;
+				for(size_t i = 0; i < entries.size(); ++i) {
+					if(std::abs(distanceToLeaf - entries[i]->distanceToParent) < candidates[i].bound()) {
+						double distance = distance_function(entries[i]->data, entry->data);
+						candidates[i].offer(distance, id);
+					}
+				}
+				return true;
+			};
+			if(distance - root->radius <= range) {
+				forEachInRange(root, distance, leaf->data, range, visitor);
+			}
+		} else {
+			// The leaf is too small to bound the search
+			NearestSearch search;
+			for(size_t i = 0; i < entries.size(); ++i) {
+				candidates[i] = NeighborCandidates(k);
+				search.start(this, root, entries[i]->data, std::numeric_limits<double>::infinity(), k + 1);
+				while(const ItemWithDistances<Entry>* nearest = search.next()) {
+					if(nearest->item != entries[i]) {
+						candidates[i].offer(nearest->distance, vertexIds.find(nearest->item)->second);
+					}
+				}
+			}
+		}
+
+		for(size_t i = 0; i < entries.size(); ++i) {
+			candidates[i].store(graph.offsets[ids[i]], graph);
+		}
+	}
+
+
+	struct JoinTask {
+		const IndexItem* item1;
+		const IndexItem* item2;
+	};
+
+
+	/*
+	 * Calls function(task) for every task, distributing them among
+	 * numThreads threads.
+	 */
+	template <typename Task, typename Function>
+	static void runTasks(const std::vector<Task>& tasks, size_t numThreads, Function function) {
+		if(numThreads <= 1  ||  tasks.size() <= 1) {
+			for(typename std::vector<Task>::const_iterator i = tasks.begin(); i != tasks.end(); ++i) {
+				function(*i);
+			}
+			return;
+		}
+
+		std::atomic<size_t> nextTask(0);
+		auto worker = [&]() {
+			for(size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+				function(tasks[i]);
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for(size_t i = 1; i < std::min(numThreads, tasks.size()); ++i) {
+			threads.push_back(std::thread(worker));
+		}
+		worker();
+		for(typename std::vector<std::thread>::iterator i = threads.begin(); i != threads.end(); ++i) {
+			i->join();
+		}
+	}
+
+
+	template <typename Callback>
+	void joinItems(const IndexItem* item1, const IndexItem* item2, double distance, double eps, Callback& callback) const {
+		if(distance - item1->radius - item2->radius > eps) {
+			return;
+		}
+
+		const Node* node1 = dynamic_cast<const Node*>(item1);
+		const Node* node2 = dynamic_cast<const Node*>(item2);
+
+		if(node1 == NULL  &&  node2 == NULL) {
+			if(distance <= eps) {
+				callback(item1->data, item2->data, distance);
+			}
+			return;
+		}
+
+		// Expand the subtree with the larger ball
+		if(node1 != NULL  &&  (node2 == NULL  ||  node1->radius >= node2->radius)) {
+			for(typename Node::ChildrenMap::const_iterator i = node1->children.begin(); i != node1->children.end(); ++i) {
+				const IndexItem* child = i->second;
+				if(child->entryCount > 0  &&  std::abs(distance - child->distanceToParent) - child->radius - item2->radius <= eps) {
+					double childDistance = distance_function(child->data, item2->data);
+					joinItems(child, item2, childDistance, eps, callback);
+				}
+			}
+		} else {
+			for(typename Node::ChildrenMap::const_iterator i = node2->children.begin(); i != node2->children.end(); ++i) {
+				const IndexItem* child = i->second;
+				if(child->entryCount > 0  &&  std::abs(distance - child->distanceToParent) - item1->radius - child->radius <= eps) {
+					double childDistance = distance_function(item1->data, child->data);
+					joinItems(item1, child, childDistance, eps, callback);
+				}
+			}
+		}
+	}
+
+
+	template <typename Callback>
+	void joinSiblings(const IndexItem* sibling1, const IndexItem* sibling2, double eps, Callback& callback) const {
+		if(sibling1->entryCount == 0  ||  sibling2->entryCount == 0) {
+			return;
+		}
+
+		double bound = std::abs(sibling1->distanceToParent - sibling2->distanceToParent);
+		if(bound - sibling1->radius - sibling2->radius <= eps) {
+			double distance = distance_function(sibling1->data, sibling2->data);
+			joinItems(sibling1, sibling2, distance, eps, callback);
+		}
+	}
+
+
+	template <typename Callback>
+	void selfJoinNode(const Node* node, double eps, Callback& callback) const {
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			const Node* child = dynamic_cast<const Node*>(i->second);
+			if(child != NULL  &&  child->entryCount > 0) {
+				selfJoinNode(child, eps, callback);
+			}
+
+			typename Node::ChildrenMap::const_iterator j = i;
+			for(++j; j != node->children.end(); ++j) {
+				joinSiblings(i->second, j->second, eps, callback);
+			}
+		}
+	}
+
+
+	void countSubtree(const IndexItem* item, double minDistance, double maxDistance, const Data& queryData, double range, size_t& budget, range_count& count) const {
+		if(item->entryCount == 0  ||  minDistance - item->radius > range) {
+			return;
+		}
+
+		if(maxDistance + item->radius <= range) {
+			count.lower += item->entryCount;
+			count.upper += item->entryCount;
+			count.estimate += item->entryCount;
+			return;
+		}
+
+		if(minDistance != maxDistance) {
+			// The distance is only bounded, so it must be computed
+			if(budget == 0) {
+				double nearest = minDistance - item->radius;
+				double farthest = maxDistance + item->radius;
+				count.upper += item->entryCount;
+				count.estimate += item->entryCount * (range - nearest) / (farthest - nearest);
+				return;
 			}
 
+			--budget;
+			double distance = distance_function(queryData, item->data);
+			countSubtree(item, distance, distance, queryData, range, budget, count);
+			return;
+		}
 
-			const query* _query;
-			result_item currentResultItem;
-			bool isEnd;
-			std::priority_queue<ItemWithDistances<Node>> pendingQueue;
-			double nextPendingMinDistance;
-			std::priority_queue<ItemWithDistances<Entry>> nearestQueue;
-			size_t yieldedCount;
-		};
+		const Node* node = dynamic_cast<const Node*>(item);
+		assert(node != NULL);
+		double distance = minDistance;
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			const IndexItem* child = i->second;
+			double childMinDistance = std::abs(distance - child->distanceToParent);
+			double childMaxDistance = distance + child->distanceToParent;
+			countSubtree(child, childMinDistance, childMaxDistance, queryData, range, budget, count);
+		}
+	}
 
+	template <typename Visitor>
+	bool forEachInRange(const Node* node, double distance, const Data& queryData, double& range, Visitor& visitor) const {
+		for(typename Node::ChildrenMap::const_iterator i = node->children.begin(); i != node->children.end(); ++i) {
+			const IndexItem* child = i->second;
+			if(child->entryCount == 0  ||  std::abs(distance - child->distanceToParent) - child->radius > range) {
+				continue;
+			}
 
-		/**
-		 * @brief Begins the execution of the query and returns an interator
-		 *        which refers to the first result.
-		 */
-		iterator begin() const {
-			return iterator(this);
+			double childDistance = distance_function(queryData, child->data);
+			if(childDistance - child->radius > range) {
+				continue;
+			}
+
+			const Node* childNode = dynamic_cast<const Node*>(child);
+			if(childNode == NULL) {
+				if(!visitor(child, childDistance, range)) {
+					return false;
+				}
+			} else if(!forEachInRange(childNode, childDistance, queryData, range, visitor)) {
+				return false;
+			}
 		}
 
+		return true;
+	}
 
-		/**
-		 * @brief Returns an iterator which informs that there are no more
-		 *        results.
-		 */
-		iterator end() const {
-			return {};
+protected:
+
+	void _check() const {
+#ifndef NDEBUG
+			if(root != NULL) {
+				root->_check(this);
+			}
+#endif
+	}
+
+private:
+
+	typedef std::pair<Data, Data> PromotedPair;
+	typedef std::set<Data> Partition;
+
+
+	size_t minNodeCapacity;
+	size_t maxNodeCapacity;
+	Node* root;
+
+	bool locatorEnabled;
+	std::map<Data, Node*> locator;
+
+	std::function<summary_type(const Data&)> summaryFunction;
+
+	bool tombstones;
+	double compactionThreshold;
+
+	insertion_mode insertionMode;
+
+	enum { HISTOGRAM_BUCKETS = 64 };
+
+	// The bucket of a value in a histogram
+	static size_t histogramBucket(double value) {
+		if(value < 1.0) {
+			return 0;
 		}
+		int exponent;
+		std::frexp(value, &exponent);
+		return exponent;
+	}
 
-	private:
-		const mtree* _mtree;
-		Data data;
-		double range;
-		size_t limit;
+	// The counters of build_stats, which may be updated by concurrent writes
+	struct BuildCounters {
+		typedef std::atomic<size_t> Histogram[HISTOGRAM_BUCKETS];
+
+		std::atomic<size_t> adds;
+		std::atomic<size_t> removes;
+		std::atomic<size_t> splitsPerLevel[HISTOGRAM_BUCKETS];
+		Histogram splitRadii;
+		std::atomic<size_t> splitDistanceComputations;
+		std::atomic<size_t> splitDistanceCacheHits;
+		std::atomic<size_t> donations;
+		std::atomic<size_t> merges;
+		std::atomic<size_t> heightIncreases;
+		std::atomic<size_t> heightDecreases;
+		Histogram addNanoseconds;
+		Histogram removeNanoseconds;
+
+		BuildCounters()
+			: adds(0), removes(0),
+			  splitDistanceComputations(0), splitDistanceCacheHits(0),
+			  donations(0), merges(0),
+			  heightIncreases(0), heightDecreases(0)
+		{
+			for(size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+				splitsPerLevel[i] = 0;
+				splitRadii[i] = 0;
+				addNanoseconds[i] = 0;
+				removeNanoseconds[i] = 0;
+			}
+		}
+
+		static void record(Histogram& histogram, double value) {
+			++histogram[std::min(histogramBucket(value), size_t(HISTOGRAM_BUCKETS - 1))];
+		}
+
+		static histogram snapshot(const Histogram& counters) {
+			histogram histogram;
+			size_t size = HISTOGRAM_BUCKETS;
+			while(size > 0  &&  counters[size - 1] == 0) {
+				--size;
+			}
+			for(size_t i = 0; i < size; ++i) {
+				histogram.buckets.push_back(counters[i]);
+			}
+			return histogram;
+		}
 	};
 
+	std::unique_ptr<BuildCounters> buildCounters;
+	std::function<void(const build_event&)> buildEventHook;
 
+	mutable std::shared_ptr<const CostModel> costModel;
+	mutable std::mutex costModelMutex;
 
-	enum {
-		/**
-		 * @brief The default minimum capacity of nodes in an M-Tree, when not
-		 * specified in the constructor call.
-		 */
-		DEFAULT_MIN_NODE_CAPACITY = 50
-	};
+	execution_mode executionMode;
+	double scanThreshold;
 
+	// Counts the writes, to identify the versions of the M-Tree without snapshots
+	std::atomic<unsigned long> writeCount;
+	mutable std::shared_ptr<const FlatScan> flatScan;
+	mutable std::mutex flatScanMutex;
 
-	/**
-	 * @brief The main constructor of an M-Tree.
-	 *
-	 * @param min_node_capacity The minimum capacity of the nodes of an M-Tree.
-	 *        Should be at least 2.
-	 * @param max_node_capacity The maximum capacity of the nodes of an M-Tree.
-	 *        Should be greater than @c min_node_capacity. If -1 is passed, then
-	 *        the value <code>2*min_node_capacity - 1</code> is used.
-	 * @param distance_function An instance of @c DistanceFunction.
-	 * @param split_function An instance of @c SplitFunction.
+
+	/*
+	 * The results of the query iterations which ran to their end, indexed by
+	 * their query data, range and limit, and evicted by the CLOCK algorithm,
+	 * whose hand goes around the index in key order. All the entries are
+	 * invalidated at once by incrementing the generation.
 	 *
+	 * The finished writes are counted, and the cache is only used or filled
+	 * by a query which saw the current count when it started.
 	 */
-	explicit mtree(
-			size_t min_node_capacity = DEFAULT_MIN_NODE_CAPACITY,
-			size_t max_node_capacity = -1,
-			const DistanceFunction& distance_function = DistanceFunction(),
-			const SplitFunction& split_function = SplitFunction()
-		)
-		: minNodeCapacity(min_node_capacity),
-		  maxNodeCapacity(max_node_capacity),
-		  root(NULL),
-		  distance_function(distance_function),
-		  split_function(split_function)
-	{
-		if(max_node_capacity == size_t(-1)) {
-			this->maxNodeCapacity = 2 * min_node_capacity - 1;
+	class ResultCache {
+	public:
+		typedef std::vector<typename query::result_item> Results;
+
+		std::atomic<unsigned long> writes;
+
+		ResultCache(size_t maxResults, bool preciseInvalidation)
+			: writes(0),
+			  maxResults(maxResults),
+			  preciseInvalidation(preciseInvalidation),
+			  generation(0),
+			  cachedResults(0),
+			  hand(index.end())
+			{}
+
+		std::shared_ptr<const Results> find(const Data& data, double range, size_t limit, unsigned long writesSeen) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if(writes != writesSeen) {
+				return nullptr;
+			}
+			typename Index::iterator i = index.find(Key{data, range, limit});
+			if(i == index.end()) {
+				return nullptr;
+			}
+			if(i->second.generation != generation) {
+				erase(i);
+				return nullptr;
+			}
+			i->second.referenced = true;
+			return i->second.results;
 		}
-	}
 
-	// Cannot copy!
-	mtree(const mtree&) = delete;
+		void store(const Data& data, double range, size_t limit, Results&& results, unsigned long writesSeen) {
+			size_t cost = std::max(results.size(), size_t(1));
+			std::lock_guard<std::mutex> lock(mutex);
+			if(writes != writesSeen  ||  limit == 0  ||  cost > maxResults) {
+				return;
+			}
 
-	// ... but moving is ok.
-	/** @brief Move constructor. */
-	mtree(mtree&& that)
-		: root(that.root),
-		  maxNodeCapacity(that.maxNodeCapacity),
-		  minNodeCapacity(that.minNodeCapacity),
-		  distance_function(that.distance_function),
-		  split_function(that.split_function)
-	{
-		that.root = NULL;
-	}
+			Key key{data, range, limit};
+			typename Index::iterator i = index.find(key);
+			if(i != index.end()) {
+				erase(i);
+			}
+			while(cachedResults + cost > maxResults) {
+				evict();
+			}
+
+			// Only a data object within this distance can change the results
+			double radius = (results.size() < limit) ? range : results.back().distance;
+			std::shared_ptr<const Results> shared = std::make_shared<Results>(std::move(results));
+			index.insert(std::make_pair(std::move(key), CacheEntry{shared, radius, cost, generation, true}));
+			cachedResults += cost;
+		}
 
+		// Called when a write finishes, with the data objects added or removed, if known
+		void written(const mtree* _mtree, const Data* data, const Data* otherData) {
+			std::lock_guard<std::mutex> lock(mutex);
+			++writes;
+			if(!preciseInvalidation  ||  data == NULL) {
+				++generation;
+				return;
+			}
 
-	~mtree() {
-		delete root;
+			for(typename Index::iterator i = index.begin(); i != index.end(); ) {
+				const CacheEntry& entry = i->second;
+				if(entry.generation != generation
+				||  _mtree->distance_function(i->first.data, *data) <= entry.radius
+				||  (otherData != NULL  &&  _mtree->distance_function(i->first.data, *otherData) <= entry.radius)) {
+					i = erase(i);
+				} else {
+					++i;
+				}
+			}
+		}
+
+	private:
+		struct Key {
+			Data data;
+			double range;
+			size_t limit;
+
+			bool operator<(const Key& that) const {
+				if(std::less<Data>()(this->data, that.data)) {
+					return true;
+				}
+				if(std::less<Data>()(that.data, this->data)) {
+					return false;
+				}
+				return this->range < that.range  ||  (this->range == that.range  &&  this->limit < that.limit);
+			}
+		};
+
+		struct CacheEntry {
+			std::shared_ptr<const Results> results;
+			double radius;
+			size_t cost;
+			unsigned long generation;
+			bool referenced;
+		};
+
+		typedef std::map<Key, CacheEntry> Index;
+
+		void evict() {
+			for(;;) {
+				if(hand == index.end()) {
+					hand = index.begin();
+				}
+				CacheEntry& entry = hand->second;
+				if(!entry.referenced  ||  entry.generation != generation) {
+					erase(hand);
+					return;
+				}
+				entry.referenced = false;
+				++hand;
+			}
+		}
+
+		typename Index::iterator erase(typename Index::iterator i) {
+			if(hand == i) {
+				++hand;
+			}
+			cachedResults -= i->second.cost;
+			index.erase(i++);
+			return i;
+		}
+
+		const size_t maxResults;
+		const bool preciseInvalidation;
+		std::mutex mutex;
+		unsigned long generation;
+		size_t cachedResults;
+		Index index;
+		typename Index::iterator hand;
+	};
+
+	std::unique_ptr<ResultCache> resultCache;
+
+	// Informs the result cache that a write finished, when it goes out of scope
+	class ResultCacheInvalidation {
+	public:
+		explicit ResultCacheInvalidation(mtree* _mtree, const Data* data = NULL, const Data* otherData = NULL)
+			: cache(_mtree->resultCache.get()), _mtree(_mtree), data(data), otherData(otherData)
+			{}
+
+		~ResultCacheInvalidation() {
+			if(cache != NULL) {
+				cache->written(_mtree, data, otherData);
+			}
+		}
+
+	private:
+		ResultCache* cache;
+		const mtree* _mtree;
+		const Data* data;
+		const Data* otherData;
+	};
+
+	// Times a write, if the build stats are enabled
+	class WriteTimer {
+	public:
+		WriteTimer(mtree* mtree, std::atomic<size_t> BuildCounters::* count, typename BuildCounters::Histogram BuildCounters::* nanoseconds)
+			: counters(mtree->buildCounters.get()), nanoseconds(nanoseconds)
+		{
+			if(counters != NULL) {
+				++(counters->*count);
+				startTime = std::chrono::steady_clock::now();
+			}
+		}
+
+		~WriteTimer() {
+			if(counters != NULL) {
+				std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - startTime;
+				BuildCounters::record(counters->*nanoseconds, elapsed.count());
+			}
+		}
+
+	private:
+		BuildCounters* counters;
+		typename BuildCounters::Histogram BuildCounters::* nanoseconds;
+		std::chrono::steady_clock::time_point startTime;
+	};
+
+	bool instrumented() const {
+		return buildCounters  ||  buildEventHook;
 	}
 
-	// Cannot copy!
-	mtree& operator=(const mtree&) = delete;
+	void recordSplit(Node* newNodes[2], const cached_distance_function_type& cachedDistanceFunction) {
+		size_t level = heightOf(newNodes[0]) - 1;
+		if(buildCounters) {
+			++buildCounters->splitsPerLevel[std::min(level, size_t(HISTOGRAM_BUCKETS - 1))];
+			BuildCounters::record(buildCounters->splitRadii, newNodes[0]->radius);
+			BuildCounters::record(buildCounters->splitRadii, newNodes[1]->radius);
+			buildCounters->splitDistanceComputations += cachedDistanceFunction.misses();
+			buildCounters->splitDistanceCacheHits += cachedDistanceFunction.hits();
+		}
+		if(buildEventHook) {
+			buildEventHook(build_event{build_event::SPLIT, level, {newNodes[0]->radius, newNodes[1]->radius}});
+		}
+	}
 
-	// ... but moving is ok.
-	/** @brief Move assignment. */
-	mtree& operator=(mtree&& that) {
-		if(&that != this) {
-			std::swap(this->root, that.root);
-			this->minNodeCapacity = that.minNodeCapacity;
-			this->maxNodeCapacity = that.maxNodeCapacity;
-			this->distance_function = std::move(that.distance_function);
-			this->split_function = std::move(that.split_function);
+	void recordEvent(typename build_event::kind_type kind, size_t level) {
+		if(buildCounters) {
+			switch(kind) {
+			case build_event::DONATION:        ++buildCounters->donations;       break;
+			case build_event::MERGE:           ++buildCounters->merges;          break;
+			case build_event::HEIGHT_INCREASE: ++buildCounters->heightIncreases; break;
+			case build_event::HEIGHT_DECREASE: ++buildCounters->heightDecreases; break;
+			default: assert(!"Unexpected event");
+			}
+		}
+		if(buildEventHook) {
+			buildEventHook(build_event{kind, level, {0.0, 0.0}});
 		}
-		return *this;
 	}
 
+	struct RetiredItem {
+		unsigned long epoch;
+		IndexItem* item;
+	};
 
-	/**
-	 * @brief Adds and indexes a data object.
-	 * @details An object that is already indexed should not be added. There is
-	 *          no validation, and the behavior is undefined if done.
-	 * @param data The data object to index.
+	bool snapshots;
+	unsigned long writeVersion;
+	const Node* publishedRoot;
+	unsigned long epoch;
+	mutable std::mutex snapshotMutex;
+	mutable std::map<unsigned long, size_t> pinnedEpochs;
+	std::mutex writerMutex;
+	std::deque<RetiredItem> retired;
+
+
+	/*
+	 * A latch on the structure of the M-Tree. It is held in shared mode by
+	 * writes that run in parallel, and in exclusive mode by writes that
+	 * restructure the M-Tree. A shared holder may try to upgrade to exclusive
+	 * mode, which only succeeds if no other holder is upgrading.
 	 */
-	void add(const Data& data) {
-		if(root == NULL) {
-			root = new RootLeafNode(data);
-			root->addData(data, 0, this);
-		} else {
-			double distance = distance_function(data, root->data);
-			try {
-				root->addData(data, distance, this);
-			} catch(SplitNodeReplacement& e) {
-				Node* newRoot = new RootNode(root->data);
-				delete root;
-				root = newRoot;
-				for(int i = 0; i < SplitNodeReplacement::NUM_NODES; ++i) {
-					Node* newNode = e.newNodes[i];
-					double distance = distance_function(root->data, newNode->data);
-					root->addChild(newNode, distance, this);
+	class StructureLatch {
+	public:
+		StructureLatch() : exclusiveHeld(false), sharedCount(0) { }
+
+		void lockShared() {
+			for(;;) {
+				while(exclusiveHeld) {
+					std::this_thread::yield();
+				}
+				++sharedCount;
+				if(!exclusiveHeld) {
+					return;
 				}
+				--sharedCount;
 			}
 		}
-	}
 
+		void unlockShared() {
+			--sharedCount;
+		}
 
-	/**
-	 * @brief Removes a data object from the M-Tree.
-	 * @param data The data object to be removed.
-	 * @return @c true if and only if the object was found.
+		void lock() {
+			exclusiveMutex.lock();
+			exclusiveHeld = true;
+			while(sharedCount > 0) {
+				std::this_thread::yield();
+			}
+		}
+
+		bool tryUpgrade() {
+			if(!exclusiveMutex.try_lock()) {
+				return false;
+			}
+			exclusiveHeld = true;
+			while(sharedCount > 1) {
+				std::this_thread::yield();
+			}
+			--sharedCount;
+			return true;
+		}
+
+		void unlock() {
+			exclusiveHeld = false;
+			exclusiveMutex.unlock();
+		}
+
+	private:
+		std::mutex exclusiveMutex;
+		std::atomic<bool> exclusiveHeld;
+		std::atomic<size_t> sharedCount;
+	};
+
+	StructureLatch structureLatch;
+
+
+	/*
+	 * Latches the M-Tree for a write. In shared mode, a write may only change
+	 * the entries of a leaf, under the latch of the leaf, without growing its
+	 * radius or splitting it, and the entry counts. Any other change requires
+	 * upgrading to exclusive mode, and WriteRestart is thrown if that is not
+	 * possible, so that the write restarts in exclusive mode. Nothing must be
+	 * changed before upgrading.
+	 *
+	 * When snapshots are enabled, writes are always exclusive, and their
+	 * results are published when they complete.
 	 */
-	bool remove(const Data& data) {
-		if(root == NULL) {
-			return false;
+	class WriteTransaction {
+	public:
+		// The leaf of the data object being removed, when found by the locator
+		Node* locatedLeaf;
+
+		// Whether the data object being added replaced a tombstone
+		bool revived;
+
+		// Whether the new data object of an update was placed
+		bool placed;
+
+		WriteTransaction(mtree* _mtree, bool exclusive)
+			: locatedLeaf(NULL),
+			  revived(false),
+			  placed(false),
+			  _mtree(_mtree),
+			  snapshot(_mtree->snapshots),
+			  _exclusive(exclusive || snapshot || _mtree->locatorEnabled)
+		{
+			++_mtree->writeCount;
+			if(snapshot) {
+				_mtree->writerMutex.lock();
+				++_mtree->writeVersion;
+			} else if(_exclusive) {
+				_mtree->structureLatch.lock();
+			} else {
+				_mtree->structureLatch.lockShared();
+			}
 		}
 
-		double distanceToRoot = distance_function(data, root->data);
-		try {
-			root->removeData(data, distanceToRoot, this);
-		} catch(RootNodeReplacement& e) {
-			delete root;
-			root = e.newRoot;
-		} catch(DataNotFound) {
-			return false;
+		~WriteTransaction() {
+			if(snapshot) {
+				_mtree->publish();
+				_mtree->writerMutex.unlock();
+			} else if(_exclusive) {
+				_mtree->structureLatch.unlock();
+			} else {
+				_mtree->structureLatch.unlockShared();
+			}
+		}
+
+		bool exclusive() const {
+			return _exclusive;
+		}
+
+		// Throws WriteRestart.
+		void upgrade() {
+			if(!_exclusive) {
+				if(!_mtree->structureLatch.tryUpgrade()) {
+					throw WriteRestart();
+				}
+				_exclusive = true;
+			}
+		}
+
+	private:
+		mtree* _mtree;
+		bool snapshot;
+		bool _exclusive;
+	};
+
+
+	void publish() {
+		unsigned long oldestPinnedEpoch;
+		{
+			std::lock_guard<std::mutex> lock(snapshotMutex);
+			publishedRoot = root;
+			++epoch;
+			oldestPinnedEpoch = pinnedEpochs.empty() ? epoch : pinnedEpochs.begin()->first;
 		}
-		return true;
+		reclaimRetired(oldestPinnedEpoch);
 	}
 
 
-	/**
-	 * @brief Performs a nearest-neighbors query on the M-Tree, constrained by
-	 *        distance.
-	 * @param query_data The query data object.
-	 * @param range The maximum distance from @c query_data to fetched neighbors.
-	 * @return A @c query object.
+	/*
+	 * Items retired while the epoch was E were reachable from the version
+	 * published in E, and are no longer reachable from versions published
+	 * later. So they can be reclaimed once no reader pins E or an earlier
+	 * epoch.
 	 */
-	query get_nearest_by_range(const Data& query_data, double range) const {
-		return get_nearest(query_data, range, std::numeric_limits<unsigned int>::max());
+	void reclaimRetired(unsigned long oldestPinnedEpoch) {
+		while(!retired.empty()  &&  retired.front().epoch < oldestPinnedEpoch) {
+			destroy(retired.front().item);
+			retired.pop_front();
+		}
 	}
 
-	/**
-	 * @brief Performs a nearest-neighbors query on the M-Tree, constrained by
-	 *        the number of neighbors.
-	 * @param query_data The query data object.
-	 * @param limit The maximum number of neighbors to fetch.
-	 * @return A @c query object.
-	 */
-	query get_nearest_by_limit(const Data& query_data, size_t limit) const {
-		return get_nearest(query_data, std::numeric_limits<double>::infinity(), limit);
-	}
 
-	/**
-	 * @brief Performs a nearest-neighbor query on the M-Tree, constrained by
-	 *        distance and/or the number of neighbors.
-	 * @param query_data The query data object.
-	 * @param range The maximum distance from @c query_data to fetched neighbors.
-	 * @param limit The maximum number of neighbors to fetch.
-	 * @return A @c query object.
+	/*
+	 * Copy-on-write. Items created by a write are stamped with its version.
+	 * When snapshots are enabled, an item of a previous version may be in use
+	 * by readers, so it is replaced by a copy before being modified, and the
+	 * original is retired.
 	 */
-	query get_nearest(const Data& query_data, double range, size_t limit) const {
-		return {this, query_data, range, limit};
+	template <typename T>
+	T* stamp(T* item) const {
+		item->version = writeVersion;
+		return item;
 	}
 
-	/**
-	 * @brief Performs a nearest-neighbor query on the M-Tree, without
-	 *        constraints.
-	 * @param query_data The query data object.
-	 * @return A @c query object.
-	 */
-	query get_nearest(const Data& query_data) const {
-		return {
-			this,
-			query_data,
-			std::numeric_limits<double>::infinity(),
-			std::numeric_limits<unsigned int>::max()
-		};
+	template <typename T>
+	T* writable(T* item) {
+		if(!snapshots  ||  item->version == writeVersion) {
+			return item;
+		}
+		T* copy = static_cast<T*>(stamp(item->clone()));
+		retired.push_back(RetiredItem{epoch, item});
+		return copy;
 	}
 
-protected:
-
-	void _check() const {
-#ifndef NDEBUG
-			if(root != NULL) {
-				root->_check(this);
-			}
-#endif
+	Node* writableChild(Node* parent, Node* child) {
+		Node* copy = writable(child);
+		if(copy != child) {
+			parent->children.find(child->data)->second = copy;
+		}
+		return copy;
 	}
 
-private:
-
-	typedef std::pair<Data, Data> PromotedPair;
-	typedef std::set<Data> Partition;
+	// Undoes writable() when the copy was left unmodified
+	template <typename T>
+	T* discardCopy(T* copy, T* original) {
+		if(copy != original) {
+			assert(retired.back().item == original);
+			retired.pop_back();
+			destroy(copy);
+		}
+		return original;
+	}
 
+	// Disposes an item that is no longer part of the M-Tree being written
+	void dispose(IndexItem* item) {
+		if(!snapshots  ||  item->version == writeVersion) {
+			destroy(item);
+		} else {
+			retired.push_back(RetiredItem{epoch, item});
+		}
+	}
 
-	size_t minNodeCapacity;
-	size_t maxNodeCapacity;
-	Node* root;
+	// Deletes an item, but not its children, which may still be referenced
+	static void destroy(IndexItem* item) {
+		Node* node = dynamic_cast<Node*>(item);
+		if(node != NULL) {
+			node->children.clear();
+		}
+		delete item;
+	}
 
 protected:
 	DistanceFunction distance_function;
@@ -618,6 +4331,11 @@ public:
 		Data data;
 		double radius;
 		double distanceToParent;
+		std::atomic<size_t> entryCount;
+		std::atomic<size_t> tombstoneCount;
+		// Only maintained while the M-Tree has a summary function
+		std::atomic<summary_type> summary;
+		unsigned long version;
 
 		virtual ~IndexItem() { };
 
@@ -628,16 +4346,36 @@ public:
 		IndexItem& operator=(IndexItem&&) = delete;
 
 	protected:
-		IndexItem(const Data& data)
+		IndexItem(const Data& data, size_t entryCount)
 			: data(data),
 			  radius(0),
-			  distanceToParent(-1)
+			  distanceToParent(-1),
+			  entryCount(entryCount),
+			  tombstoneCount(0),
+			  summary(0),
+			  version(0)
 			{ }
 
+	public:
+		virtual IndexItem* clone() const = 0;
+
+	protected:
+		template <typename T>
+		T* copyTo(T* copy) const {
+			copy->radius = radius;
+			copy->distanceToParent = distanceToParent;
+			copy->entryCount = entryCount.load();
+			copy->tombstoneCount = tombstoneCount.load();
+			copy->summary = summary.load();
+			return copy;
+		}
+
 	public:
 		virtual size_t _check(const mtree* mtree) const {
 			_checkRadius();
 			_checkDistanceToParent();
+			// A later write would take it as its own
+			assert(version <= mtree->writeVersion);
 			return 1;
 		}
 
@@ -664,9 +4402,46 @@ private:
 			}
 		}
 
-		void addData(const Data& data, double distance, const mtree* mtree) throw(SplitNodeReplacement) {
-			doAddData(data, distance, mtree);
+		/*
+		 * Adds a subtree to the descendants of this node which are the given
+		 * number of levels below it. Throws SplitNodeReplacement.
+		 */
+		void addSubtree(IndexItem* subtree, size_t levels, double distance, mtree* mtree) {
+			if(levels == 0) {
+				addChild(subtree, distance, mtree);
+			} else {
+				doAddSubtree(subtree, levels, distance, mtree);
+			}
+			checkMaxCapacity(mtree);
+		}
+
+		// Throws SplitNodeReplacement or WriteRestart.
+		void addData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			doAddData(data, distance, mtree, transaction);
+			// In shared mode, no node gets over its capacity
+			if(transaction.exclusive()) {
+				checkMaxCapacity(mtree);
+			}
+		}
+
+		/*
+		 * Replaces a data object in this subtree with another one. The new
+		 * data object is placed in the lowest node on the path to the old one
+		 * whose ball covers it, and transaction.placed is set once it is.
+		 * Throws SplitNodeReplacement, RootNodeReplacement, NodeUnderCapacity,
+		 * DataNotFound or WriteRestart.
+		 */
+		virtual void updateData(const Data& oldData, double oldDistance, const Data& newData, double newDistance, mtree* mtree, WriteTransaction& transaction) {
+			doUpdateData(oldData, oldDistance, newData, newDistance, mtree, transaction);
 			checkMaxCapacity(mtree);
+			if(children.size() < getMinCapacity(mtree)) {
+				throw NodeUnderCapacity();
+			}
+		}
+
+		// Whether a data object at this distance can be placed in this subtree
+		virtual bool covers(double distance) const {
+			return distance <= this->radius;
 		}
 
 #ifndef NDEBUG
@@ -677,6 +4452,8 @@ private:
 
 			bool   childHeightKnown = false;
 			size_t childHeight;
+			size_t entryCount = 0;
+			size_t tombstoneCount = 0;
 			for(typename ChildrenMap::const_iterator i = children.begin(); i != children.end(); ++i) {
 #ifndef NDEBUG
 				const Data& data = i->first;
@@ -685,7 +4462,11 @@ private:
 
 				assert(child->data == data);
 				_checkChildClass(child);
+				_checkLocator(child, mtree);
 				_checkChildMetrics(child, mtree);
+				entryCount += child->entryCount;
+				tombstoneCount += child->tombstoneCount;
+				_checkSummary(child, mtree);
 
 				size_t height = child->_check(mtree);
 				if(childHeightKnown) {
@@ -695,6 +4476,8 @@ private:
 					childHeightKnown = true;
 				}
 			}
+			assert(this->entryCount == entryCount);
+			assert(this->tombstoneCount == tombstoneCount);
 
 			return childHeight + 1;
 		}
@@ -704,22 +4487,42 @@ private:
 
 		ChildrenMap children;
 
+		// Guards the children of a leaf against other writes in shared mode
+		std::mutex latch;
+
+		// Only maintained while the locator is enabled
+		Node* parent;
+
 	protected:
-		Node(const Data& data) : IndexItem(data) { }
+		Node(const Data& data) : IndexItem(data, 0), parent(NULL) { }
+
+		template <typename T>
+		T* copyTo(T* copy) const {
+			IndexItem::copyTo(copy);
+			copy->children = children;
+			copy->parent = parent;
+			return copy;
+		}
 
-		Node() : IndexItem(*((Data*)(0))) { assert(!"THIS SHOULD NEVER BE CALLED"); };
+		Node() : IndexItem(*((Data*)(0)), 0) { assert(!"THIS SHOULD NEVER BE CALLED"); };
 
 		Node(const Node&) = delete;
 		Node(Node&&) = delete;
 		Node& operator=(const Node&) = delete;
 		Node& operator=(Node&&) = delete;
 
-		virtual void doAddData(const Data& data, double distance, const mtree* mtree) = 0;
+		virtual void doAddData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) = 0;
 
-		virtual void doRemoveData(const Data& data, double distance, const mtree* mtree) throw (DataNotFound) = 0;
+		virtual void doAddSubtree(IndexItem* subtree, size_t levels, double distance, mtree* mtree) = 0;
+
+		// Throws DataNotFound or WriteRestart.
+		virtual void doRemoveData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) = 0;
+
+		// Throws DataNotFound or WriteRestart.
+		virtual void doUpdateData(const Data& oldData, double oldDistance, const Data& newData, double newDistance, mtree* mtree, WriteTransaction& transaction) = 0;
 
 	public:
-		void checkMaxCapacity(const mtree* mtree) throw (SplitNodeReplacement) {
+		void checkMaxCapacity(mtree* mtree) throw (SplitNodeReplacement) {
 			if(children.size() > mtree->maxNodeCapacity) {
 				Partition firstPartition;
 				for(typename ChildrenMap::iterator i = children.begin(); i != children.end(); ++i) {
@@ -736,7 +4539,7 @@ private:
 					Data& promotedData    = (i == 0) ? promoted.first : promoted.second;
 					Partition& partition = (i == 0) ? firstPartition : secondPartition;
 
-					Node* newNode = newSplitNodeReplacement(promotedData);
+					Node* newNode = mtree->stamp(newSplitNodeReplacement(promotedData));
 					for(typename Partition::iterator j = partition.begin(); j != partition.end(); ++j) {
 						const Data& data = *j;
 						IndexItem* child = children[data];
@@ -749,6 +4552,9 @@ private:
 				}
 				assert(children.empty());
 
+				if(mtree->instrumented()) {
+					mtree->recordSplit(newNodes, cachedDistanceFunction);
+				}
 				throw SplitNodeReplacement(newNodes);
 			}
 
@@ -758,11 +4564,13 @@ private:
 		virtual Node* newSplitNodeReplacement(const Data&) const = 0;
 
 	public:
-		virtual void addChild(IndexItem* child, double distance, const mtree* mtree) = 0;
+		virtual void addChild(IndexItem* child, double distance, mtree* mtree) = 0;
 
-		virtual void removeData(const Data& data, double distance, const mtree* mtree) throw (RootNodeReplacement, NodeUnderCapacity, DataNotFound) {
-			doRemoveData(data, distance, mtree);
-			if(children.size() < getMinCapacity(mtree)) {
+		// Throws RootNodeReplacement, NodeUnderCapacity, DataNotFound or WriteRestart.
+		virtual void removeData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			doRemoveData(data, distance, mtree, transaction);
+			// In shared mode, no node gets under its capacity
+			if(transaction.exclusive()  &&  children.size() < getMinCapacity(mtree)) {
 				throw NodeUnderCapacity();
 			}
 		}
@@ -772,11 +4580,14 @@ private:
 	protected:
 		void updateMetrics(IndexItem* child, double distance) {
 			child->distanceToParent = distance;
-			updateRadius(child);
+			this->updateRadius(child);
 		}
 
 		void updateRadius(IndexItem* child) {
-			this->radius = std::max(this->radius, child->distanceToParent + child->radius);
+			double radius = child->distanceToParent + child->radius;
+			if(radius > this->radius) {
+				this->radius = radius;
+			}
 		}
 
 
@@ -790,6 +4601,28 @@ private:
 	protected:
 		virtual void _checkChildClass(IndexItem* child) const = 0;
 
+	private:
+		void _checkSummary(IndexItem* child, const mtree* mtree) const {
+			if(mtree->summaryFunction) {
+				assert((child->summary & ~this->summary) == 0);
+				if(dynamic_cast<const Entry*>(child) != NULL  &&  child->entryCount > 0) {
+					assert(child->summary == mtree->summaryFunction(child->data));
+				}
+			}
+		}
+
+		void _checkLocator(IndexItem* child, const mtree* mtree) const {
+			if(mtree->locatorEnabled) {
+				const Node* childNode = dynamic_cast<const Node*>(child);
+				if(childNode != NULL) {
+					assert(childNode->parent == this);
+				} else if(child->entryCount > 0) {
+					typename std::map<Data, Node*>::const_iterator i = mtree->locator.find(child->data);
+					assert(i != mtree->locator.end()  &&  i->second == this);
+				}
+			}
+		}
+
 	private:
 #ifndef NDEBUG
 		void _checkChildMetrics(IndexItem* child, const mtree* mtree) const {
@@ -808,6 +4641,11 @@ private:
 
 
 	class RootNodeTrait : public virtual Node {
+		// The ball of the root can always grow
+		bool covers(double distance) const {
+			return true;
+		}
+
 		void _checkDistanceToParent() const {
 			assert(this->distanceToParent == -1);
 		}
@@ -826,29 +4664,146 @@ private:
 
 
 	class LeafNodeTrait : public virtual Node {
-		void doAddData(const Data& data, double distance, const mtree* mtree) {
-			Entry* entry = new Entry(data);
-			assert(this->children.find(data) == this->children.end());
+		void doAddData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			if(!transaction.exclusive()) {
+				std::lock_guard<std::mutex> lock(this->latch);
+				if(distance <= this->radius  &&  this->children.size() < mtree->maxNodeCapacity) {
+					addEntry(data, distance, mtree, transaction);
+					return;
+				}
+			}
+
+			transaction.upgrade();
+			addEntry(data, distance, mtree, transaction);
+		}
+
+		void doAddSubtree(IndexItem* subtree, size_t levels, double distance, mtree* mtree) {
+			assert(!"A leaf has no subtrees");
+		}
+
+		void addEntry(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			typename Node::ChildrenMap::iterator i = this->children.find(data);
+			if(i != this->children.end()) {
+				// Only a tombstone can be found, which is revived
+				Entry* entry = mtree->writable(dynamic_cast<Entry*>(i->second));
+				assert(entry->tombstoneCount == 1);
+				i->second = entry;
+				entry->entryCount = 1;
+				entry->tombstoneCount = 0;
+				entry->summary = mtree->summarize(data);
+				++this->entryCount;
+				--this->tombstoneCount;
+				this->summary |= entry->summary;
+				transaction.revived = true;
+				if(mtree->locatorEnabled) {
+					mtree->locator[data] = this;
+				}
+				return;
+			}
+
+			Entry* entry = mtree->stamp(new Entry(data));
+			entry->summary = mtree->summarize(data);
 			this->children[data] = entry;
 			assert(this->children.find(data) != this->children.end());
-			updateMetrics(entry, distance);
+			this->updateMetrics(entry, distance);
+			++this->entryCount;
+			this->summary |= entry->summary;
+			if(mtree->locatorEnabled) {
+				mtree->locator[data] = this;
+			}
 		}
 
-		void addChild(IndexItem* child, double distance, const mtree* mtree) {
+		void addChild(IndexItem* child, double distance, mtree* mtree) {
+			child = mtree->writable(child);
 			assert(this->children.find(child->data) == this->children.end());
 			this->children[child->data] = child;
 			assert(this->children.find(child->data) != this->children.end());
-			updateMetrics(child, distance);
+			this->updateMetrics(child, distance);
+			this->entryCount += child->entryCount;
+			this->tombstoneCount += child->tombstoneCount;
+			this->summary |= child->summary;
+			if(mtree->locatorEnabled  &&  child->entryCount > 0) {
+				mtree->locator[child->data] = this;
+			}
 		}
 
 		Node* newSplitNodeReplacement(const Data& data) const {
 			return new LeafNode(data);
 		}
 
-		void doRemoveData(const Data& data, double distance, const mtree* mtree) throw (DataNotFound) {
-			if(this->children.erase(data) == 0) {
+		// Throws DataNotFound or WriteRestart.
+		void doRemoveData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			if(mtree->tombstones) {
+				// The leaf keeps its children, so no write needs to be exclusive
+				std::lock_guard<std::mutex> lock(this->latch);
+				buryEntry(data, mtree);
+				return;
+			}
+
+			if(!transaction.exclusive()) {
+				std::lock_guard<std::mutex> lock(this->latch);
+				if(this->children.size() > this->getMinCapacity(mtree)) {
+					removeEntry(data, mtree);
+					return;
+				}
+				if(this->children.find(data) == this->children.end()) {
+					throw DataNotFound{data};
+				}
+			}
+
+			transaction.upgrade();
+			removeEntry(data, mtree);
+		}
+
+		// Throws DataNotFound.
+		void removeEntry(const Data& data, mtree* mtree) {
+			typename Node::ChildrenMap::iterator i = this->children.find(data);
+			if(i == this->children.end()) {
+				throw DataNotFound{data};
+			}
+			IndexItem* entry = i->second;
+			this->children.erase(i);
+			--this->entryCount;
+			if(mtree->locatorEnabled) {
+				mtree->locator.erase(data);
+			}
+			mtree->dispose(entry);
+		}
+
+		// Replaces an entry with a tombstone. Throws DataNotFound.
+		void buryEntry(const Data& data, mtree* mtree) {
+			typename Node::ChildrenMap::iterator i = this->children.find(data);
+			if(i == this->children.end()  ||  i->second->entryCount == 0) {
 				throw DataNotFound{data};
 			}
+			Entry* entry = mtree->writable(dynamic_cast<Entry*>(i->second));
+			i->second = entry;
+			entry->entryCount = 0;
+			entry->tombstoneCount = 1;
+			--this->entryCount;
+			++this->tombstoneCount;
+			if(mtree->locatorEnabled) {
+				mtree->locator.erase(data);
+			}
+		}
+
+		// Throws DataNotFound or WriteRestart.
+		void doUpdateData(const Data& oldData, double oldDistance, const Data& newData, double newDistance, mtree* mtree, WriteTransaction& transaction) {
+			typename Node::ChildrenMap::iterator i = this->children.find(oldData);
+			if(i == this->children.end()  ||  i->second->entryCount == 0) {
+				throw DataNotFound{oldData};
+			}
+
+			if(this->covers(newDistance)) {
+				// Update in place
+				removeEntry(oldData, mtree);
+				addEntry(newData, newDistance, mtree, transaction);
+				transaction.placed = true;
+			} else if(mtree->tombstones) {
+				buryEntry(oldData, mtree);
+			} else {
+				removeEntry(oldData, mtree);
+			}
 		}
 
 
@@ -859,12 +4814,22 @@ private:
 
 
 	class NonLeafNodeTrait : public virtual Node {
-		void doAddData(const Data& data, double distance, const mtree* mtree) {
-			struct CandidateChild {
-				Node* node;
-				double distance;
-				double metric;
-			};
+		struct CandidateChild {
+			Node* node;
+			double distance;
+			double metric;
+		};
+
+		/*
+		 * Chooses the child where a data object should be added, or a subtree
+		 * with the given radius around it: the nearest child whose ball covers
+		 * it, or else the one whose radius would increase the least. The
+		 * distance is from the data object to this node.
+		 */
+		CandidateChild chooseChild(const Data& data, double radius, double distance, mtree* mtree) {
+			if(mtree->insertionMode != EXHAUSTIVE_INSERTION) {
+				return chooseChildBounded(data, radius, distance, mtree);
+			}
 
 			CandidateChild minRadiusIncreaseNeeded = { NULL, -1.0, std::numeric_limits<double>::infinity() };
 			CandidateChild nearestDistance         = { NULL, -1.0, std::numeric_limits<double>::infinity() };
@@ -873,8 +4838,8 @@ private:
 				Node* child = dynamic_cast<Node*>(i->second);
 				assert(child != NULL);
 				double distance = mtree->distance_function(child->data, data);
-				if(distance > child->radius) {
-					double radiusIncrease = distance - child->radius;
+				if(distance + radius > child->radius) {
+					double radiusIncrease = distance + radius - child->radius;
 					if(radiusIncrease < minRadiusIncreaseNeeded.metric) {
 						minRadiusIncreaseNeeded = { child, distance, radiusIncrease };
 					}
@@ -885,35 +4850,117 @@ private:
 				}
 			}
 
-			CandidateChild chosen = (nearestDistance.node != NULL)
-			                      ? nearestDistance
-			                      : minRadiusIncreaseNeeded;
+			return (nearestDistance.node != NULL)
+			     ? nearestDistance
+			     : minRadiusIncreaseNeeded;
+		}
+
+		CandidateChild chooseChildBounded(const Data& data, double radius, double distance, mtree* mtree) {
+			// Each candidate starts with the lower bound of its distance
+			std::vector<CandidateChild> candidates;
+			candidates.reserve(this->children.size());
+			for(typename Node::ChildrenMap::iterator i = this->children.begin(); i != this->children.end(); ++i) {
+				Node* child = dynamic_cast<Node*>(i->second);
+				assert(child != NULL);
+				candidates.push_back({ child, -1.0, std::abs(distance - child->distanceToParent) });
+			}
+			std::sort(candidates.begin(), candidates.end(), [](const CandidateChild& a, const CandidateChild& b) {
+				return a.metric < b.metric;
+			});
+
+			CandidateChild minRadiusIncreaseNeeded = { NULL, -1.0, std::numeric_limits<double>::infinity() };
+			CandidateChild nearestDistance         = { NULL, -1.0, std::numeric_limits<double>::infinity() };
+
+			for(typename std::vector<CandidateChild>::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+				Node* child = i->node;
+				double lowerBound = i->metric;
+				if(lowerBound >= nearestDistance.metric) {
+					// No other child can be a nearer one which covers it
+					break;
+				}
+
+				bool mayCover = lowerBound + radius <= child->radius;
+				if(!mayCover  &&  (nearestDistance.node != NULL  ||  lowerBound + radius - child->radius >= minRadiusIncreaseNeeded.metric)) {
+					continue;
+				}
+
+				double distance = mtree->distance_function(child->data, data);
+				if(distance + radius > child->radius) {
+					double radiusIncrease = distance + radius - child->radius;
+					if(radiusIncrease < minRadiusIncreaseNeeded.metric) {
+						minRadiusIncreaseNeeded = { child, distance, radiusIncrease };
+					}
+				} else {
+					nearestDistance = { child, distance, distance };
+					if(mtree->insertionMode == FIRST_FIT_INSERTION) {
+						break;
+					}
+				}
+			}
+
+			return (nearestDistance.node != NULL)
+			     ? nearestDistance
+			     : minRadiusIncreaseNeeded;
+		}
+
+		void doAddData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			CandidateChild chosen = chooseChild(data, 0.0, distance, mtree);
+			Node* child = mtree->writableChild(this, chosen.node);
+			try {
+				child->addData(data, chosen.distance, mtree, transaction);
+				this->updateRadius(child);
+				this->summary |= child->summary;
+			} catch(SplitNodeReplacement& e) {
+				replaceSplitChild(child, e, mtree);
+			}
+			++this->entryCount;
+			if(transaction.revived) {
+				--this->tombstoneCount;
+			}
+		}
 
-			Node* child = chosen.node;
+		void doAddSubtree(IndexItem* subtree, size_t levels, double distance, mtree* mtree) {
+			size_t entryCount = subtree->entryCount;
+			size_t tombstoneCount = subtree->tombstoneCount;
+			summary_type summary = subtree->summary;
+			CandidateChild chosen = chooseChild(subtree->data, subtree->radius, distance, mtree);
+			Node* child = mtree->writableChild(this, chosen.node);
 			try {
-				child->addData(data, chosen.distance, mtree);
-				updateRadius(child);
+				child->addSubtree(subtree, levels - 1, chosen.distance, mtree);
+				this->updateRadius(child);
 			} catch(SplitNodeReplacement& e) {
-				// Replace current child with new nodes
+				replaceSplitChild(child, e, mtree);
+			}
+			this->entryCount += entryCount;
+			this->tombstoneCount += tombstoneCount;
+			this->summary |= summary;
+		}
+
+		void replaceSplitChild(Node* child, SplitNodeReplacement& e, mtree* mtree) {
+			// Replace current child with new nodes
 #ifndef NDEBUG
-				size_t _ =
+			size_t _ =
 #endif
-					this->children.erase(child->data);
-				assert(_ == 1);
-				delete child;
-
-				for(int i = 0; i < e.NUM_NODES; ++i) {
-					Node* newChild = e.newNodes[i];
-					double distance = mtree->distance_function(this->data, newChild->data);
-					addChild(newChild, distance, mtree);
-				}
+				this->children.erase(child->data);
+			assert(_ == 1);
+			this->entryCount -= child->entryCount;
+			this->tombstoneCount -= child->tombstoneCount;
+			mtree->dispose(child);
+
+			for(int i = 0; i < e.NUM_NODES; ++i) {
+				Node* newChild = e.newNodes[i];
+				double distance = mtree->distance_function(this->data, newChild->data);
+				addChild(newChild, distance, mtree);
 			}
 		}
 
 
-		void addChild(IndexItem* newChild_, double distance, const mtree* mtree) {
-			Node* newChild = dynamic_cast<Node*>(newChild_);
+		void addChild(IndexItem* newChild_, double distance, mtree* mtree) {
+			Node* newChild = mtree->writable(dynamic_cast<Node*>(newChild_));
 			assert(newChild != NULL);
+			this->entryCount += newChild->entryCount;
+			this->tombstoneCount += newChild->tombstoneCount;
+			this->summary |= newChild->summary;
 
 			struct ChildWithDistance {
 				Node* child;
@@ -932,9 +4979,10 @@ private:
 				typename Node::ChildrenMap::iterator i = this->children.find(newChild->data);
 				if(i == this->children.end()) {
 					this->children[newChild->data] = newChild;
-					updateMetrics(newChild, distance);
+					newChild->parent = this;
+					this->updateMetrics(newChild, distance);
 				} else {
-					Node* existingChild = dynamic_cast<Node*>(this->children[newChild->data]);
+					Node* existingChild = mtree->writableChild(this, dynamic_cast<Node*>(i->second));
 					assert(existingChild != NULL);
 					assert(existingChild->data == newChild->data);
 
@@ -943,8 +4991,7 @@ private:
 						IndexItem* grandchild = i->second;
 						existingChild->addChild(grandchild, grandchild->distanceToParent, mtree);
 					}
-					newChild->children.clear();
-					delete newChild;
+					mtree->dispose(newChild);
 
 					try {
 						existingChild->checkMaxCapacity(mtree);
@@ -954,7 +5001,7 @@ private:
 #endif
 							this->children.erase(existingChild->data);
 						assert(_ == 1);
-						delete existingChild;
+						mtree->dispose(existingChild);
 
 						for(int i = 0; i < e.NUM_NODES; ++i) {
 							Node* newNode = e.newNodes[i];
@@ -972,24 +5019,29 @@ private:
 		}
 
 
-		void doRemoveData(const Data& data, double distance, const mtree* mtree) throw (DataNotFound) {
+		// Throws DataNotFound or WriteRestart.
+		void doRemoveData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
+			if(transaction.locatedLeaf != NULL) {
+				// Go straight to the child on the way up from the leaf
+				Node* child = transaction.locatedLeaf;
+				while(child->parent != this) {
+					child = child->parent;
+				}
+#ifndef NDEBUG
+				bool removed =
+#endif
+					removeFromChild(this->children.find(child->data), data, 0.0, mtree, transaction);
+				assert(removed);
+				return;
+			}
+
 			for(typename Node::ChildrenMap::iterator i = this->children.begin(); i != this->children.end(); ++i) {
 				Node* child = dynamic_cast<Node*>(i->second);
 				assert(child != NULL);
-				if(abs(distance - child->distanceToParent) <= child->radius) {
+				if(std::abs(distance - child->distanceToParent) <= child->radius) {
 					double distanceToChild = mtree->distance_function(data, child->data);
-					if(distanceToChild <= child->radius) {
-						try {
-							child->removeData(data, distanceToChild, mtree);
-							updateRadius(child);
-							return;
-						} catch(DataNotFound&) {
-							// If DataNotFound was thrown, then the data was not found in the child
-						} catch(NodeUnderCapacity&) {
-							Node* expandedChild = balanceChildren(child, mtree);
-							updateRadius(expandedChild);
-							return;
-						}
+					if(distanceToChild <= child->radius  &&  removeFromChild(i, data, distanceToChild, mtree, transaction)) {
+						return;
 					}
 				}
 			}
@@ -997,8 +5049,105 @@ private:
 			throw DataNotFound{data};
 		}
 
+		// Throws WriteRestart.
+		bool removeFromChild(typename Node::ChildrenMap::iterator i, const Data& data, double distanceToChild, mtree* mtree, WriteTransaction& transaction) {
+			Node* original = dynamic_cast<Node*>(i->second);
+			Node* child = mtree->writableChild(this, original);
+			try {
+				child->removeData(data, distanceToChild, mtree, transaction);
+				this->updateRadius(child);
+				--this->entryCount;
+				if(mtree->tombstones) {
+					++this->tombstoneCount;
+				}
+				return true;
+			} catch(DataNotFound&) {
+				// If DataNotFound was thrown, then the data was not found in the child
+				if(child != original) {
+					i->second = mtree->discardCopy(child, original);
+				}
+				return false;
+			} catch(NodeUnderCapacity&) {
+				Node* expandedChild = balanceChildren(child, mtree);
+				this->updateRadius(expandedChild);
+				--this->entryCount;
+				return true;
+			}
+		}
+
+		// Throws DataNotFound or WriteRestart.
+		void doUpdateData(const Data& oldData, double oldDistance, const Data& newData, double newDistance, mtree* mtree, WriteTransaction& transaction) {
+			bool found = false;
+			if(transaction.locatedLeaf != NULL) {
+				Node* child = transaction.locatedLeaf;
+				while(child->parent != this) {
+					child = child->parent;
+				}
+				found = updateChild(this->children.find(child->data), oldData, 0.0, newData, mtree, transaction);
+				assert(found);
+			} else {
+				// The iterator may be invalidated once the child is updated
+				for(typename Node::ChildrenMap::iterator i = this->children.begin(); i != this->children.end(); ++i) {
+					Node* child = dynamic_cast<Node*>(i->second);
+					assert(child != NULL);
+					if(std::abs(oldDistance - child->distanceToParent) <= child->radius) {
+						double distanceToChild = mtree->distance_function(oldData, child->data);
+						if(distanceToChild <= child->radius  &&  updateChild(i, oldData, distanceToChild, newData, mtree, transaction)) {
+							found = true;
+							break;
+						}
+					}
+				}
+			}
+
+			if(!found) {
+				throw DataNotFound{oldData};
+			}
+
+			if(!transaction.placed  &&  this->covers(newDistance)) {
+				doAddData(newData, newDistance, mtree, transaction);
+				transaction.placed = true;
+			}
+		}
+
+		// Throws WriteRestart.
+		bool updateChild(typename Node::ChildrenMap::iterator i, const Data& oldData, double distanceToChild, const Data& newData, mtree* mtree, WriteTransaction& transaction) {
+			Node* original = dynamic_cast<Node*>(i->second);
+			Node* child = mtree->writableChild(this, original);
+			size_t entryCount = child->entryCount;
+			size_t tombstoneCount = child->tombstoneCount;
+			double newDistanceToChild = mtree->distance_function(newData, child->data);
+
+			// The counts of this node follow the changes of the child
+			try {
+				child->updateData(oldData, distanceToChild, newData, newDistanceToChild, mtree, transaction);
+				this->updateRadius(child);
+				this->summary |= child->summary;
+			} catch(DataNotFound&) {
+				if(child != original) {
+					i->second = mtree->discardCopy(child, original);
+				}
+				return false;
+			} catch(SplitNodeReplacement& e) {
+				this->entryCount += e.newNodes[0]->entryCount + e.newNodes[1]->entryCount - entryCount;
+				this->tombstoneCount += e.newNodes[0]->tombstoneCount + e.newNodes[1]->tombstoneCount - tombstoneCount;
+				replaceSplitChild(child, e, mtree);
+				return true;
+			} catch(NodeUnderCapacity&) {
+				this->entryCount += child->entryCount - entryCount;
+				this->tombstoneCount += child->tombstoneCount - tombstoneCount;
+				this->summary |= child->summary;
+				Node* expandedChild = balanceChildren(child, mtree);
+				this->updateRadius(expandedChild);
+				return true;
+			}
+			this->entryCount += child->entryCount - entryCount;
+			this->tombstoneCount += child->tombstoneCount - tombstoneCount;
+			return true;
+		}
+
 
-		Node* balanceChildren(Node* theChild, const mtree* mtree) {
+		Node* balanceChildren(Node* theChild, mtree* mtree) {
 			// Tries to find anotherChild which can donate a grand-child to theChild.
 
 			Node* nearestDonor = NULL;
@@ -1028,20 +5177,24 @@ private:
 
 			if(nearestDonor == NULL) {
 				// Merge
+				nearestMergeCandidate = mtree->writableChild(this, nearestMergeCandidate);
 				for(typename Node::ChildrenMap::iterator i = theChild->children.begin(); i != theChild->children.end(); ++i) {
 					IndexItem* grandchild = i->second;
 					double distance = mtree->distance_function(grandchild->data, nearestMergeCandidate->data);
 					nearestMergeCandidate->addChild(grandchild, distance, mtree);
 				}
 
-				theChild->children.clear();
 				this->children.erase(theChild->data);
-				delete theChild;
+				mtree->dispose(theChild);
+				if(mtree->instrumented()) {
+					mtree->recordEvent(build_event::MERGE, heightOf(nearestMergeCandidate) - 1);
+				}
 				return nearestMergeCandidate;
 			} else {
 				// Donate
+				nearestDonor = mtree->writableChild(this, nearestDonor);
 				// Look for the nearest grandchild
-				IndexItem* nearestGrandchild;
+				IndexItem* nearestGrandchild = NULL;
 				double nearestGrandchildDistance = std::numeric_limits<double>::infinity();
 				for(typename Node::ChildrenMap::iterator i = nearestDonor->children.begin(); i != nearestDonor->children.end(); ++i) {
 					IndexItem* grandchild = i->second;
@@ -1057,7 +5210,12 @@ private:
 #endif
 					nearestDonor->children.erase(nearestGrandchild->data);
 				assert(_ == 1);
+				nearestDonor->entryCount -= nearestGrandchild->entryCount;
+				nearestDonor->tombstoneCount -= nearestGrandchild->tombstoneCount;
 				theChild->addChild(nearestGrandchild, nearestGrandchildDistance, mtree);
+				if(mtree->instrumented()) {
+					mtree->recordEvent(build_event::DONATION, heightOf(theChild) - 1);
+				}
 				return theChild;
 			}
 		}
@@ -1074,9 +5232,14 @@ private:
 	public:
 		RootLeafNode(const Data& data) : Node(data) { }
 
-		void removeData(const Data& data, double distance, const mtree* mtree) throw (RootNodeReplacement, DataNotFound) {
+		IndexItem* clone() const {
+			return this->copyTo(new RootLeafNode(this->data));
+		}
+
+		// Throws RootNodeReplacement, DataNotFound or WriteRestart.
+		void removeData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
 			try {
-				Node::removeData(data, distance, mtree);
+				Node::removeData(data, distance, mtree, transaction);
 			} catch (NodeUnderCapacity&) {
 				assert(this->children.empty());
 				throw RootNodeReplacement{NULL};
@@ -1096,27 +5259,33 @@ private:
 	public:
 		RootNode(const Data& data) : Node(data) {}
 
+		IndexItem* clone() const {
+			return this->copyTo(new RootNode(this->data));
+		}
+
 	private:
-		void removeData(const Data& data, double distance, const mtree* mtree) throw (RootNodeReplacement, NodeUnderCapacity, DataNotFound) {
+		// Throws RootNodeReplacement, NodeUnderCapacity, DataNotFound or WriteRestart.
+		void removeData(const Data& data, double distance, mtree* mtree, WriteTransaction& transaction) {
 			try {
-				Node::removeData(data, distance, mtree);
+				Node::removeData(data, distance, mtree, transaction);
 			} catch(NodeUnderCapacity&) {
 				// Promote the only child to root
 				Node* theChild = dynamic_cast<Node*>(this->children.begin()->second);
-				Node* newRoot;
-				if(dynamic_cast<InternalNode*>(theChild) != NULL) {
-					newRoot = new RootNode(theChild->data);
-				} else {
-					assert(dynamic_cast<LeafNode*>(theChild) != NULL);
-					newRoot = new RootLeafNode(theChild->data);
-				}
+				Node* newRoot = mtree->newRootFrom(theChild);
+				this->children.clear();
 
-				for(typename Node::ChildrenMap::iterator i = theChild->children.begin(); i != theChild->children.end(); ++i) {
-					IndexItem* grandchild = i->second;
-					double distance = mtree->distance_function(newRoot->data, grandchild->data);
-					newRoot->addChild(grandchild, distance, mtree);
-				}
-				theChild->children.clear();
+				throw RootNodeReplacement{newRoot};
+			}
+		}
+
+		// Throws SplitNodeReplacement, RootNodeReplacement, DataNotFound or WriteRestart.
+		void updateData(const Data& oldData, double oldDistance, const Data& newData, double newDistance, mtree* mtree, WriteTransaction& transaction) {
+			try {
+				Node::updateData(oldData, oldDistance, newData, newDistance, mtree, transaction);
+			} catch(NodeUnderCapacity&) {
+				Node* theChild = dynamic_cast<Node*>(this->children.begin()->second);
+				Node* newRoot = mtree->newRootFrom(theChild);
+				this->children.clear();
 
 				throw RootNodeReplacement{newRoot};
 			}
@@ -1136,23 +5305,67 @@ private:
 	class InternalNode : public NonRootNodeTrait, public NonLeafNodeTrait {
 	public:
 		InternalNode(const Data& data) : Node(data) { }
+
+		IndexItem* clone() const {
+			return this->copyTo(new InternalNode(this->data));
+		}
 	};
 
 
 	class LeafNode : public NonRootNodeTrait, public LeafNodeTrait {
 	public:
 		LeafNode(const Data& data) : Node(data) { }
+
+		IndexItem* clone() const {
+			return this->copyTo(new LeafNode(this->data));
+		}
 	};
 
 
 	class Entry : public IndexItem {
 	public:
-		Entry(const Data& data) : IndexItem(data) { }
+		Entry(const Data& data) : IndexItem(data, 1) { }
+
+		IndexItem* clone() const {
+			return this->copyTo(new Entry(this->data));
+		}
 	};
 };
 
 
 
+/**
+ * @brief Finds all the pairs of data objects, one from each M-Tree, which are
+ *        within a distance from each other.
+ * @see mtree::similarity_join()
+ */
+template <typename Data, typename DistanceFunction, typename SplitFunction, typename Callback>
+void similarity_join(const mtree<Data, DistanceFunction, SplitFunction>& tree_a,
+                     const mtree<Data, DistanceFunction, SplitFunction>& tree_b,
+                     double eps,
+                     Callback callback,
+                     size_t num_threads = 1)
+{
+	tree_a.similarity_join(tree_b, eps, callback, num_threads);
+}
+
+
+/**
+ * @brief Finds all the pairs of distinct data objects in an M-Tree which are
+ *        within a distance from each other.
+ * @see mtree::self_join()
+ */
+template <typename Data, typename DistanceFunction, typename SplitFunction, typename Callback>
+void self_join(const mtree<Data, DistanceFunction, SplitFunction>& tree,
+               double eps,
+               Callback callback,
+               size_t num_threads = 1)
+{
+	tree.self_join(eps, callback, num_threads);
+}
+
+
+
 } /* namespace mtree */
 
 
@@ -0,0 +1,284 @@
+#ifndef MTREE_FOREST_H_
+#define MTREE_FOREST_H_
+
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "mtree.h"
+
+
+
+namespace mt {
+
+
+
+/**
+ * @brief A logical index made of several independent M-Trees, called shards.
+ * @details Each data object is stored in the shard chosen by the partition
+ *          function. The shards can be written and queried concurrently from
+ *          different threads, since they share nothing. Nearest-neighbors
+ *          queries are performed on every shard, and their results merged.
+ *
+ * @tparam Data The type of data that will be indexed. See ::mt::mtree.
+ * @tparam DistanceFunction The type of the distance function. See
+ *         ::mt::mtree.
+ * @tparam SplitFunction The type of the split function. See ::mt::mtree.
+ * @tparam PartitionFunction The type of the function that assigns a data
+ *         object to a shard, called as
+ *         <code>partition_function(data, num_shards)</code>. By default, it is
+ *         ::mt::functions::hash_partition. ::mt::functions::pivot_partition
+ *         partitions by clusters instead.
+ */
+template <
+	typename Data,
+	typename DistanceFunction = ::mt::functions::euclidean_distance,
+	typename SplitFunction = ::mt::functions::split_function<
+	        ::mt::functions::random_promotion,
+	        ::mt::functions::balanced_partition
+		>,
+	typename PartitionFunction = ::mt::functions::hash_partition
+>
+class mtree_forest {
+public:
+	/** @brief The type of the shards. */
+	typedef mtree<Data, DistanceFunction, SplitFunction> mtree_type;
+
+	/** @brief The type of the results of nearest-neighbors queries. */
+	typedef typename mtree_type::query::result_item result_item;
+
+
+	/**
+	 * @brief The main constructor of a forest.
+	 * @param num_shards The number of shards. Should be at least 1.
+	 * @param min_node_capacity See ::mt::mtree::mtree().
+	 * @param max_node_capacity See ::mt::mtree::mtree().
+	 * @param distance_function An instance of @c DistanceFunction.
+	 * @param split_function An instance of @c SplitFunction.
+	 * @param partition_function An instance of @c PartitionFunction.
+	 */
+	explicit mtree_forest(
+			size_t num_shards,
+			size_t min_node_capacity = mtree_type::DEFAULT_MIN_NODE_CAPACITY,
+			size_t max_node_capacity = -1,
+			const DistanceFunction& distance_function = DistanceFunction(),
+			const SplitFunction& split_function = SplitFunction(),
+			const PartitionFunction& partition_function = PartitionFunction()
+		)
+		: partition_function(partition_function)
+	{
+		assert(num_shards > 0);
+		shards.reserve(num_shards);
+		for(size_t i = 0; i < num_shards; ++i) {
+			shards.emplace_back(min_node_capacity, max_node_capacity, distance_function, split_function);
+		}
+	}
+
+
+	/** @brief Returns the number of shards. */
+	size_t shard_count() const {
+		return shards.size();
+	}
+
+	/** @brief Returns the i-th shard. */
+	mtree_type& shard(size_t i) {
+		return shards[i];
+	}
+
+	/** @brief Returns the i-th shard. */
+	const mtree_type& shard(size_t i) const {
+		return shards[i];
+	}
+
+	/** @brief Returns the index of the shard where a data object is stored. */
+	size_t shard_of(const Data& data) const {
+		return partition_function(data, shards.size());
+	}
+
+
+	/**
+	 * @brief Adds and indexes a data object in its shard.
+	 * @param data The data object to index.
+	 */
+	void add(const Data& data) {
+		shards[shard_of(data)].add(data);
+	}
+
+	/**
+	 * @brief Adds and indexes a range of data objects, filling the shards in
+	 *        parallel.
+	 * @param first The beginning of the range.
+	 * @param last The end of the range.
+	 * @param num_threads The number of threads to use. Each shard is filled by
+	 *        a single thread.
+	 */
+	template <typename InputIterator>
+	void add(InputIterator first, InputIterator last, size_t num_threads = 1) {
+		std::vector<std::vector<Data>> partitions(shards.size());
+		for(; first != last; ++first) {
+			partitions[shard_of(*first)].push_back(*first);
+		}
+
+		forEachShard(num_threads, [&](size_t i) {
+			for(typename std::vector<Data>::const_iterator data = partitions[i].begin(); data != partitions[i].end(); ++data) {
+				shards[i].add(*data);
+			}
+		});
+	}
+
+	/**
+	 * @brief Removes a data object from its shard.
+	 * @param data The data object to be removed.
+	 * @return @c true if and only if the object was found.
+	 */
+	bool remove(const Data& data) {
+		return shards[shard_of(data)].remove(data);
+	}
+
+	/** @brief Returns the number of data objects indexed in all the shards. */
+	size_t size() const {
+		size_t size = 0;
+		for(typename std::vector<mtree_type>::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+			size += i->size();
+		}
+		return size;
+	}
+
+
+	/**
+	 * @brief Performs a nearest-neighbors query on all the shards.
+	 * @details With a single thread, the incremental queries of the shards
+	 *          are merged through a heap, and each one only advances as far
+	 *          as the merge needs it. With more threads, the shards are queried
+	 *          in parallel and their results are collected into a shared
+	 *          bounded heap. Once the heap has @c limit results, the distance
+	 *          of the farthest one is a global bound, and each shard stops as
+	 *          soon as its next result is beyond it.
+	 * @param query_data The query data object.
+	 * @param range The maximum distance from @c query_data to fetched neighbors.
+	 * @param limit The maximum number of neighbors to fetch.
+	 * @param num_threads The number of threads to use.
+	 * @return The neighbors, in non-decreasing order of distance from
+	 *         @c query_data.
+	 */
+	std::vector<result_item> get_nearest(const Data& query_data, double range, size_t limit, size_t num_threads = 1) const {
+		if(num_threads <= 1  ||  limit == 0) {
+			return mergeNearest(query_data, range, limit);
+		}
+
+		std::vector<result_item> heap;
+		std::mutex heapMutex;
+		std::atomic<double> bound(range);
+		auto fartherResult = [](const result_item& a, const result_item& b) {
+			return a.distance < b.distance;
+		};
+
+		forEachShard(num_threads, [&](size_t i) {
+			typename mtree_type::query query = shards[i].get_nearest(query_data, range, limit);
+			for(typename mtree_type::query::iterator result = query.begin(); result != query.end(); ++result) {
+				if(result->distance > bound) {
+					break;
+				}
+
+				std::lock_guard<std::mutex> lock(heapMutex);
+				if(heap.size() == limit) {
+					if(result->distance >= heap.front().distance) {
+						break;
+					}
+					std::pop_heap(heap.begin(), heap.end(), fartherResult);
+					heap.pop_back();
+				}
+				heap.push_back(*result);
+				std::push_heap(heap.begin(), heap.end(), fartherResult);
+				if(heap.size() == limit) {
+					bound = heap.front().distance;
+				}
+			}
+		});
+
+		std::sort_heap(heap.begin(), heap.end(), fartherResult);
+		return heap;
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbors query on all the shards, constrained
+	 *        by distance.
+	 * @see get_nearest()
+	 */
+	std::vector<result_item> get_nearest_by_range(const Data& query_data, double range, size_t num_threads = 1) const {
+		return get_nearest(query_data, range, std::numeric_limits<unsigned int>::max(), num_threads);
+	}
+
+	/**
+	 * @brief Performs a nearest-neighbors query on all the shards, constrained
+	 *        by the number of neighbors.
+	 * @see get_nearest()
+	 */
+	std::vector<result_item> get_nearest_by_limit(const Data& query_data, size_t limit, size_t num_threads = 1) const {
+		return get_nearest(query_data, std::numeric_limits<double>::infinity(), limit, num_threads);
+	}
+
+
+private:
+
+	std::vector<result_item> mergeNearest(const Data& query_data, double range, size_t limit) const {
+		typedef typename mtree_type::query::iterator QueryIterator;
+		typedef std::pair<double, size_t> Head;
+
+		std::vector<typename mtree_type::query> queries;
+		std::vector<QueryIterator> iterators;
+		std::vector<Head> heads;
+		queries.reserve(shards.size());
+		iterators.reserve(shards.size());
+		for(size_t i = 0; i < shards.size(); ++i) {
+			queries.push_back(shards[i].get_nearest(query_data, range, limit));
+			iterators.push_back(queries[i].begin());
+			if(iterators[i] != queries[i].end()) {
+				heads.push_back(Head(iterators[i]->distance, i));
+			}
+		}
+		std::make_heap(heads.begin(), heads.end(), std::greater<Head>());
+
+		std::vector<result_item> results;
+		while(!heads.empty()  &&  results.size() < limit) {
+			std::pop_heap(heads.begin(), heads.end(), std::greater<Head>());
+			size_t i = heads.back().second;
+			heads.pop_back();
+
+			results.push_back(*iterators[i]);
+			++iterators[i];
+			if(iterators[i] != queries[i].end()) {
+				heads.push_back(Head(iterators[i]->distance, i));
+				std::push_heap(heads.begin(), heads.end(), std::greater<Head>());
+			}
+		}
+		return results;
+	}
+
+
+	// Calls function(i) for the index of every shard, distributing them among numThreads threads
+	template <typename Function>
+	void forEachShard(size_t numThreads, Function function) const {
+		std::vector<size_t> shardIndexes(shards.size());
+		for(size_t i = 0; i < shardIndexes.size(); ++i) {
+			shardIndexes[i] = i;
+		}
+		mtree_type::runTasks(shardIndexes, numThreads, function);
+	}
+
+
+	std::vector<mtree_type> shards;
+	PartitionFunction partition_function;
+};
+
+
+
+} /* namespace mt */
+
+
+
+#endif /* MTREE_FOREST_H_ */
@@ -0,0 +1,329 @@
+#ifndef MTREE_TUNER_H_
+#define MTREE_TUNER_H_
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "mtree.h"
+
+
+
+namespace mt {
+
+
+
+/**
+ * @brief Chooses the node capacities and the split function of an M-Tree for
+ *        a dataset and a query workload.
+ * @details Each candidate configuration, a split function and a minimum node
+ *          capacity, is evaluated by building an M-Tree with a sample of the
+ *          data objects and running a sample of the queries on it. The
+ *          candidates are ranked by the distances computed per query, which
+ *          is deterministic for a given tree, or by the time per query, and
+ *          the best one within the memory and build-time constraints is
+ *          recommended.
+ *
+ *          The split functions are types, so they must be registered with
+ *          add_split_policy() under a name, which identifies them in the
+ *          results. If none is registered, only the default split function of
+ *          ::mt::mtree is evaluated, under the name <code>"default"</code>.
+ *
+ * @tparam Data The type of data that will be indexed. See ::mt::mtree.
+ * @tparam DistanceFunction The type of the distance function. See
+ *         ::mt::mtree.
+ */
+template <
+	typename Data,
+	typename DistanceFunction = ::mt::functions::euclidean_distance
+>
+class mtree_tuner {
+public:
+	/** @brief A query of the sample workload. */
+	struct query_type {
+		/** @brief The query data object. */
+		Data data;
+
+		/** @brief The maximum distance to the fetched neighbors. */
+		double range;
+
+		/** @brief The maximum number of neighbors to fetch. */
+		size_t limit;
+	};
+
+	/** @brief The measurements of a candidate configuration. */
+	struct result_type {
+		/** @brief The name of the split function. */
+		std::string split_policy;
+
+		/** @brief The minimum capacity of the nodes. */
+		size_t min_node_capacity;
+
+		/** @brief The maximum capacity of the nodes. */
+		size_t max_node_capacity;
+
+		/** @brief The time taken to add the sample, in seconds. */
+		double build_seconds;
+
+		/** @brief The memory used by the M-Tree with the sample, in bytes. */
+		size_t memory_bytes;
+
+		/** @brief The average number of distances computed by a query. */
+		double distances_per_query;
+
+		/** @brief The average time taken by a query, in seconds. */
+		double seconds_per_query;
+
+		/** @brief Whether the memory and build-time constraints are met. */
+		bool feasible;
+	};
+
+	/** @brief What the recommended configuration minimizes. */
+	enum objective_type {
+		/** @brief The distances computed per query. */
+		MINIMIZE_DISTANCES,
+
+		/** @brief The time taken per query. */
+		MINIMIZE_TIME
+	};
+
+
+	/**
+	 * @brief The main constructor of a tuner.
+	 * @param sample The data objects which will be indexed by each candidate.
+	 *        Should be representative of the dataset, and as large as the
+	 *        time available for tuning allows.
+	 * @param queries The queries which will be run on each candidate.
+	 * @param distance_function An instance of @c DistanceFunction.
+	 */
+	mtree_tuner(
+			const std::vector<Data>& sample,
+			const std::vector<query_type>& queries,
+			const DistanceFunction& distance_function = DistanceFunction()
+		)
+		: sample(sample),
+		  queries(queries),
+		  distance_function(distance_function),
+		  capacities({ 4, 8, 16, 32, 64, 128 }),
+		  maxMemory(std::numeric_limits<size_t>::max()),
+		  maxBuildSeconds(std::numeric_limits<double>::infinity()),
+		  objective(MINIMIZE_DISTANCES)
+		{}
+
+
+	/**
+	 * @brief Registers a split function to be evaluated.
+	 * @param name The name that identifies the split function in the results.
+	 * @param split_function An instance of @c SplitFunction.
+	 */
+	template <typename SplitFunction>
+	void add_split_policy(const std::string& name, const SplitFunction& split_function = SplitFunction()) {
+		splitPolicies.push_back(SplitPolicy(name, [name, split_function](const mtree_tuner& tuner, size_t minNodeCapacity) {
+			return tuner.evaluateCandidate(name, minNodeCapacity, split_function);
+		}));
+	}
+
+	/**
+	 * @brief Sets the minimum node capacities to be evaluated. By default,
+	 *        they are 4, 8, 16, 32, 64 and 128. The maximum capacities are the
+	 *        default ones of ::mt::mtree.
+	 */
+	void set_capacities(const std::vector<size_t>& min_node_capacities) {
+		capacities = min_node_capacities;
+	}
+
+	/** @brief Sets the maximum memory of a feasible configuration, in bytes. */
+	void set_max_memory(size_t bytes) {
+		maxMemory = bytes;
+	}
+
+	/**
+	 * @brief Sets the maximum time to add the sample to a feasible
+	 *        configuration, in seconds.
+	 */
+	void set_max_build_seconds(double seconds) {
+		maxBuildSeconds = seconds;
+	}
+
+	/**
+	 * @brief Sets the function that tells the memory owned by a data object.
+	 * @see mtree::statistics()
+	 */
+	void set_payload_size(std::function<size_t(const Data&)> payload_size) {
+		payloadSize = std::move(payload_size);
+	}
+
+	/** @brief Sets what the recommended configuration minimizes. */
+	void set_objective(objective_type objective) {
+		this->objective = objective;
+	}
+
+
+	/**
+	 * @brief Evaluates every candidate configuration.
+	 * @details The candidates are evaluated in parallel, each one by a single
+	 *          thread. The times are measured on each thread, so they are
+	 *          comparable among themselves only if there are enough processors
+	 *          for the threads. The distances computed are not affected.
+	 *
+	 *          Each candidate is evaluated with its own copy of the distance
+	 *          function. With more than one thread, the copies are called
+	 *          concurrently, so they must not share any state which is not
+	 *          thread-safe.
+	 *
+	 *          The queries are always executed on the trees, so that the
+	 *          candidates are compared by their structure, and not by the
+	 *          automatic choice of a scan.
+	 * @param num_threads The number of threads to use.
+	 * @return The results, in the order of the split functions and then of the
+	 *         capacities.
+	 */
+	std::vector<result_type> evaluate(size_t num_threads = 1) const {
+		std::vector<SplitPolicy> policies = splitPolicies;
+		if(policies.empty()) {
+			typename mtree<Data, DistanceFunction>::split_function_type split;
+			policies.push_back(SplitPolicy("default", [split](const mtree_tuner& tuner, size_t minNodeCapacity) {
+				return tuner.evaluateCandidate("default", minNodeCapacity, split);
+			}));
+		}
+
+		std::vector<result_type> results(policies.size() * capacities.size());
+		std::atomic<size_t> nextCandidate(0);
+		auto worker = [&]() {
+			for(size_t i = nextCandidate++; i < results.size(); i = nextCandidate++) {
+				results[i] = policies[i / capacities.size()].evaluate(*this, capacities[i % capacities.size()]);
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for(size_t i = 1; i < std::min(num_threads, results.size()); ++i) {
+			threads.push_back(std::thread(worker));
+		}
+		worker();
+		for(typename std::vector<std::thread>::iterator i = threads.begin(); i != threads.end(); ++i) {
+			i->join();
+		}
+		return results;
+	}
+
+	/**
+	 * @brief Returns the best of the results, according to the objective.
+	 * @details Feasible results are always preferred. If no result is
+	 *          feasible, the best of the infeasible ones is returned, which
+	 *          can be told by its @c feasible member.
+	 * @param results The results of evaluate(). Must not be empty.
+	 */
+	result_type best(const std::vector<result_type>& results) const {
+		assert(!results.empty());
+		return *std::min_element(results.begin(), results.end(), [this](const result_type& a, const result_type& b) {
+			if(a.feasible != b.feasible) {
+				return a.feasible;
+			}
+			if(objective == MINIMIZE_TIME) {
+				return a.seconds_per_query < b.seconds_per_query;
+			}
+			return a.distances_per_query < b.distances_per_query;
+		});
+	}
+
+	/**
+	 * @brief Evaluates every candidate configuration and returns the best.
+	 * @see evaluate()
+	 * @see best()
+	 */
+	result_type recommend(size_t num_threads = 1) const {
+		return best(evaluate(num_threads));
+	}
+
+	/**
+	 * @brief Constructs an empty M-Tree with a configuration.
+	 * @tparam SplitFunction The split function named by the
+	 *         @c split_policy of the result.
+	 * @param result The configuration, usually returned by recommend().
+	 * @param split_function An instance of @c SplitFunction.
+	 */
+	template <typename SplitFunction = typename mtree<Data, DistanceFunction>::split_function_type>
+	mtree<Data, DistanceFunction, SplitFunction> construct(const result_type& result, const SplitFunction& split_function = SplitFunction()) const {
+		return mtree<Data, DistanceFunction, SplitFunction>(result.min_node_capacity, result.max_node_capacity, distance_function, split_function);
+	}
+
+
+private:
+	// A split function, with its type erased
+	struct SplitPolicy {
+		typedef std::function<result_type(const mtree_tuner&, size_t)> Evaluator;
+
+		std::string name;
+		Evaluator evaluate;
+
+		SplitPolicy(const std::string& name, Evaluator evaluate)
+			: name(name), evaluate(std::move(evaluate))
+			{}
+	};
+
+
+	template <typename SplitFunction>
+	result_type evaluateCandidate(const std::string& name, size_t minNodeCapacity, const SplitFunction& splitFunction) const {
+		typedef mtree<Data, DistanceFunction, SplitFunction> MTree;
+		typedef std::chrono::steady_clock Clock;
+
+		// A copy for this candidate alone, since candidates are evaluated in parallel
+		DistanceFunction distanceFunction(distance_function);
+		MTree mtree(minNodeCapacity, -1, distanceFunction, splitFunction);
+		mtree.set_execution_mode(MTree::TREE_EXECUTION);
+
+		result_type result;
+		result.split_policy = name;
+		result.min_node_capacity = minNodeCapacity;
+		result.max_node_capacity = 2 * minNodeCapacity - 1;
+
+		Clock::time_point begin = Clock::now();
+		for(typename std::vector<Data>::const_iterator i = sample.begin(); i != sample.end(); ++i) {
+			mtree.add(*i);
+		}
+		result.build_seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+		result.memory_bytes = mtree.statistics(0, payloadSize).memory.total();
+
+		size_t distances = 0;
+		begin = Clock::now();
+		for(typename std::vector<query_type>::const_iterator q = queries.begin(); q != queries.end(); ++q) {
+			typename MTree::query query = mtree.get_nearest(q->data, q->range, q->limit);
+			query.collect_stats();
+			for(typename MTree::query::iterator r = query.begin(); r != query.end(); ++r) {
+				// Only iterates
+			}
+			distances += query.stats().distance_computations;
+		}
+		double querySeconds = std::chrono::duration<double>(Clock::now() - begin).count();
+		result.distances_per_query = queries.empty() ? 0 : double(distances) / queries.size();
+		result.seconds_per_query = queries.empty() ? 0 : querySeconds / queries.size();
+
+		result.feasible = result.memory_bytes <= maxMemory  &&  result.build_seconds <= maxBuildSeconds;
+		return result;
+	}
+
+
+	std::vector<Data> sample;
+	std::vector<query_type> queries;
+	DistanceFunction distance_function;
+	std::vector<SplitPolicy> splitPolicies;
+	std::vector<size_t> capacities;
+	size_t maxMemory;
+	double maxBuildSeconds;
+	std::function<size_t(const Data&)> payloadSize;
+	objective_type objective;
+};
+
+
+
+} /* namespace mt */
+
+
+
+#endif /* MTREE_TUNER_H_ */
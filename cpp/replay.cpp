@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mtree.h"
+#include "tests/fixture.h"
+#include "latency.h"
+
+using namespace std;
+
+
+/*
+ * Replays fixture files, in the format of tests/fixtures/<name>.txt, as timed
+ * workloads, and prints the latencies of each kind of operation, as CSV or,
+ * with --json, as JSON. Large fixtures can be made by generate-fixture.
+ *
+ * Usage: replay [--json] [--threads N] [--min-capacity N]
+ *               [--execution automatic|tree|scan] FIXTURE-FILE...
+ *
+ * Each action adds ('A') or removes ('R') a data object, or does neither
+ * ('Q'), and is followed by a query by range and a query by limit, which are
+ * skipped when the radius is negative or the limit is zero.
+ *
+ * With several threads, the actions are distributed by the hash of their data
+ * objects, so that the writes of each data object keep their order, and
+ * snapshots are enabled, so that the queries may run concurrently with the
+ * writes.
+ */
+
+
+enum {
+	DEFAULT_MIN_NODE_CAPACITY = 16,
+};
+
+const char* const OPERATIONS[] = { "add", "remove", "range", "knn" };
+enum Operation { ADD, REMOVE, RANGE, KNN, NUM_OPERATIONS };
+
+
+typedef Fixture::Data Data;
+typedef mt::mtree<Data> MTree;
+
+
+
+struct Latencies {
+	vector<double> nanoseconds[NUM_OPERATIONS];
+	size_t results = 0;
+	size_t failedRemovals = 0;
+
+	void merge(const Latencies& other) {
+		for(size_t op = 0; op < NUM_OPERATIONS; ++op) {
+			nanoseconds[op].insert(nanoseconds[op].end(), other.nanoseconds[op].begin(), other.nanoseconds[op].end());
+		}
+		results += other.results;
+		failedRemovals += other.failedRemovals;
+	}
+};
+
+
+struct Summary {
+	string operation;
+	vector<double> latencies;
+	double seconds;
+
+	// The number of latencies in each bucket, where bucket i holds the
+	// latencies below 2^i nanoseconds, and not in a previous bucket
+	MTree::histogram histogram() const {
+		MTree::histogram histogram;
+		for(vector<double>::const_iterator i = latencies.begin(); i != latencies.end(); ++i) {
+			size_t bucket = (*i < 1) ? 0 : ilogb(*i) + 1;
+			if(bucket >= histogram.buckets.size()) {
+				histogram.buckets.resize(bucket + 1);
+			}
+			++histogram.buckets[bucket];
+		}
+		return histogram;
+	}
+};
+
+
+
+size_t hashData(const Data& data) {
+	size_t hash = 0;
+	for(Data::const_iterator i = data.begin(); i != data.end(); ++i) {
+		hash = hash * 31 + size_t(*i);
+	}
+	return hash;
+}
+
+
+void perform(const MTree& mtree, const Fixture::Action& action, Latencies& latencies) {
+	if(action.radius >= 0) {
+		Stopwatch stopwatch;
+		mtree.for_each_in_range(action.queryData, action.radius, [&](const Data&, double, double&) {
+			++latencies.results;
+			return true;
+		});
+		latencies.nanoseconds[RANGE].push_back(stopwatch.nanoseconds());
+	}
+
+	if(action.limit > 0) {
+		Stopwatch stopwatch;
+		MTree::query query = mtree.get_nearest_by_limit(action.queryData, action.limit);
+		for(MTree::query::iterator i = query.begin(); i != query.end(); ++i) {
+			++latencies.results;
+		}
+		latencies.nanoseconds[KNN].push_back(stopwatch.nanoseconds());
+	}
+}
+
+
+void replay(MTree& mtree, const Fixture& fixture, size_t thread, size_t numThreads, Latencies& latencies) {
+	for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+		if(hashData(i->data) % numThreads != thread) {
+			continue;
+		}
+
+		switch(i->cmd) {
+		case 'A': {
+			Stopwatch stopwatch;
+			mtree.add(i->data);
+			latencies.nanoseconds[ADD].push_back(stopwatch.nanoseconds());
+			break;
+		}
+		case 'R': {
+			Stopwatch stopwatch;
+			bool removed = mtree.remove(i->data);
+			latencies.nanoseconds[REMOVE].push_back(stopwatch.nanoseconds());
+			latencies.failedRemovals += !removed;
+			break;
+		}
+		case 'Q':
+			break;
+		default:
+			cerr << "Unknown action: " << i->cmd << endl;
+			exit(1);
+		}
+
+		perform(mtree, *i, latencies);
+	}
+}
+
+
+vector<Summary> run(const Fixture& fixture, size_t numThreads, size_t minNodeCapacity, MTree::execution_mode executionMode, double& seconds) {
+	MTree mtree(minNodeCapacity);
+	mtree.set_execution_mode(executionMode);
+	if(numThreads > 1) {
+		mtree.enable_snapshots();
+	}
+
+	vector<Latencies> latencies(numThreads);
+	Stopwatch stopwatch;
+	vector<thread> threads;
+	for(size_t t = 1; t < numThreads; ++t) {
+		threads.push_back(thread([&, t]() {
+			replay(mtree, fixture, t, numThreads, latencies[t]);
+		}));
+	}
+	replay(mtree, fixture, 0, numThreads, latencies[0]);
+	for(vector<thread>::iterator i = threads.begin(); i != threads.end(); ++i) {
+		i->join();
+	}
+	seconds = stopwatch.nanoseconds() / 1e9;
+
+	for(size_t t = 1; t < numThreads; ++t) {
+		latencies[0].merge(latencies[t]);
+	}
+	if(latencies[0].failedRemovals > 0) {
+		cerr << latencies[0].failedRemovals << " removed data objects were not found" << endl;
+	}
+
+	vector<Summary> summaries;
+	Summary all;
+	all.operation = "all";
+	all.seconds = seconds;
+	for(size_t op = 0; op < NUM_OPERATIONS; ++op) {
+		Summary summary;
+		summary.operation = OPERATIONS[op];
+		summary.latencies.swap(latencies[0].nanoseconds[op]);
+		sort(summary.latencies.begin(), summary.latencies.end());
+		summary.seconds = mean(summary.latencies) * summary.latencies.size() / 1e9;
+		all.latencies.insert(all.latencies.end(), summary.latencies.begin(), summary.latencies.end());
+		summaries.push_back(summary);
+	}
+	sort(all.latencies.begin(), all.latencies.end());
+	summaries.push_back(all);
+	return summaries;
+}
+
+
+
+// The upper bound (exclusive) in nanoseconds and the count of each non-empty
+// bucket, formatted by format and joined by separator
+string formatHistogram(const MTree::histogram& histogram, const char* separator, const char* format) {
+	string formatted;
+	for(size_t b = 0; b < histogram.buckets.size(); ++b) {
+		if(histogram.buckets[b] > 0) {
+			char entry[64];
+			snprintf(entry, sizeof(entry), format, MTree::histogram::bucket_upper_bound(b), histogram.buckets[b]);
+			formatted += (formatted.empty() ? "" : separator);
+			formatted += entry;
+		}
+	}
+	return formatted;
+}
+
+
+void print(Report& report, const string& fixtureFile, size_t numThreads, const vector<Summary>& summaries) {
+	for(vector<Summary>::const_iterator s = summaries.begin(); s != summaries.end(); ++s) {
+		MTree::histogram histogram = s->histogram();
+		report.field("fixture",          fixtureFile)
+		      .field("threads",          numThreads)
+		      .field("operation",        s->operation)
+		      .field("count",            s->latencies.size())
+		      .field("p50_ns",           percentile(s->latencies, 0.50))
+		      .field("p90_ns",           percentile(s->latencies, 0.90))
+		      .field("p99_ns",           percentile(s->latencies, 0.99))
+		      .field("mean_ns",          mean(s->latencies))
+		      .field("throughput_per_s", throughput(s->latencies.size(), s->seconds))
+		      .field("histogram",
+		             formatHistogram(histogram, ";", "%.0f:%zu"),
+		             "[" + formatHistogram(histogram, ", ", "{\"upper_ns\": %.0f, \"count\": %zu}") + "]")
+		      .endRow();
+	}
+}
+
+
+
+
+
+int main(int argc, const char* argv[]) {
+	bool json = false;
+	size_t numThreads = 1;
+	size_t minNodeCapacity = DEFAULT_MIN_NODE_CAPACITY;
+	MTree::execution_mode executionMode = MTree::AUTOMATIC_EXECUTION;
+	vector<string> fixtureFiles;
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "--json") == 0) {
+			json = true;
+		} else if(strcmp(argv[i], "--threads") == 0  &&  i + 1 < argc) {
+			numThreads = max(atoi(argv[++i]), 1);
+		} else if(strcmp(argv[i], "--min-capacity") == 0  &&  i + 1 < argc) {
+			minNodeCapacity = max(atoi(argv[++i]), 2);
+		} else if(strcmp(argv[i], "--execution") == 0  &&  i + 1 < argc) {
+			++i;
+			if(strcmp(argv[i], "tree") == 0) {
+				executionMode = MTree::TREE_EXECUTION;
+			} else if(strcmp(argv[i], "scan") == 0) {
+				executionMode = MTree::SCAN_EXECUTION;
+			} else if(strcmp(argv[i], "automatic") != 0) {
+				fixtureFiles.clear();
+				break;
+			}
+		} else if(argv[i][0] != '-') {
+			fixtureFiles.push_back(argv[i]);
+		} else {
+			fixtureFiles.clear();
+			break;
+		}
+	}
+	if(fixtureFiles.empty()) {
+		cerr << "Usage: " << argv[0] << " [--json] [--threads N] [--min-capacity N] [--execution automatic|tree|scan] FIXTURE-FILE..." << endl;
+		return 1;
+	}
+
+	Report report(json);
+	for(vector<string>::const_iterator f = fixtureFiles.begin(); f != fixtureFiles.end(); ++f) {
+		if(!ifstream(*f)) {
+			cerr << "Cannot open " << *f << endl;
+			return 1;
+		}
+		cerr << "Loading " << *f << "..." << endl;
+		Fixture fixture = Fixture::loadFile(*f);
+
+		cerr << "Replaying " << fixture.actions.size() << " actions with " << numThreads << " thread(s)..." << endl;
+		double seconds;
+		vector<Summary> summaries = run(fixture, numThreads, minNodeCapacity, executionMode, seconds);
+		cerr << "Replayed in " << seconds << " s" << endl;
+
+		print(report, *f, numThreads, summaries);
+	}
+	report.end();
+}
@@ -1,11 +1,11 @@
 #include <ext/algorithm>
-#include <fstream>
 #include <iostream>
 #include <iterator>
 #include <string>
 #include <utility>
 #include <vector>
 #include <cassert>
+#include <cstring>
 #include "word-distance.h"
 
 using namespace std;
@@ -24,10 +24,15 @@ enum {
 };
 
 
-WordMTree createMTree(const vector<string>& words, size_t minNodeCapacity) {
+const char* const INSERTION_MODE_NAMES[] = { "exhaustive", "bounded", "first-fit" };
+
+
+WordMTree createMTree(const vector<string>& words, size_t minNodeCapacity, WordMTree::insertion_mode insertionMode) {
 	cerr << "Creating M-Tree with minNodeCapacity=" << minNodeCapacity << endl;
-	WordMTree mtree(minNodeCapacity);
+	WordMTree mtree(minNodeCapacity, countingWordDistance);
+	mtree.set_insertion_mode(insertionMode);
 	cerr << "Adding words...";
+	size_t distancesBegin = wordDistanceCount;
 	Timer t;
 	for(size_t i = 0; i < words.size(); ++i) {
 		size_t n = i + 1;
@@ -38,12 +43,15 @@ WordMTree createMTree(const vector<string>& words, size_t minNodeCapacity) {
 		}
 	}
 	Timer::Times times = t.getTimes();
+	size_t distances = wordDistanceCount - distancesBegin;
 	cerr << endl;
 	cout <<      "CREATE-MTREE"
-	        "\t" "minNodeCapacity" "=" << minNodeCapacity
-	     << "\t" "userTime"        "=" << times.user
-	     << "\t" "sysTime"         "=" << times.sys
-	     << "\t" "realTime"        "=" << times.real
+	        "\t" "minNodeCapacity"    "=" << minNodeCapacity
+	     << "\t" "insertionMode"      "=" << INSERTION_MODE_NAMES[insertionMode]
+	     << "\t" "userTime"           "=" << times.user
+	     << "\t" "sysTime"            "=" << times.sys
+	     << "\t" "realTime"           "=" << times.real
+	     << "\t" "distancesPerInsert" "=" << double(distances) / words.size()
 	     << endl;
 	
 	cerr << "M-Tree created" << endl;
@@ -87,27 +95,24 @@ void test(const WordMTree& mtree, const vector<string>& testWords, size_t minNod
 
 
 
-int main() {
-	srand(time(NULL));
-
-	cerr << "Loading words..." << endl;
-	ifstream f(DICT_FILE);
-	vector<string> words;
-	while(!f.eof()) {
-		if(words.size() >= WORD_LIMIT) {
-			break;
+int main(int argc, const char* argv[]) {
+	WordMTree::insertion_mode insertionMode = WordMTree::EXHAUSTIVE_INSERTION;
+	if(argc > 1) {
+		if(strcmp(argv[1], "bounded") == 0) {
+			insertionMode = WordMTree::BOUNDED_INSERTION;
+		} else if(strcmp(argv[1], "first-fit") == 0) {
+			insertionMode = WordMTree::FIRST_FIT_INSERTION;
+		} else if(strcmp(argv[1], "exhaustive") != 0) {
+			cerr << "Usage: " << argv[0] << " [exhaustive|bounded|first-fit]" << endl;
+			return 1;
 		}
+	}
 
-		string word;
-		getline(f, word);
-		if(word == "") {
-			break;
-		}
+	srand(time(NULL));
 
-		if(word[0] != '%') {
-			words.push_back(word);
-		}
-	}
+	cerr << "Loading words..." << endl;
+	vector<string> words = loadWords(DICT_FILE);
+	words.resize(min(words.size(), size_t(WORD_LIMIT)));
 	cerr << words.size() << " words loaded" << endl;
 
 	vector<string> testWords;
@@ -122,7 +127,7 @@ int main() {
 	cerr << endl;
 	
 	for(size_t minNodeCapacity = 2; minNodeCapacity < TOP_MIN_CAPACITY; minNodeCapacity *= RATE) {
-		WordMTree mtree = createMTree(words, minNodeCapacity);
+		WordMTree mtree = createMTree(words, minNodeCapacity, insertionMode);
 		
 		for(size_t limit = 1; limit < TOP_LIMIT; limit *= RATE) {
 			test(mtree, testWords, minNodeCapacity, limit);
@@ -2,11 +2,21 @@
 #undef NDEBUG
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <set>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include <cassert>
 #include "mtree.h"
+#include "mtree_forest.h"
+#include "mtree_tuner.h"
 #include "functions.h"
 #include "tests/fixture.h"
 
@@ -52,13 +62,14 @@ private:
 	};
 
 public:
-	// Turning the member public
+	// Turning the members public
 	using MTree::distance_function;
+	using MTree::_check;
 
-	MTreeTest()
+	MTreeTest(PromotionFunction promotionFunction = nonRandomPromotion)
 		: MTree(2, -1,
 				distance_function_type(),
-				split_function_type(nonRandomPromotion)
+				split_function_type(promotionFunction)
 			)
 		{}
 
@@ -104,6 +115,13 @@ public:
 	void test20() { _test("f20"); }
 	void testLots() { _test("fLots"); }
 
+	void testFarthestPairPromotion() {
+		mtree = MTreeTest([](const DataSet& dataSet, CachedDistanceFunction& distanceFunction) {
+			return mt::functions::farthest_pair_promotion()(dataSet, distanceFunction);
+		});
+		_test("fLots");
+	}
+
 
 	void testRemoveNonExisting() {
 		// Empty
@@ -133,6 +151,14 @@ public:
 	void testGeneratedCase01() { _test("fG01"); }
 	void testGeneratedCase02() { _test("fG02"); }
 
+	void testMixedWorkload() {
+		/*
+		 * Generated by:
+		 * 		cpp/generate-fixture --actions 300 --dimensions 3 --remove-chance 0.2 --query-chance 0.5 --max-radius 30 --max-limit 10 --seed 7
+		 */
+		_test("fMixed");
+	}
+
 	void testNotRandom() {
 		/*
 		 * To generate a random test, execute the following commands:
@@ -320,6 +346,1251 @@ public:
 	}
 
 
+	void testQueryContext() {
+		Fixture fixture = Fixture::load("fLots");
+		MTreeTest::query_context context(mtree);
+
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			applyAction(*i);
+
+			// The same context is reused for every query
+			context.start(i->queryData, i->radius, i->limit);
+			MTreeTest::query query = mtree.get_nearest(i->queryData, i->radius, i->limit);
+			for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+				assert(context.next());
+				assertEqual(context.distance(), r->distance);
+			}
+			assert(!context.next());
+		}
+
+		// A cleared context can be started again
+		context.clear();
+		context.start(fixture.actions.front().queryData);
+		for(size_t n = 0; n < allData.size(); ++n) {
+			assert(context.next());
+			assertIn(context.data(), allData);
+		}
+		assert(!context.next());
+	}
+
+
+	void testQueryStats() {
+		Fixture fixture = loadLots();
+
+		// Not collected by default
+		MTreeTest::query query = mtree.get_nearest_by_range(fixture.actions.front().queryData, 10);
+		MTreeTest::query::iterator r = query.begin();
+		assertEqual(r.stats().queries, 0);
+
+		// Every node and every entry is visited without a bound
+		query = mtree.get_nearest(fixture.actions.front().queryData);
+		query.collect_stats();
+		size_t count = distance(query.begin(), query.end());
+		const MTreeTest::query_stats& stats = query.stats();
+		assertEqual(stats.queries, 1);
+		assertEqual(stats.results, count);
+		assertEqual(count, allData.size());
+		assertEqual(stats.distance_computations, stats.nodes_expanded + allData.size());
+		assertEqual(stats.pruned_by_parent_distance, 0);
+		assertEqual(stats.pruned_by_radius, 0);
+		assertLessEqual(1, stats.peak_pending_queue);
+		assertLessEqual(1, stats.peak_nearest_queue);
+		assertLessEqual(0.0, stats.time_to_first_result);
+
+		// The statistics of a context are the aggregate of its queries
+		MTreeTest::query_context context(mtree);
+		context.collect_stats();
+		MTreeTest::query_stats aggregate;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			MTreeTest::query query = mtree.get_nearest(i->queryData, i->radius, i->limit);
+			query.collect_stats();
+			for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+				assertEqual(r.stats().results, query.stats().results);
+			}
+			aggregate += query.stats();
+
+			context.start(i->queryData, i->radius, i->limit);
+			while(context.next()) { }
+		}
+		assertEqual(context.stats().queries, fixture.actions.size());
+		assertEqual(context.stats().queries, aggregate.queries);
+		assertEqual(context.stats().results, aggregate.results);
+		assertEqual(context.stats().distance_computations, aggregate.distance_computations);
+		assertEqual(context.stats().nodes_expanded, aggregate.nodes_expanded);
+		assertEqual(context.stats().pruned_by_parent_distance, aggregate.pruned_by_parent_distance);
+		assertEqual(context.stats().pruned_by_radius, aggregate.pruned_by_radius);
+		assertEqual(context.stats().peak_pending_queue, aggregate.peak_pending_queue);
+		assertEqual(context.stats().peak_nearest_queue, aggregate.peak_nearest_queue);
+		assertLessEqual(1, aggregate.pruned_by_parent_distance);
+		assertLessEqual(1, aggregate.pruned_by_radius);
+	}
+
+
+	void testBuildStats() {
+		// Not collected by default
+		mtree.add({1, 2});
+		assertEqual(mtree.get_build_stats().adds, 0);
+		mtree.remove({1, 2});
+
+		mtree.enable_build_stats();
+		map<MTree::build_event::kind_type, size_t> events;
+		size_t splits = 0;
+		size_t height = 1;
+		mtree.set_build_event_hook([&](const MTree::build_event& event) {
+			++events[event.kind];
+			if(event.kind == MTree::build_event::SPLIT) {
+				assertLessEqual(event.level, height - 1);
+				assertLessEqual(0.0, event.radii[0]);
+				assertLessEqual(0.0, event.radii[1]);
+				++splits;
+			} else if(event.kind == MTree::build_event::HEIGHT_INCREASE) {
+				assertEqual(event.level, ++height);
+			} else if(event.kind == MTree::build_event::HEIGHT_DECREASE) {
+				assertEqual(event.level, --height);
+			}
+		});
+
+		loadLots();
+
+		MTree::build_stats stats = mtree.get_build_stats();
+		assertEqual(stats.adds, allData.size());
+		assertEqual(stats.add_nanoseconds.count(), allData.size());
+		assertEqual(stats.splits_per_level.size(), height - 1);
+		assertEqual(accumulate(stats.splits_per_level.begin(), stats.splits_per_level.end(), size_t(0)), splits);
+		assertEqual(stats.split_radii.count(), 2 * splits);
+		assertLessEqual(1, stats.split_distance_computations);
+		assertEqual(stats.height_increases, events[MTree::build_event::HEIGHT_INCREASE]);
+
+		for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+			bool removed = mtree.remove(*data);
+			assert(removed);
+		}
+		stats = mtree.get_build_stats();
+		assertEqual(stats.removes, allData.size());
+		assertEqual(stats.remove_nanoseconds.count(), allData.size());
+		assertEqual(stats.donations, events[MTree::build_event::DONATION]);
+		assertEqual(stats.merges, events[MTree::build_event::MERGE]);
+		assertEqual(stats.height_decreases, events[MTree::build_event::HEIGHT_DECREASE]);
+		assertLessEqual(1, stats.donations);
+		assertLessEqual(1, stats.merges);
+		assertEqual(height, 1);
+		allData.clear();
+
+		// Disabling resets the counters
+		mtree.enable_build_stats(false);
+		assertEqual(mtree.get_build_stats().adds, 0);
+	}
+
+
+	void testStatistics() {
+		assertEqual(mtree.statistics().height, 0);
+
+		loadLots();
+
+		MTree::tree_statistics stats = mtree.statistics(-1, [](const Data& data) { return data.size() * sizeof(int); });
+		assertEqual(stats.entries, allData.size());
+		assertEqual(stats.tombstones, 0);
+		assertEqual(stats.levels.size(), stats.height);
+		assertLessEqual(2, stats.height);
+		assertEqual(stats.levels.back().nodes, 1);
+		assertEqual(stats.levels.front().children, allData.size());
+		for(size_t level = 1; level < stats.height; ++level) {
+			assertEqual(stats.levels[level].children, stats.levels[level - 1].nodes);
+		}
+		for(size_t level = 0; level < stats.height; ++level) {
+			const MTree::tree_statistics::level_statistics& levelStats = stats.levels[level];
+			assertEqual(accumulate(levelStats.fill_factors.begin(), levelStats.fill_factors.end(), size_t(0)), levelStats.nodes);
+			assertEqual(levelStats.radii.count(), levelStats.nodes);
+			assertLessEqual(levelStats.min_radius, levelStats.mean_radius);
+			assertLessEqual(levelStats.mean_radius, levelStats.max_radius);
+			assertLessEqual(0.0, levelStats.sibling_overlap);
+			assertLessEqual(levelStats.sibling_overlap, 1.0);
+		}
+		assertLessEqual(1, stats.levels.front().sibling_pairs_sampled);
+		assertLessEqual(1, stats.memory.nodes);
+		assertLessEqual(1, stats.memory.entries);
+		assertLessEqual(1, stats.memory.child_containers);
+		assertLessEqual(allData.size() * 2 * sizeof(int), stats.memory.data_payload);
+
+		// Sampling fewer pairs
+		MTree::tree_statistics sampled = mtree.statistics(10);
+		assertEqual(sampled.levels.front().sibling_pairs_sampled, 10);
+		assertEqual(sampled.memory.data_payload, 0);
+
+		// Tombstones are counted apart
+		mtree.enable_tombstones(true, 1.0);
+		bool removed = mtree.remove(*allData.begin());
+		assert(removed);
+		allData.erase(allData.begin());
+		stats = mtree.statistics();
+		assertEqual(stats.entries, allData.size());
+		assertEqual(stats.tombstones, 1);
+	}
+
+
+	void testCostModel() {
+		MTree::cost_estimate empty = mtree.estimate_cost_by_range(10);
+		assertEqual(empty.node_accesses, 0.0);
+
+		Fixture fixture = loadLots();
+		mtree.update_cost_model();
+
+		// A query without bounds accesses every node and every entry
+		MTreeTest::query query = mtree.get_nearest(fixture.actions.front().queryData);
+		query.collect_stats();
+		size_t count = distance(query.begin(), query.end());
+		MTree::cost_estimate everything = mtree.estimate_cost_by_range(numeric_limits<double>::infinity());
+		assertEqual(everything.node_accesses, query.stats().nodes_expanded);
+		assertEqual(everything.distance_computations, query.stats().distance_computations);
+		assertEqual(everything.results, count);
+
+		// The cost grows with the range and with the number of neighbors
+		MTree::cost_estimate previous = mtree.estimate_cost_by_range(0);
+		for(double range = 1; range < 100; range *= 2) {
+			MTree::cost_estimate estimate = mtree.estimate_cost_by_range(range);
+			assertLessEqual(previous.node_accesses, estimate.node_accesses);
+			assertLessEqual(previous.distance_computations, estimate.distance_computations);
+			assertLessEqual(previous.results, estimate.results);
+			assertLessEqual(estimate.node_accesses, everything.node_accesses);
+			previous = estimate;
+		}
+		previous = mtree.estimate_cost_by_limit(1);
+		for(size_t limit = 2; limit < allData.size(); limit *= 2) {
+			MTree::cost_estimate estimate = mtree.estimate_cost_by_limit(limit);
+			assertLessEqual(previous.radius, estimate.radius);
+			assertLessEqual(previous.distance_computations, estimate.distance_computations);
+			assertLessEqual(estimate.results, limit);
+			previous = estimate;
+		}
+		assertEqual(mtree.estimate_cost(1.0, allData.size()).radius, 1.0);
+	}
+
+
+	void testScan() {
+		Fixture fixture = Fixture::load("fLots");
+		MTreeTest::query_context context(mtree);
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			applyAction(*i);
+
+			// The same distances by every execution mode, including scans of
+			// query data objects of another dimension, which are not columnar
+			Data otherDimension = i->queryData;
+			otherDimension.push_back(0);
+			for(const Data& queryData : { i->queryData, otherDimension }) {
+				vector<double> expected;
+				mtree.set_execution_mode(MTree::TREE_EXECUTION);
+				MTreeTest::query query = mtree.get_nearest(queryData, i->radius, i->limit);
+				for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+					expected.push_back(r->distance);
+				}
+
+				for(MTree::execution_mode mode : { MTree::SCAN_EXECUTION, MTree::AUTOMATIC_EXECUTION }) {
+					mtree.set_execution_mode(mode);
+					vector<double> distances;
+					MTreeTest::query query = mtree.get_nearest(queryData, i->radius, i->limit);
+					for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+						assertIn(r->data, allData);
+						assertEqual(mtree.distance_function(r->data, queryData), r->distance);
+						distances.push_back(r->distance);
+					}
+					assertEqual(distances, expected);
+
+					distances.clear();
+					context.start(queryData, i->radius, i->limit);
+					while(context.next()) {
+						distances.push_back(context.distance());
+					}
+					assertEqual(distances, expected);
+
+					vector<MTree::query::result_item> results = mtree.get_nearest_parallel(queryData, i->radius, i->limit, 3);
+					assertEqual(results.size(), expected.size());
+					for(size_t r = 0; r < results.size(); ++r) {
+						assertEqual(results[r].distance, expected[r]);
+					}
+				}
+			}
+		}
+
+		// The whole M-Tree is scanned when the queries are large enough
+		mtree.set_execution_mode(MTree::AUTOMATIC_EXECUTION, 0.0);
+		MTreeTest::query query = mtree.get_nearest_by_limit(fixture.actions.front().queryData, 1);
+		query.collect_stats();
+		assertEqual(distance(query.begin(), query.end()), 1);
+		assertEqual(query.stats().nodes_expanded, 0);
+		assertEqual(query.stats().distance_computations, allData.size());
+
+		vector<MTree::query::result_item> results = mtree.scan_nearest(fixture.actions.front().queryData, numeric_limits<double>::infinity(), allData.size(), 4);
+		assertEqual(results.size(), allData.size());
+		for(size_t r = 1; r < results.size(); ++r) {
+			assertLessEqual(results[r - 1].distance, results[r].distance);
+		}
+	}
+
+
+	void testResultCache() {
+		Fixture fixture = loadLots();
+
+		auto fetch = [&](const Data& queryData, size_t limit, vector<Data>& results) {
+			MTreeTest::query query = mtree.get_nearest(queryData, numeric_limits<double>::infinity(), limit);
+			query.collect_stats();
+			results.clear();
+			for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+				assertEqual(mtree.distance_function(r->data, queryData), r->distance);
+				results.push_back(r->data);
+			}
+			assertEqual(query.stats().queries, 1);
+			assertEqual(query.stats().results, results.size());
+			return query.stats();
+		};
+
+		const Data& queryData = fixture.actions.front().queryData;
+		assert(allData.count(queryData) == 0);
+		const Data farData(queryData.size(), 1000000);
+		vector<Data> expected;
+		vector<Data> results;
+
+		// A repeated query is answered by the cache
+		mtree.enable_result_cache();
+		assertEqual(fetch(queryData, 5, expected).cache_hits, 0);
+		MTreeTest::query_stats stats = fetch(queryData, 5, results);
+		assertEqual(stats.cache_hits, 1);
+		assertEqual(stats.distance_computations, 0);
+		assertEqual(results, expected);
+		assertEqual(fetch(queryData, 6, results).cache_hits, 0);
+
+		// By default, any write invalidates it
+		mtree.add(farData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+		assertEqual(results, expected);
+		mtree.remove(farData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+
+		// With precise invalidation, only the writes within the ball of a query
+		mtree.enable_result_cache(true, MTreeTest::DEFAULT_RESULT_CACHE_SIZE, true);
+		fetch(queryData, 5, results);
+		mtree.add(farData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 1);
+		assertEqual(results, expected);
+		mtree.add(queryData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+		assertEqual(results.front(), queryData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 1);
+		mtree.remove(queryData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+		assertEqual(results, expected);
+		mtree.update(farData, queryData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+		mtree.remove(queryData);
+
+		// The results held are limited
+		mtree.enable_result_cache(true, 10);
+		vector<Data> queries;
+		for(size_t i = 0; i < 3; ++i) {
+			queries.push_back(fixture.actions[i].queryData);
+			fetch(queries.back(), 5, results);
+		}
+		assertEqual(fetch(queries[2], 5, results).cache_hits, 1);
+		size_t hits = fetch(queries[0], 5, results).cache_hits + fetch(queries[1], 5, results).cache_hits;
+		assertLessEqual(hits, 1);
+		fetch(queryData, 11, results);
+		assertEqual(fetch(queryData, 11, results).cache_hits, 0);
+
+		mtree.enable_result_cache(false);
+		fetch(queryData, 5, results);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+
+		// A query does not get results from a version of the M-Tree other
+		// than the one from when it was created
+		mtree.enable_snapshots();
+		mtree.enable_result_cache();
+		fetch(queryData, 5, results);
+		MTreeTest::query previous = mtree.get_nearest(queryData, numeric_limits<double>::infinity(), 5);
+		previous.collect_stats();
+		mtree.add(queryData);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 0);
+		assertEqual(results.front(), queryData);
+		results.clear();
+		for(MTreeTest::query::iterator r = previous.begin(); r != previous.end(); ++r) {
+			results.push_back(r->data);
+		}
+		assertEqual(previous.stats().cache_hits, 0);
+		assertEqual(results, expected);
+		assertEqual(fetch(queryData, 5, results).cache_hits, 1);
+		assertEqual(results.front(), queryData);
+	}
+
+
+	void testFilteredQuery() {
+		// Near data objects tend to be of the same category
+		auto category = [](const Data& data) { return size_t(data[0] / 13); };
+		const size_t CATEGORIES = 8;
+
+		Fixture fixture = loadLots();
+
+		auto checkFiltered = [&](size_t wanted, size_t limit, size_t& distanceComputations) {
+			for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+				vector<double> expected;
+				for(set<Data>::const_iterator d = allData.begin(); d != allData.end(); ++d) {
+					if(category(*d) == wanted) {
+						expected.push_back(mtree.distance_function(*d, i->queryData));
+					}
+				}
+				sort(expected.begin(), expected.end());
+				expected.resize(min(expected.size(), limit));
+
+				MTreeTest::query_filter filter([&](const Data& data) { return category(data) == wanted; }, MTreeTest::summary_type(1) << wanted);
+				MTreeTest::query query = mtree.get_nearest(i->queryData, filter, numeric_limits<double>::infinity(), limit);
+				query.collect_stats();
+				vector<double> distances;
+				for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+					assertIn(r->data, allData);
+					assertEqual(category(r->data), wanted);
+					distances.push_back(r->distance);
+				}
+				assertEqual(distances, expected);
+				distanceComputations += query.stats().distance_computations;
+			}
+		};
+
+		// The rejected entries cost no distance computations, only the nodes
+		MTreeTest::query query = mtree.get_nearest(fixture.actions.front().queryData, MTreeTest::query_filter([](const Data&) { return false; }));
+		query.collect_stats();
+		assert(query.begin() == query.end());
+		assertEqual(query.stats().pruned_by_filter, allData.size());
+		assertEqual(query.stats().distance_computations, query.stats().nodes_expanded);
+
+		vector<size_t> plainComputations(CATEGORIES);
+		for(size_t c = 0; c < CATEGORIES; ++c) {
+			checkFiltered(c, 5, plainComputations[c]);
+		}
+
+		// The summaries skip the subtrees without the category
+		mtree.set_summary_function([&](const Data& data) { return MTreeTest::summary_type(1) << category(data); });
+		mtree._check();
+		size_t plainTotal = 0;
+		size_t summarizedTotal = 0;
+		for(size_t c = 0; c < CATEGORIES; ++c) {
+			size_t summarizedComputations = 0;
+			checkFiltered(c, 5, summarizedComputations);
+			assertLessEqual(summarizedComputations, plainComputations[c]);
+			plainTotal += plainComputations[c];
+			summarizedTotal += summarizedComputations;
+		}
+		assert(summarizedTotal < plainTotal);
+
+		// They are kept through the writes
+		size_t n = 0;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(i->cmd == 'A'  &&  n++ % 2 == 0) {
+				allData.erase(i->data);
+				bool removed = mtree.remove(i->data);
+				assert(removed);
+			}
+		}
+		mtree._check();
+		Data moved = *allData.begin();
+		Data target = moved;
+		target[0] = 99;
+		while(allData.count(target) > 0) {
+			++target[1];
+		}
+		allData.erase(moved);
+		allData.insert(target);
+		bool updated = mtree.update(moved, target);
+		assert(updated);
+		mtree._check();
+
+		MTreeTest other;
+		n = 0;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(i->cmd == 'A'  &&  n++ % 2 == 0) {
+				allData.insert(i->data);
+				other.add(i->data);
+			}
+		}
+		mtree.merge(std::move(other));
+		mtree._check();
+		for(size_t c = 0; c < CATEGORIES; ++c) {
+			size_t distanceComputations = 0;
+			checkFiltered(c, 10, distanceComputations);
+		}
+
+		mtree.set_summary_function(nullptr);
+		size_t distanceComputations = 0;
+		checkFiltered(0, 3, distanceComputations);
+	}
+
+
+	void testTuner() {
+		typedef mt::mtree_tuner<Data> Tuner;
+		typedef mt::functions::split_function<mt::functions::farthest_pair_promotion, mt::functions::balanced_partition> FarthestPairSplit;
+
+		Fixture fixture = Fixture::load("fLots");
+		vector<Data> sample = addedData(fixture);
+		vector<Tuner::query_type> queries;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			queries.push_back({ i->queryData, numeric_limits<double>::infinity(), 5 });
+		}
+
+		Tuner tuner(sample, queries);
+		tuner.set_capacities({ 2, 4, 8 });
+		tuner.add_split_policy("non-random", MTree::split_function_type(nonRandomPromotion));
+		tuner.add_split_policy<FarthestPairSplit>("farthest-pair");
+		vector<Tuner::result_type> results = tuner.evaluate(3);
+		assertEqual(results.size(), 6U);
+		for(size_t i = 0; i < results.size(); ++i) {
+			assertEqual(results[i].split_policy, string((i < 3) ? "non-random" : "farthest-pair"));
+			assertEqual(results[i].min_node_capacity, size_t(2) << (i % 3));
+			assertEqual(results[i].max_node_capacity, 2 * results[i].min_node_capacity - 1);
+			assert(results[i].feasible);
+			assert(results[i].memory_bytes > 0);
+			assert(results[i].distances_per_query > 0);
+			assertLessEqual(results[i].distances_per_query, 2.0 * sample.size());
+			assertLessEqual(tuner.best(results).distances_per_query, results[i].distances_per_query);
+		}
+
+		// Only the configurations within the memory limit are feasible
+		size_t maxMemory = 0;
+		for(size_t i = 0; i < results.size(); ++i) {
+			maxMemory = max(maxMemory, results[i].memory_bytes);
+		}
+		tuner.set_max_memory(maxMemory - 1);
+		results = tuner.evaluate();
+		Tuner::result_type best = tuner.best(results);
+		assert(best.feasible);
+		for(size_t i = 0; i < results.size(); ++i) {
+			assertEqual(results[i].feasible, (results[i].memory_bytes < maxMemory));
+			if(results[i].feasible) {
+				assertLessEqual(best.distances_per_query, results[i].distances_per_query);
+			}
+		}
+
+		tuner.set_max_memory(0);
+		assert(!tuner.recommend().feasible);
+
+		mt::mtree<Data, mt::functions::euclidean_distance, FarthestPairSplit> mtree = tuner.construct<FarthestPairSplit>(results[4]);
+		for(vector<Data>::const_iterator i = sample.begin(); i != sample.end(); ++i) {
+			mtree.add(*i);
+		}
+		assertEqual(mtree.size(), sample.size());
+	}
+
+
+	void testForEachInRange() {
+		Fixture fixture = Fixture::load("fLots");
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			applyAction(*i);
+
+			set<Data> visited;
+			bool completed = mtree.for_each_in_range(i->queryData, i->radius,
+				[&](const Data& data, double distance, double&) {
+					assertEqual(mtree.distance_function(data, i->queryData), distance);
+					assertLessEqual(distance, i->radius);
+					visited.insert(data);
+					return true;
+				}
+			);
+			assert(completed);
+
+			for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+				if(mtree.distance_function(*data, i->queryData) <= i->radius) {
+					assertIn(*data, visited);
+				} else {
+					assertNotIn(*data, visited);
+				}
+			}
+		}
+
+		// Stopping early
+		size_t count = 0;
+		bool completed = mtree.for_each_in_range(Data{50, 50, 50, 50, 50}, 1000,
+			[&](const Data&, double, double&) {
+				return ++count < 3;
+			}
+		);
+		assert(!completed);
+		assertEqual(count, 3u);
+
+		// Tightening the range to find the nearest neighbor
+		Data nearest;
+		double nearestDistance = numeric_limits<double>::infinity();
+		mtree.for_each_in_range(Data{50, 50, 50, 50, 50}, nearestDistance,
+			[&](const Data& data, double distance, double& range) {
+				if(distance < nearestDistance) {
+					nearest = data;
+					nearestDistance = distance;
+					range = distance;
+				}
+				return true;
+			}
+		);
+		assertEqual(nearestDistance, mtree.get_nearest_by_limit(Data{50, 50, 50, 50, 50}, 1).begin()->distance);
+	}
+
+
+	void testCountInRange() {
+		Fixture fixture = Fixture::load("fLots");
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			applyAction(*i);
+			assertEqual(mtree.size(), allData.size());
+
+			size_t expected = 0;
+			for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+				if(mtree.distance_function(*data, i->queryData) <= i->radius) {
+					++expected;
+				}
+			}
+
+			MTreeTest::range_count count = mtree.count_in_range(i->queryData, i->radius);
+			assert(count.exact());
+			assertEqual(count.lower, expected);
+			assertEqual(count.estimate, double(expected));
+
+			count = mtree.count_in_range(i->queryData, i->radius, 5);
+			assertLessEqual(count.lower, expected);
+			assertLessEqual(expected, count.upper);
+			assertLessEqual(double(count.lower), count.estimate);
+			assertLessEqual(count.estimate, double(count.upper));
+		}
+	}
+
+
+	void testJoins() {
+		typedef set<pair<Data, Data>> PairSet;
+		const double eps = 30.0;
+
+		Fixture fixture = loadLots();
+		MTree other(2, -1, MTree::distance_function_type(), MTree::split_function_type(nonRandomPromotion));
+		set<Data> otherData;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(otherData.insert(i->queryData).second) {
+				other.add(i->queryData);
+			}
+		}
+
+		PairSet expectedSelf;
+		for(set<Data>::const_iterator i = allData.begin(); i != allData.end(); ++i) {
+			for(set<Data>::const_iterator j = allData.begin(); j != i; ++j) {
+				if(mtree.distance_function(*i, *j) <= eps) {
+					expectedSelf.insert(make_pair(*j, *i));
+				}
+			}
+		}
+
+		PairSet expectedJoin;
+		for(set<Data>::const_iterator i = allData.begin(); i != allData.end(); ++i) {
+			for(set<Data>::const_iterator j = otherData.begin(); j != otherData.end(); ++j) {
+				if(mtree.distance_function(*i, *j) <= eps) {
+					expectedJoin.insert(make_pair(*i, *j));
+				}
+			}
+		}
+
+		for(size_t threads = 1; threads <= 4; threads *= 4) {
+			mutex resultsMutex;
+			PairSet selfPairs;
+			mt::self_join(mtree, eps,
+				[&](const Data& data1, const Data& data2, double distance) {
+					assertEqual(mtree.distance_function(data1, data2), distance);
+					lock_guard<mutex> lock(resultsMutex);
+					pair<Data, Data> p = (data1 < data2) ? make_pair(data1, data2) : make_pair(data2, data1);
+					assert(selfPairs.insert(p).second);
+				},
+				threads
+			);
+			assert(selfPairs == expectedSelf);
+
+			PairSet joinPairs;
+			mt::similarity_join(mtree, other, eps,
+				[&](const Data& data1, const Data& data2, double distance) {
+					assertEqual(mtree.distance_function(data1, data2), distance);
+					lock_guard<mutex> lock(resultsMutex);
+					assert(joinPairs.insert(make_pair(data1, data2)).second);
+				},
+				threads
+			);
+			assert(joinPairs == expectedJoin);
+		}
+	}
+
+
+	void testAllKnn() {
+		loadLots(true);
+
+		for(size_t k = 0; k <= 5; ++k) {
+			MTreeTest::knn_graph graph = mtree.all_knn(k, (k % 2) + 1);
+			assertEqual(graph.size(), allData.size());
+			assertEqual(graph.offsets.size(), allData.size() + 1);
+
+			for(size_t v = 0; v < graph.size(); ++v) {
+				const Data& data = graph.vertices[v];
+				assertIn(data, allData);
+				assertEqual(graph.degree(v), min(k, allData.size() - 1));
+
+				// Compare with a regular query, skipping the data object itself
+				MTreeTest::query query = mtree.get_nearest_by_limit(data, k + 1);
+				MTreeTest::query::iterator expected = query.begin();
+				++expected;
+				for(size_t n = graph.offsets[v]; n < graph.offsets[v + 1]; ++n, ++expected) {
+					assertEqual(graph.distances[n], expected->distance);
+					assertEqual(mtree.distance_function(data, graph.vertices[graph.neighbors[n]]), graph.distances[n]);
+					assert(graph.neighbors[n] != v);
+				}
+			}
+		}
+	}
+
+
+	void testSnapshots() {
+		mtree.enable_snapshots();
+		_test("fLots");
+
+		// A query reads the version of the M-Tree from when it was created
+		Fixture fixture = Fixture::load("fLots");
+		const set<Data> previousData = allData;
+		MTreeTest::query previous = mtree.get_nearest_by_range(fixture.actions.front().queryData, numeric_limits<double>::infinity());
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(allData.erase(i->data) > 0) {
+				assert(mtree.remove(i->data));
+			} else {
+				allData.insert(i->data);
+				mtree.add(i->data);
+			}
+		}
+
+		set<Data> previousResults;
+		for(MTreeTest::query::iterator i = previous.begin(); i != previous.end(); ++i) {
+			previousResults.insert(i->data);
+		}
+		assert(previousResults == previousData);
+		assertEqual(mtree.size(), allData.size());
+	}
+
+
+	void testConcurrentSnapshots() {
+		vector<Data> order = addedData(Fixture::load("fLots"));
+		map<Data, size_t> positions;
+		for(size_t i = 0; i < order.size(); ++i) {
+			positions[order[i]] = i;
+		}
+
+		mtree.enable_snapshots();
+		atomic<bool> done(false);
+
+		// The writer adds all the data objects and then removes them in the
+		// same order, so every version of the M-Tree holds a contiguous
+		// window of the order.
+		thread writer([&]() {
+			for(size_t i = 0; i < order.size(); ++i) {
+				mtree.add(order[i]);
+			}
+			for(size_t i = 0; i < order.size(); ++i) {
+				bool removed = mtree.remove(order[i]);
+				assert(removed);
+			}
+			done = true;
+		});
+
+		vector<thread> readers;
+		for(int r = 0; r < 3; ++r) {
+			readers.push_back(thread([&, r]() {
+				MTreeTest::query_context context(mtree);
+				size_t n = 0;
+				while(!done) {
+					const Data& queryData = order[n++ % order.size()];
+					vector<size_t> found;
+					if(r == 0) {
+						context.start(queryData);
+						while(context.next()) {
+							found.push_back(positions.find(context.data())->second);
+						}
+					} else {
+						MTreeTest::query query = mtree.get_nearest_by_limit(queryData, (r == 1) ? 10 : order.size());
+						double previousDistance = 0.0;
+						for(MTreeTest::query::iterator i = query.begin(); i != query.end(); ++i) {
+							assertLessEqual(previousDistance, i->distance);
+							previousDistance = i->distance;
+							found.push_back(positions.find(i->data)->second);
+						}
+					}
+
+					if(r != 1  &&  !found.empty()) {
+						sort(found.begin(), found.end());
+						assertEqual(found.back() - found.front() + 1, found.size());
+					}
+				}
+			}));
+		}
+
+		writer.join();
+		for(size_t r = 0; r < readers.size(); ++r) {
+			readers[r].join();
+		}
+		assert(mtree.empty());
+	}
+
+
+	void testConcurrentWrites() {
+		vector<Data> order = addedData(Fixture::load("fLots"));
+		allData.insert(order.begin(), order.end());
+
+		const size_t NUM_THREADS = 4;
+		auto concurrently = [&](function<void(size_t)> write) {
+			vector<thread> threads;
+			for(size_t t = 0; t < NUM_THREADS; ++t) {
+				threads.push_back(thread([&, t]() {
+					for(size_t i = t; i < order.size(); i += NUM_THREADS) {
+						write(i);
+					}
+				}));
+			}
+			for(size_t t = 0; t < NUM_THREADS; ++t) {
+				threads[t].join();
+			}
+			mtree._check();
+		};
+
+		// Calls the methods of the base class, which do not check the M-Tree
+		concurrently([&](size_t i) {
+			mtree.MTree::add(order[i]);
+		});
+		assertEqual(mtree.size(), allData.size());
+		_checkNearestByLimit(order.front(), allData.size());
+
+		concurrently([&](size_t i) {
+			if(i % 3 != 0) {
+				bool removed = mtree.MTree::remove(order[i]);
+				assert(removed);
+			}
+		});
+		for(size_t i = 0; i < order.size(); ++i) {
+			if(i % 3 != 0) {
+				allData.erase(order[i]);
+			}
+		}
+		assertEqual(mtree.size(), allData.size());
+		_checkNearestByLimit(order.front(), allData.size());
+		_checkNearestByRange(order.back(), 20);
+	}
+
+
+	void testParallelQuery() {
+		Fixture fixture = loadLots(true);
+
+		for(size_t threads = 1; threads <= 4; threads += 3) {
+			for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); i += 25) {
+				for(size_t limit : { size_t(0), size_t(1), size_t(i->limit), allData.size() / 2, allData.size() + 1 }) {
+					for(double range : { double(i->radius), numeric_limits<double>::infinity() }) {
+						ResultsVector results = mtree.get_nearest_parallel(i->queryData, range, limit, threads);
+						MTreeTest::query query = mtree.get_nearest(i->queryData, range, limit);
+						ResultsVector expected(query.begin(), query.end());
+
+						assertEqual(results.size(), expected.size());
+						set<Data> distinct;
+						for(size_t r = 0; r < results.size(); ++r) {
+							assert(distinct.insert(results[r].data).second);
+							assertIn(results[r].data, allData);
+							assertEqual(results[r].distance, expected[r].distance);
+							assertEqual(mtree.distance_function(results[r].data, i->queryData), results[r].distance);
+						}
+					}
+				}
+			}
+		}
+	}
+
+
+	void testForest() {
+		typedef mt::functions::pivot_partition<Data, mt::functions::euclidean_distance> PivotPartition;
+		typedef mt::mtree_forest<Data, MTree::distance_function_type, MTree::split_function_type, PivotPartition> Forest;
+		typedef size_t(*SumPartition)(const Data&, size_t);
+		typedef mt::mtree_forest<Data, MTree::distance_function_type, MTree::split_function_type, SumPartition> HashForest;
+
+		Fixture fixture = loadLots(true);
+		vector<Data> pivots = addedData(fixture);
+		pivots.resize(4);
+
+		Forest forest(3, 2, -1, MTree::distance_function_type(), MTree::split_function_type(nonRandomPromotion), PivotPartition(pivots));
+		forest.add(allData.begin(), allData.end(), 2);
+		HashForest hashForest(4, 2, -1, MTree::distance_function_type(), MTree::split_function_type(nonRandomPromotion),
+			[](const Data& data, size_t numShards) -> size_t {
+				size_t sum = 0;
+				for(size_t i = 0; i < data.size(); ++i) {
+					sum += data[i];
+				}
+				return sum % numShards;
+			});
+		for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+			hashForest.add(*data);
+		}
+
+		assertEqual(forest.size(), allData.size());
+		assertEqual(hashForest.size(), allData.size());
+		for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+			MTree::query query = forest.shard(forest.shard_of(*data)).get_nearest_by_limit(*data, 1);
+			assertEqual(query.begin()->distance, 0);
+		}
+
+		for(size_t threads = 1; threads <= 3; threads += 2) {
+			for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); i += 25) {
+				for(size_t limit : { size_t(0), size_t(1), size_t(i->limit), allData.size() + 1 }) {
+					MTreeTest::query query = mtree.get_nearest(i->queryData, i->radius, limit);
+					ResultsVector expected(query.begin(), query.end());
+					ResultsVector results = forest.get_nearest(i->queryData, i->radius, limit, threads);
+					ResultsVector hashResults = hashForest.get_nearest(i->queryData, i->radius, limit, threads);
+
+					assertEqual(results.size(), expected.size());
+					assertEqual(hashResults.size(), expected.size());
+					for(size_t r = 0; r < results.size(); ++r) {
+						assertEqual(results[r].distance, expected[r].distance);
+						assertEqual(hashResults[r].distance, expected[r].distance);
+						assertEqual(mtree.distance_function(results[r].data, i->queryData), results[r].distance);
+					}
+				}
+			}
+		}
+
+		for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+			assert(forest.remove(*data));
+		}
+		assertEqual(forest.size(), 0);
+	}
+
+
+	void testMerge() {
+		Fixture fixture = Fixture::load("fLots");
+		vector<Data> order = addedData(fixture);
+		allData.insert(order.begin(), order.end());
+
+		// Each case is the number of data objects in this M-Tree, and the
+		// minimum node capacity of the other one
+		struct Case {
+			size_t split;
+			size_t otherMinCapacity;
+		};
+		for(Case c : { Case{0, 2}, Case{order.size() - 3, 2}, Case{order.size() - 40, 2}, Case{order.size() / 2, 2}, Case{10, 2}, Case{order.size() / 2, 3} }) {
+			MTreeTest tree;
+			MTree other(c.otherMinCapacity, -1, MTree::distance_function_type(), MTree::split_function_type(nonRandomPromotion));
+			for(size_t i = 0; i < order.size(); ++i) {
+				if(i < c.split) {
+					tree.add(order[i]);
+				} else {
+					other.add(order[i]);
+				}
+			}
+
+			tree.merge(std::move(other));
+			tree._check();
+			assert(other.empty());
+			assertEqual(tree.size(), allData.size());
+
+			for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); i += 50) {
+				MTreeTest::query query = tree.get_nearest_by_range(i->queryData, i->radius);
+				set<Data> results;
+				for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+					results.insert(r->data);
+				}
+				for(set<Data>::const_iterator data = allData.begin(); data != allData.end(); ++data) {
+					assertEqual((results.count(*data) > 0), (tree.distance_function(*data, i->queryData) <= i->radius));
+				}
+			}
+
+			for(size_t i = 0; i < order.size(); i += 2) {
+				assert(tree.remove(order[i]));
+			}
+		}
+
+		// With snapshots, the nodes of the other M-Tree are not taken as
+		// created by a later write of this one, while queries still read them
+		MTreeTest tree;
+		MTreeTest other;
+		tree.enable_snapshots();
+		other.enable_snapshots();
+		set<Data> treeData;
+		for(size_t i = 0; i < 260; ++i) {
+			(i < 200 ? other : tree).add(order[i]);
+			treeData.insert(order[i]);
+		}
+		tree.merge(std::move(other));
+		tree._check();
+		for(size_t i = 260; i < order.size() + 260; ++i) {
+			const Data& data = order[i % order.size()];
+			MTreeTest::query query = tree.get_nearest(data);
+			if(i < order.size()) {
+				tree.add(data);
+			} else {
+				bool removed = tree.remove(data);
+				assert(removed);
+			}
+			set<Data> results;
+			for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+				results.insert(r->data);
+			}
+			assert(results == treeData);
+			if(i < order.size()) {
+				treeData.insert(data);
+			} else {
+				treeData.erase(data);
+			}
+		}
+		tree._check();
+	}
+
+	void testInsertionModes() {
+		for(MTree::insertion_mode mode : { MTree::BOUNDED_INSERTION, MTree::FIRST_FIT_INSERTION }) {
+			Test test;
+			test.mtree.set_insertion_mode(mode);
+			test._test("fLots");
+		}
+
+		// Subtrees are grafted as data objects are added
+		vector<Data> order = addedData(Fixture::load("fLots"));
+		allData.insert(order.begin(), order.end());
+		MTreeTest tree;
+		MTree other(2, -1, MTree::distance_function_type(), MTree::split_function_type(nonRandomPromotion));
+		tree.set_insertion_mode(MTree::BOUNDED_INSERTION);
+		for(size_t i = 0; i < order.size(); ++i) {
+			MTree& target = ((i + 1) % 4 == 0) ? tree : other;
+			target.add(order[i]);
+		}
+		tree.merge(std::move(other));
+		tree._check();
+		assertEqual(tree.size(), allData.size());
+	}
+
+	void testLocator() {
+		mtree.enable_locator();
+		_test("fLots");
+		assert(!mtree.remove({-1, -1}));
+
+		// Enabling it on a populated M-Tree, and merging other M-Trees into it
+		vector<Data> order = addedData(Fixture::load("fLots"));
+		MTreeTest tree;
+		MTreeTest other;
+		for(size_t i = 0; i < order.size(); ++i) {
+			(i % 3 == 0 ? other : tree).add(order[i]);
+		}
+		tree.enable_locator();
+		tree._check();
+		tree.merge(std::move(other));
+		tree._check();
+
+		for(vector<Data>::const_iterator i = order.begin(); i != order.end(); ++i) {
+			assert(tree.remove(*i));
+		}
+		assert(tree.empty());
+
+		// It cannot be combined with snapshots
+		bool thrown = false;
+		try {
+			tree.enable_snapshots();
+		} catch(logic_error&) {
+			thrown = true;
+		}
+		assert(thrown);
+		tree.enable_locator(false);
+		tree.enable_snapshots();
+		thrown = false;
+		try {
+			tree.enable_locator();
+		} catch(logic_error&) {
+			thrown = true;
+		}
+		assert(thrown);
+
+		// Nor can snapshots be toggled while a query is alive
+		tree.add({1, 2});
+		{
+			MTreeTest::query query = tree.get_nearest_by_limit({1, 2}, 1);
+			thrown = false;
+			try {
+				tree.enable_snapshots(false);
+			} catch(logic_error&) {
+				thrown = true;
+			}
+			assert(thrown);
+		}
+		tree.enable_snapshots(false);
+	}
+
+	void testRemoveBatch() {
+		vector<Data> data = addedData(Fixture::load("fLots"));
+
+		for(int mode = 0; mode < 3; ++mode) {
+			MTreeTest tree;
+			if(mode == 1) {
+				tree.enable_locator();
+			} else if(mode == 2) {
+				tree.enable_snapshots();
+			}
+			for(vector<Data>::const_iterator i = data.begin(); i != data.end(); ++i) {
+				tree.add(*i);
+			}
+			MTreeTest::query snapshot = tree.get_nearest_by_limit(data[0], data.size());
+
+			// Half of the data objects, plus some not indexed
+			vector<Data> victims;
+			for(size_t i = 0; i < data.size(); i += 2) {
+				victims.push_back(data[i]);
+			}
+			victims.push_back({-1, -1});
+			assertEqual(tree.remove_batch(victims.begin(), victims.end()), (data.size() + 1) / 2);
+			tree._check();
+			assertEqual(tree.size(), data.size() / 2);
+			for(size_t i = 0; i < data.size(); ++i) {
+				MTreeTest::query query = tree.get_nearest_by_limit(data[i], 1);
+				assertEqual((query.begin()->data == data[i]), (i % 2 == 1));
+			}
+
+			auto predicate = [](const Data& d) { return d[0] % 3 == 0; };
+			size_t expected = tree.size();
+			for(size_t i = 1; i < data.size(); i += 2) {
+				expected -= predicate(data[i]);
+			}
+			size_t sizeBefore = tree.size();
+			assertEqual(tree.remove_if(predicate), sizeBefore - expected);
+			tree._check();
+			assertEqual(tree.size(), expected);
+			assertEqual(tree.remove_if(predicate), 0U);
+
+			assertEqual(tree.remove_batch(data.begin(), data.end()), expected);
+			assert(tree.empty());
+
+			if(mode == 2) {
+				// The query started before the removals is unaffected
+				size_t count = 0;
+				for(MTreeTest::query::iterator i = snapshot.begin(); i != snapshot.end(); ++i) {
+					++count;
+				}
+				assertEqual(count, data.size());
+			}
+		}
+	}
+
+
+	void testUpdate() {
+		vector<Data> data = addedData(Fixture::load("fLots"));
+
+		for(int mode = 0; mode < 4; ++mode) {
+			MTreeTest tree;
+			if(mode == 1) {
+				tree.enable_locator();
+			} else if(mode == 2) {
+				tree.enable_snapshots();
+			} else if(mode == 3) {
+				tree.enable_tombstones();
+			}
+			set<Data> indexed(data.begin(), data.end());
+			for(vector<Data>::const_iterator i = data.begin(); i != data.end(); ++i) {
+				tree.add(*i);
+			}
+			assert(!tree.update({-1, -1}, {-2, -2}));
+
+			// Small moves and then large ones
+			for(int delta : { 1, -3, 500, -1000 }) {
+				for(vector<Data>::iterator i = data.begin(); i != data.end(); ++i) {
+					Data moved = *i;
+					moved[0] += delta;
+					if(indexed.count(moved) > 0) {
+						continue;
+					}
+					bool updated = tree.update(*i, moved);
+					assert(updated);
+					tree._check();
+					indexed.erase(*i);
+					indexed.insert(moved);
+					*i = moved;
+				}
+				assertEqual(tree.size(), indexed.size());
+
+				MTreeTest::query query = tree.get_nearest_by_limit(data[0], indexed.size());
+				set<Data> results;
+				for(MTreeTest::query::iterator r = query.begin(); r != query.end(); ++r) {
+					results.insert(r->data);
+				}
+				assert(results == indexed);
+			}
+		}
+	}
+
+	void testTombstones() {
+		mtree.enable_tombstones();
+		_test("fLots");
+		assert(mtree.tombstone_count() > 0);
+
+		// Incremental compaction
+		size_t tombstoneCount = mtree.tombstone_count();
+		while(size_t compacted = mtree.compact(5)) {
+			tombstoneCount -= compacted;
+			assertEqual(mtree.tombstone_count(), tombstoneCount);
+			mtree._check();
+		}
+		assertLessEqual(double(tombstoneCount), 0.25 * (tombstoneCount + mtree.size()));
+		assertEqual(mtree.size(), allData.size());
+
+		mtree.enable_tombstones(false);
+		mtree._check();
+		assertEqual(mtree.tombstone_count(), 0U);
+		assertEqual(mtree.size(), allData.size());
+		_checkNearestByRange(*allData.begin(), 100);
+
+		Test located;
+		located.mtree.enable_locator();
+		located.mtree.enable_tombstones();
+		located._test("fLots");
+		located.mtree.compact();
+		located.mtree._check();
+
+		// The other kinds of queries skip the tombstones
+		Test knn;
+		knn.mtree.enable_tombstones();
+		knn.testAllKnn();
+		assert(knn.mtree.tombstone_count() > 0);
+
+		Test count;
+		count.mtree.enable_tombstones(true, 1.0);
+		count.testCountInRange();
+		assert(count.mtree.tombstone_count() > 0);
+		assertEqual(count.mtree.compact(), 0U);
+	}
+
+	void testConcurrentCompaction() {
+		vector<Data> order = addedData(Fixture::load("fLots"));
+		allData.insert(order.begin(), order.end());
+
+		mtree.enable_snapshots();
+		mtree.enable_tombstones(true, 0.0);
+		for(size_t i = 0; i < order.size(); ++i) {
+			mtree.add(order[i]);
+		}
+		for(size_t i = 0; i < order.size(); i += 2) {
+			assert(mtree.remove(order[i]));
+			allData.erase(order[i]);
+		}
+
+		thread compactor([&]() {
+			while(mtree.compact(3) > 0) {
+			}
+		});
+
+		// Every version of the M-Tree has the same data objects
+		for(size_t n = 0; n < 200; ++n) {
+			const Data& queryData = order[n % order.size()];
+			MTreeTest::query query = mtree.get_nearest_by_limit(queryData, allData.size() + 1);
+			size_t count = 0;
+			for(MTreeTest::query::iterator i = query.begin(); i != query.end(); ++i, ++count) {
+				assertIn(i->data, allData);
+			}
+			assertEqual(count, allData.size());
+		}
+
+		compactor.join();
+		mtree._check();
+		assertEqual(mtree.tombstone_count(), 0U);
+		assertEqual(mtree.size(), allData.size());
+	}
+
+
 private:
 	typedef vector<MTreeTest::query::result_item> ResultsVector;
 
@@ -327,6 +1598,45 @@ private:
 	set<Data> allData;
 
 
+	/*
+	 * Applies the actions of the "fLots" fixture to mtree and allData, without
+	 * its removals unless replayRemovals is true, and returns it for its
+	 * queries.
+	 */
+	Fixture loadLots(bool replayRemovals = false) {
+		Fixture fixture = Fixture::load("fLots");
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(i->cmd == 'A'  ||  replayRemovals) {
+				applyAction(*i);
+			}
+		}
+		return fixture;
+	}
+
+
+	void applyAction(const Fixture::Action& action) {
+		if(action.cmd == 'A') {
+			allData.insert(action.data);
+			mtree.add(action.data);
+		} else {
+			allData.erase(action.data);
+			mtree.remove(action.data);
+		}
+	}
+
+
+	// The data objects added by a fixture, in order
+	static vector<Data> addedData(const Fixture& fixture) {
+		vector<Data> data;
+		for(vector<Fixture::Action>::const_iterator i = fixture.actions.begin(); i != fixture.actions.end(); ++i) {
+			if(i->cmd == 'A') {
+				data.push_back(i->data);
+			}
+		}
+		return data;
+	}
+
+
 	void _test(const char* fixtureName) {
 		Fixture fixture = Fixture::load(fixtureName);
 		_testFixture(fixture);
@@ -346,6 +1656,9 @@ private:
 				assert(removed);
 				break;
 			}
+			case 'Q':
+				// Only queries
+				break;
 			default:
 				cerr << i->cmd << endl;
 				assert(false);
@@ -471,11 +1784,38 @@ int main() {
 	RUN_TEST(test19);
 	RUN_TEST(test20);
 	RUN_TEST(testLots);
+	RUN_TEST(testFarthestPairPromotion);
 	RUN_TEST(testRemoveNonExisting);
 	RUN_TEST(testGeneratedCase01);
 	RUN_TEST(testGeneratedCase02);
+	RUN_TEST(testMixedWorkload);
 	RUN_TEST(testNotRandom);
 	RUN_TEST(testIterators);
+	RUN_TEST(testQueryContext);
+	RUN_TEST(testQueryStats);
+	RUN_TEST(testBuildStats);
+	RUN_TEST(testStatistics);
+	RUN_TEST(testCostModel);
+	RUN_TEST(testScan);
+	RUN_TEST(testResultCache);
+	RUN_TEST(testFilteredQuery);
+	RUN_TEST(testTuner);
+	RUN_TEST(testForEachInRange);
+	RUN_TEST(testCountInRange);
+	RUN_TEST(testJoins);
+	RUN_TEST(testAllKnn);
+	RUN_TEST(testSnapshots);
+	RUN_TEST(testConcurrentSnapshots);
+	RUN_TEST(testConcurrentWrites);
+	RUN_TEST(testParallelQuery);
+	RUN_TEST(testForest);
+	RUN_TEST(testMerge);
+	RUN_TEST(testInsertionModes);
+	RUN_TEST(testLocator);
+	RUN_TEST(testRemoveBatch);
+	RUN_TEST(testUpdate);
+	RUN_TEST(testTombstones);
+	RUN_TEST(testConcurrentCompaction);
 #undef RUN_TEST
 
 	cout << "DONE" << endl;
@@ -49,7 +49,10 @@ public:
 	}
 
 	static Fixture load(const std::string& fixtureName) {
-		std::string fixtureFileName = path(fixtureName);
+		return loadFile(path(fixtureName));
+	}
+
+	static Fixture loadFile(const std::string& fixtureFileName) {
 		std::ifstream fixtureFile(fixtureFileName);
 		assert(fixtureFile);
 
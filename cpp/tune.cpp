@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "word-distance.h"
+#include "mtree_tuner.h"
+
+using namespace std;
+
+
+/*
+ * Recommends the node capacity and the split policy of an M-Tree of words,
+ * from a sample of a dictionary and queries by other words of it.
+ *
+ * Usage: tune [--dict FILE] [--sample N] [--queries N] [--limit N]
+ *             [--threads N] [--max-memory BYTES] [--max-build-seconds S]
+ *             [--minimize distances|time]
+ */
+
+
+typedef size_t (*WordDistanceFunction)(string, string);
+typedef mt::mtree_tuner<string, WordDistanceFunction> Tuner;
+typedef mt::functions::split_function<mt::functions::random_promotion, mt::functions::balanced_partition> RandomSplit;
+typedef mt::functions::split_function<mt::functions::farthest_pair_promotion, mt::functions::balanced_partition> FarthestPairSplit;
+
+enum {
+	DEFAULT_SAMPLE = 20000,
+	DEFAULT_QUERIES = 200,
+	DEFAULT_LIMIT = 10,
+	SEED = 42,
+};
+
+
+void print(const char* label, const Tuner::result_type& result) {
+	cout <<      label
+	     << "\t" "splitPolicy"       "=" << result.split_policy
+	     << "\t" "minNodeCapacity"   "=" << result.min_node_capacity
+	     << "\t" "maxNodeCapacity"   "=" << result.max_node_capacity
+	     << "\t" "buildSeconds"      "=" << result.build_seconds
+	     << "\t" "memoryBytes"       "=" << result.memory_bytes
+	     << "\t" "distancesPerQuery" "=" << result.distances_per_query
+	     << "\t" "secondsPerQuery"   "=" << result.seconds_per_query
+	     << "\t" "feasible"          "=" << result.feasible
+	     << endl;
+}
+
+
+
+
+
+int main(int argc, const char* argv[]) {
+	const char* dictFile = "en.dic";
+	size_t sampleSize = DEFAULT_SAMPLE;
+	size_t numQueries = DEFAULT_QUERIES;
+	size_t limit = DEFAULT_LIMIT;
+	size_t numThreads = max(1u, thread::hardware_concurrency());
+	size_t maxMemory = 0;
+	double maxBuildSeconds = 0;
+	Tuner::objective_type objective = Tuner::MINIMIZE_DISTANCES;
+	for(int i = 1; i < argc; ++i) {
+		if(i + 1 < argc  &&  strcmp(argv[i], "--dict") == 0) {
+			dictFile = argv[++i];
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--sample") == 0) {
+			sampleSize = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--queries") == 0) {
+			numQueries = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--limit") == 0) {
+			limit = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--threads") == 0) {
+			numThreads = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--max-memory") == 0) {
+			maxMemory = strtoul(argv[++i], NULL, 10);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--max-build-seconds") == 0) {
+			maxBuildSeconds = atof(argv[++i]);
+		} else if(i + 1 < argc  &&  strcmp(argv[i], "--minimize") == 0) {
+			objective = (strcmp(argv[++i], "time") == 0) ? Tuner::MINIMIZE_TIME : Tuner::MINIMIZE_DISTANCES;
+		} else {
+			cerr << "Usage: " << argv[0] << " [--dict FILE] [--sample N] [--queries N] [--limit N]" << endl
+			     << "       [--threads N] [--max-memory BYTES] [--max-build-seconds S] [--minimize distances|time]" << endl;
+			return 1;
+		}
+	}
+
+	cerr << "Loading words..." << endl;
+	vector<string> words = loadWords(dictFile);
+	if(words.size() < 2) {
+		cerr << "Cannot load " << dictFile << endl;
+		return 1;
+	}
+
+	// The words which are not in the sample are the queries
+	shuffle(words.begin(), words.end(), mt19937(SEED));
+	sampleSize = min(sampleSize, words.size() / 2);
+	vector<string> sample(words.begin(), words.begin() + sampleSize);
+	vector<Tuner::query_type> queries;
+	for(size_t i = sampleSize; i < min(sampleSize + numQueries, words.size()); ++i) {
+		queries.push_back({ words[i], numeric_limits<double>::infinity(), limit });
+	}
+
+	Tuner tuner(sample, queries, wordDistance);
+	tuner.add_split_policy("random", RandomSplit());
+	tuner.add_split_policy("farthest-pair", FarthestPairSplit());
+	tuner.set_payload_size(wordPayloadSize);
+	if(maxMemory > 0) {
+		tuner.set_max_memory(maxMemory);
+	}
+	if(maxBuildSeconds > 0) {
+		tuner.set_max_build_seconds(maxBuildSeconds);
+	}
+	tuner.set_objective(objective);
+
+	cerr << "Evaluating with " << sample.size() << " words, " << queries.size() << " queries and " << numThreads << " thread(s)..." << endl;
+	vector<Tuner::result_type> results = tuner.evaluate(numThreads);
+	for(vector<Tuner::result_type>::const_iterator r = results.begin(); r != results.end(); ++r) {
+		print("CANDIDATE", *r);
+	}
+	print("RECOMMENDED", tuner.best(results));
+}
@@ -3,8 +3,11 @@
 
 
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include <ctime>
+#include <fstream>
+#include <vector>
 #include <unistd.h>
 #include <sys/times.h>
 #include "mtree.h"
@@ -43,19 +46,50 @@ size_t wordDistance(std::string word1, std::string word2) {
 }
 
 
+// Counts the calls to countingWordDistance()
+std::atomic<size_t> wordDistanceCount(0);
+
+// Like wordDistance(), for the tools which report the distances computed
+size_t countingWordDistance(std::string word1, std::string word2) {
+	++wordDistanceCount;
+	return wordDistance(word1, word2);
+}
+
+
 
 typedef mt::mtree<std::string, size_t(*)(std::string,std::string)> MTree;
 class WordMTree : public MTree {
 public:
 	WordMTree(WordMTree&&);
 
-	WordMTree(size_t minNodeCapacity = MTree::DEFAULT_MIN_NODE_CAPACITY)
-		: MTree(minNodeCapacity, -1, wordDistance)
+	WordMTree(size_t minNodeCapacity = MTree::DEFAULT_MIN_NODE_CAPACITY, MTree::distance_function_type distanceFunction = wordDistance)
+		: MTree(minNodeCapacity, -1, distanceFunction)
 		{}
 };
 
 
 
+// Loads the words of a dictionary file, skipping its comment lines
+std::vector<std::string> loadWords(const char* dictFile) {
+	std::ifstream f(dictFile);
+	std::vector<std::string> words;
+	std::string word;
+	while(getline(f, word)) {
+		if(!word.empty()  &&  word[0] != '%') {
+			words.push_back(word);
+		}
+	}
+	return words;
+}
+
+
+// The heap memory used by a word; short strings are stored inline
+size_t wordPayloadSize(const std::string& word) {
+	return (word.capacity() >= sizeof(std::string)) ? word.capacity() + 1 : 0;
+}
+
+
+
 class Timer {
 public:
 	struct Times {